@@ -1,17 +1,123 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <ctype.h>
+#include <stdint.h>
 #include <time.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#else
+#include <io.h>
+#endif
 
 #define MAX_NAME_LEN 50
 #define MAX_PASS_LEN 50
 #define ENCRYPTION_KEY 3
 #define START_HOUR 9
 #define END_HOUR 17
-#define APPOINTMENT_DURATION 30 // minutes
-#define MAX_APPOINTMENTS_PER_DAY ((END_HOUR - START_HOUR) * 60 / APPOINTMENT_DURATION)
-#define DATA_FILE "appointments.dat"
-#define USER_FILE "users.dat"
+#define APPOINTMENT_DURATION 30 // minutes; the standard visit, and the default start granularity
+#define SLOT_MINUTES 15 // resolution of the day bitmaps; lengths and granularities are multiples of it
+#define DAY_MINUTES ((END_HOUR - START_HOUR) * 60 + APPOINTMENT_DURATION) // a standard visit may start at END_HOUR:00
+#define SLOTS_PER_DAY (DAY_MINUTES / SLOT_MINUTES)
+#define STANDARD_SLOTS_PER_DAY (DAY_MINUTES / APPOINTMENT_DURATION) // standard visits that fit in a day
+#define ALL_SLOTS_MASK ((SlotMask)((((uint64_t)1) << SLOTS_PER_DAY) - 1))
+#define DAY_INDEX_INITIAL_CAPACITY 64
+#define MAX_BOOKING_YEARS 10 // how far ahead an appointment may be booked
+#define HORIZON_DAYS (MAX_BOOKING_YEARS * 366) // most days from today to the booking horizon
+#define FREE_TREE_INITIAL_DAYS 1024 // days from the base day covered at first, about three years
+#define NAME_INDEX_INITIAL_CAPACITY 64
+#define REPORT_INITIAL_MONTHS 64 // months covered at first, about five years
+#define REPORT_ILLNESS_INITIAL_CAPACITY 64
+#define REPORT_TOP_DAYS 10 // busiest days listed by the admin report
+#define REPORT_MAX_DAYS 100 // most a REPORT command lists
+#define REMINDER_WHEEL_BITS 6
+#define REMINDER_WHEEL_SLOTS (1 << REMINDER_WHEEL_BITS) // per level; one slot spans a whole lap of the level below
+#define REMINDER_WHEEL_LEVELS 4 // minutes, hours, days, months: about 32 years ahead
+#define REMINDER_MAX_LEADS 4
+#define REMINDER_MAX_LEAD (30 * 1440) // minutes; a month
+#define REMINDER_DEFAULT_LEADS "1440,60" // minutes before an appointment: a day and an hour
+#define REMINDER_PATH_LEN 256
+#define REMINDER_INITIAL_BUCKETS 1024
+#define REMINDER_TICK_SECONDS 20 // how often the server looks for reminders that fell due
+#define STRING_TABLE_INITIAL_CAPACITY 256
+#define STRING_CHUNK_BYTES 65536
+#define BATCH_LINE_LEN 512
+#define BATCH_MAX_TOKENS 20
+#define BATCH_OUTPUT_BUFFER (1 << 16)
+#define CSV_LINE_LEN 512
+#define CSV_FIELDS 6 // name, illness, date, time, length, doctor
+#define CSV_BUFFER (1 << 16) // stdio buffer of --import and --export
+#define CSV_INITIAL_ROWS 1024
+#define POOL_SLAB_OBJECTS 1024 // objects carved from each slab a pool allocates
+#define LOAD_MAX_THREADS 16
+#define LOAD_PARALLEL_MIN 65536 // records below which one thread loads them all, unless told otherwise
+#define LOAD_VERIFY_THREADS 4 // --verify-load uses at least this many, even on one core
+#define SKIP_MAX_LEVEL 16
+#define SKIP_BRANCHING 4 // on average one node in four is promoted a level
+#define DATA_FILE "appointments.db"
+#define USER_FILE "users.db"
+#define DOCTOR_FILE "doctors.db"
+#define LEGACY_DATA_FILE "appointments.dat" // raw struct dumps written by older versions
+#define LEGACY_USER_FILE "users.dat"
+#define JOURNAL_FILE "appointments.log"
+#define SNAPSHOT_TEMP_FILE "appointments.db.tmp"
+#define USER_TEMP_FILE "users.db.tmp"
+#define DOCTOR_TEMP_FILE "doctors.db.tmp"
+#define ARCHIVE_FILE_PATTERN "archive-%04d-%02d.db" // appointments that are over, one file per month
+#define ARCHIVE_PATH_LEN 32
+#define SERIES_FILE "series.db"
+#define SERIES_TEMP_FILE "series.db.tmp"
+#define SHARED_FILE "appointments.shm" // mapped by every process started with --shared
+#define APPOINTMENT_FILE_MAGIC 0x54505041u // "APPT" in a little-endian file
+#define USER_FILE_MAGIC 0x53525355u // "USRS"
+#define DOCTOR_FILE_MAGIC 0x53524344u // "DCRS"
+#define ARCHIVE_FILE_MAGIC 0x56484341u // "ACHV"
+#define SERIES_FILE_MAGIC 0x53524553u // "SERS"
+#define SHARED_FILE_MAGIC 0x4D485341u // "ASHM"
+#define SERIES_MAX_OCCURRENCES 256 // a bit each records whether it was cancelled
+#define SERIES_MAX_INTERVAL 365 // days between occurrences
+#define MAX_DOCTORS 0xFFFF // a doctor's number has 16 bits of the key
+#define DOCTOR_ANY (-1) // whichever doctor is free
+#define USER_TABLE_INITIAL_CAPACITY 64
+#define FILE_FORMAT_VERSION 1
+#define FILE_ENDIAN_MARK 0x01020304u
+#define JOURNAL_COMPACT_THRESHOLD 1024 // records before the log is folded into DATA_FILE
+#define COMMIT_WINDOW_DEFAULT 0 // microseconds a commit waits for others to share its fsync
+#define COMMIT_WINDOW_MAX 1000000
+#define SERVER_SOCKET "appointments.sock"
+#define SERVER_THREADS 8
+#define SERVER_BACKLOG 64 // accepted connections waiting for a worker
+#define DAY_LOCK_STRIPES 64 // days share a lock only when their keys hash alike
+#define LOADGEN_CLIENTS 8
+#define LOADGEN_REQUESTS 10000 // per client
+#define LOADGEN_DAYS 30 // bookings are spread over this many days
+#define BENCH_MIN_SIZE 1000
+#define BENCH_MAX_SIZE 1000000
+#define BENCH_PER_DAY 12
+#define BENCH_DOCTORS 32 // calendars enough for the largest size within the booking horizon
+#define BENCH_USERS 10000
+#define BENCH_SKEW 1.0 // Zipf exponent of how bookings spread over patients
+#define BENCH_SEARCHES 100000 // name lookups per size at most
+#define BENCH_FILE_REPEATS 3 // saves and loads timed per size
+#define BENCH_CSV_FILE "bench.csv"
+#define METRICS_SUB_BITS 4 // latency buckets per power of two are 2^this, so each is within 1/16
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_MAX_EXPONENT 36 // 2^36 ns, about 69 seconds; slower calls share the last bucket
+#define METRICS_BUCKETS ((METRICS_MAX_EXPONENT - METRICS_SUB_BITS + 2) * METRICS_SUB_BUCKETS)
+#define METRICS_FIRST_BOUND 10 // histogram bounds exported run from 2^10 ns (about 1 us) up
+#define METRICS_PATH_LEN 256
 
 // Date structure to track appointments across multiple days
 typedef struct date {
@@ -20,78 +126,991 @@ typedef struct date {
     int year;
 } Date;
 
+// Sort key of an appointment: dateKey() of its day in the high 32 bits, the
+// minute of the day in the next 16 and the doctor's number (0 for none) in
+// the low 16, so one compare orders two bookings
+typedef uint64_t AppointmentKey;
+
 // Node structure for appointment
 typedef struct appointment {
+    AppointmentKey key;
+    const char* name; // encrypted, interned in the store's string pool
+    const char* illness;
+    struct appointment* next;
+    uint16_t duration; // minutes
+} Appointment;
+
+// A booking as the user enters it; the store keeps it as an Appointment
+typedef struct bookingRequest {
+    char name[MAX_NAME_LEN]; // encrypted
+    char illness[MAX_NAME_LEN];
+    Date date;
+    int hour;
+    int minute;
+    int doctor; // 0 for none, or DOCTOR_ANY to take the first doctor free
+    int duration; // minutes, 0 for APPOINTMENT_DURATION
+} BookingRequest;
+
+// Occupancy bitmap for one day, one bit per SLOT_MINUTES from START_HOUR;
+// an appointment sets the run of bits its length covers
+typedef uint64_t SlotMask;
+
+_Static_assert(SLOTS_PER_DAY < 64, "a day's slots must fit in one SlotMask word with a bit to spare");
+
+typedef struct daySlots {
+    uint32_t key; // dateKey() of the day, 0 when the bucket is empty
+    uint32_t doctorCount; // entries in doctors
+    SlotMask booked; // appointments without a doctor
+    SlotMask* doctors; // doctors[i] is doctor i + 1's bitmap, side by side
+} DaySlots;
+
+// Fenwick tree of the slots booked on each day of one calendar, from the
+// index's base day on; days past its end have nothing booked
+typedef struct bookedTree {
+    uint32_t* sums; // 1-based; entry i sums days (i - lowbit(i), i] after the base
+    size_t days; // a power of two, 0 until the calendar's first booking
+} BookedTree;
+
+// Open-addressing hash table from date to that day's occupancy bitmap,
+// plus Fenwick trees of booked slot counts from a base day to the booking
+// horizon, one per calendar and one for all doctors together, so the next
+// day with room can be found without walking the calendar
+typedef struct daySlotIndex {
+    DaySlots* buckets;
+    size_t capacity; // always a power of two
+    size_t count;
+    BookedTree* trees; // trees[0] for appointments without a doctor, trees[d] for doctor d
+    size_t treeCount; // entries in trees
+    BookedTree anyDoctor; // every doctor's days added up; some doctor has room below their total
+    int32_t treeBase; // day number of tree entry 1, the day a tree was first used; 0 before
+} DaySlotIndex;
+
+// Skip list tower entry; the bottom level is the appointment list itself
+typedef struct skipIndex {
+    AppointmentKey key; // copy of node->key, so searches stay within the index
+    Appointment* node;
+    struct skipIndex* right;
+    struct skipIndex* down;
+} SkipIndex;
+
+// Header at the start of DATA_FILE and USER_FILE. Records follow it
+// back to back and never contain pointers, so a file can be mapped as is.
+typedef struct fileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t endianMark; // reads back differently on a machine of the other byte order
+    uint32_t recordSize;
+    uint64_t recordCount;
+    uint32_t nameLen; // MAX_NAME_LEN the records were written with
+    uint32_t passLen; // MAX_PASS_LEN the records were written with
+} FileHeader;
+
+// On-disk form of an appointment
+typedef struct appointmentRecord {
+    int32_t day;
+    int32_t month;
+    int32_t year;
+    int32_t hour;
+    int32_t minute;
+    char name[MAX_NAME_LEN];
+    char illness[MAX_NAME_LEN];
+    int32_t doctor; // not in files written before doctors existed
+    int32_t duration; // minutes; not in files written before lengths existed
+} AppointmentRecord;
+
+// Layouts of LEGACY_DATA_FILE and LEGACY_USER_FILE: the old in-memory
+// structs written out whole, including their next pointers
+typedef struct legacyAppointment {
     char name[MAX_NAME_LEN];
     char illness[MAX_NAME_LEN];
     int hour;
     int minute;
     Date date;
-    struct appointment* next;
-} Appointment;
+    void* next;
+} LegacyAppointment;
+
+typedef struct legacyUser {
+    char username[MAX_NAME_LEN];
+    char password[MAX_PASS_LEN];
+    int is_admin;
+    void* next;
+} LegacyUser;
+
+// A data file held in memory, mapped where the platform allows it
+typedef struct mappedFile {
+    void* base;
+    size_t size;
+    int mapped; // 1 if base came from mmap, 0 if it was read into the heap
+} MappedFile;
+
+// Slab of fixed-size objects; the objects follow the header
+typedef struct poolSlab {
+    struct poolSlab* next;
+    union { void* pointer; long double number; } align; // keeps objects aligned
+} PoolSlab;
+
+// Fixed-size object allocator: objects come from large slabs, released ones
+// are reused through a free list and everything goes back in one sweep
+typedef struct pool {
+    size_t objectSize;
+    PoolSlab* slabs;
+    void* freeList; // released objects, linked through their first word
+    char* cursor; // unused tail of the newest slab
+    char* limit;
+    size_t live;
+    size_t peak;
+    size_t reused; // allocations served from the free list
+    size_t slabBytes;
+} Pool;
+
+// Appointments booked under one (encrypted) name, in date and time order
+typedef struct nameEntry {
+    const char* name; // interned
+    Appointment** items;
+    size_t count;
+    size_t capacity;
+} NameEntry;
+
+// Block of interned strings laid end to end
+typedef struct stringChunk {
+    struct stringChunk* next;
+    size_t used;
+    char text[STRING_CHUNK_BYTES];
+} StringChunk;
+
+// Every distinct name and illness is stored once and shared by the
+// appointments that use it
+typedef struct stringPool {
+    const char** table; // open addressing, NULL for an empty bucket
+    size_t capacity; // always a power of two
+    size_t count;
+    StringChunk* chunks;
+    size_t bytes; // text held, terminators included
+} StringPool;
+
+// Secondary index on name: a hash table for exact lookups and the same
+// entries in name order for prefix queries
+typedef struct nameIndex {
+    NameEntry** table; // open addressing, NULL for an empty bucket
+    size_t tableCapacity; // always a power of two
+    NameEntry** sorted;
+    size_t count;
+    size_t sortedCapacity;
+} NameIndex;
+
+// Read position in one entry while merging prefix matches by date
+typedef struct nameCursor {
+    NameEntry* entry;
+    size_t position;
+} NameCursor;
+
+// Hands name search hits on, with series occurrences merged in by date
+typedef struct nameMerge {
+    Appointment* occurrences; // in key order
+    size_t count;
+    size_t next;
+    void (*visit)(const Appointment*, void*);
+    void* context;
+} NameMerge;
+
+// Outcomes of the store operations shared by the menus and batch mode
+enum {
+    RESULT_OK = 0,
+    RESULT_INVALID_SLOT,
+    RESULT_SLOT_TAKEN,
+    RESULT_NOT_FOUND,
+    RESULT_DUPLICATE,
+    RESULT_UNKNOWN_DOCTOR,
+    RESULT_INVALID_SERIES,
+    RESULT_BEYOND_HORIZON
+};
+
+// Operations timed when --metrics is given
+enum {
+    METRIC_ADD,
+    METRIC_DELETE,
+    METRIC_MODIFY,
+    METRIC_SEARCH,
+    METRIC_SLOTS,
+    METRIC_SAVE,
+    METRIC_LOAD,
+    METRIC_AUTHENTICATE,
+    METRIC_OPERATIONS
+};
+
+// Kinds of change recorded in the journal
+enum {
+    JOURNAL_ADD = 1,
+    JOURNAL_DELETE = 2,
+    JOURNAL_MODIFY = 3,
+    JOURNAL_SERIES_ADD = 4,
+    JOURNAL_SERIES_SKIP = 5, // one occurrence cancelled
+    JOURNAL_SERIES_END = 6,
+    JOURNAL_MOVE = 7 // new date, time or doctor; applied like a modify
+};
+
+// One fixed-size journal entry; the old key identifies the appointment a
+// delete or modify applies to, the remaining fields are its new contents.
+// Series records give the series' number and, when it is added, its rule.
+// A move of one occurrence of a series gives its number and the occurrence
+// in place of an old key.
+typedef struct journalRecord {
+    int op;
+    Date oldDate;
+    int oldHour;
+    int oldMinute;
+    char name[MAX_NAME_LEN];
+    char illness[MAX_NAME_LEN];
+    Date date;
+    int hour;
+    int minute;
+    int oldDoctor;
+    int doctor;
+    int duration;
+    int series;
+    int interval;
+    int occurrences;
+    int occurrence; // the one cancelled, for JOURNAL_SERIES_SKIP and a JOURNAL_MOVE out of a series
+} JournalRecord;
+
+// What saving has cost so far: bytes and fsyncs per kind of file
+typedef struct storageStats {
+    uint64_t changes; // appointments added, removed or modified
+    uint64_t logRecords; // journal records written
+    uint64_t logBytes;
+    uint64_t logSyncs; // fsyncs of the journal and of the directory for a new one
+    uint64_t commits; // changes that waited for their record to be on disk
+    uint64_t snapshots; // data files written and renamed into place
+    uint64_t snapshotBytes;
+    uint64_t snapshotSyncs; // fsyncs of snapshot files and of the directory after renaming
+    uint64_t archived; // past appointments moved out of DATA_FILE into the archives
+    uint64_t archiveBytes;
+    uint64_t archiveSyncs;
+    uint64_t caughtUp; // journal records other --shared processes wrote, applied here
+    uint64_t reloads; // full loads after another process folded the journal in
+} StorageStats;
+
+// Append-only log of changes made since DATA_FILE was last written.
+// Records are numbered as appended; a change is acknowledged once the
+// fsync that covers its number has finished.
+typedef struct journal {
+    FILE* file;
+    size_t records; // appended since the last compaction
+    int deferred; // count changes but leave writing to the next compaction (batch mode)
+    uint64_t appended; // records written in this session
+    uint64_t durable; // the first this many of them are known to be on disk
+    int syncing; // a commit's fsync is under way
+    int commitWindow; // microseconds a commit waits for others to share its fsync
+    StorageStats stats;
+} Journal;
+
+// Calls, failures and latencies of one kind of operation. The histogram is
+// HDR-style: exact up to METRICS_SUB_BUCKETS ns, then METRICS_SUB_BUCKETS
+// buckets per power of two, so any latency is known to within 1/16.
+typedef struct operationMetrics {
+    uint64_t calls;
+    uint64_t errors; // calls that failed or were refused
+    uint64_t totalNs;
+    uint64_t maxNs;
+    uint64_t buckets[METRICS_BUCKETS];
+} OperationMetrics;
+
+// Instrumentation shared by the store and the users. Only allocated when
+// --metrics is given, so otherwise a call pays one NULL check.
+typedef struct metrics {
+    OperationMetrics operations[METRIC_OPERATIONS];
+    char path[METRICS_PATH_LEN]; // written in Prometheus text on SIGUSR1 and at exit
+    uint64_t started; // clock reading when collection began
+} Metrics;
+
+// One reminder of one appointment. It sits in a slot of the timer wheel
+// and, by key, in a hash chain, so it can be dropped without a search.
+typedef struct reminder {
+    struct reminder* next; // in its slot
+    struct reminder* prev;
+    struct reminder* sameBucket;
+    AppointmentKey key;
+    int64_t due; // minutes since 1970 on the local clock
+    const char* name; // interned, encrypted
+    int32_t lead; // minutes before the appointment
+    uint8_t level; // REMINDER_WHEEL_LEVELS for the overflow list
+    uint8_t slot;
+} Reminder;
+
+struct appointmentStore;
+typedef void (*ReminderSink)(struct appointmentStore* store, const Reminder* reminder, void* context);
+
+// Hierarchical timer wheel of reminders. Level k has REMINDER_WHEEL_SLOTS
+// slots of REMINDER_WHEEL_SLOTS^k minutes; a reminder waits on the lowest
+// level it is less than a lap ahead on, and moves down when the clock
+// reaches the start of its slot. Adding and dropping one is O(1), and
+// moving the clock costs the slots it passes that hold reminders, however
+// many appointments are booked. Only allocated when --reminders is given.
+typedef struct reminderWheel {
+    Reminder* slots[REMINDER_WHEEL_LEVELS][REMINDER_WHEEL_SLOTS];
+    uint64_t occupied[REMINDER_WHEEL_LEVELS]; // a bit per slot that holds reminders
+    Reminder* overflow; // more than the wheel's reach ahead
+    Reminder** buckets; // by key
+    size_t bucketCount; // always a power of two
+    size_t count;
+    Pool pool;
+    int64_t now; // minutes since 1970; everything due up to here has been sent
+    int simulated; // set by the CLOCK command, after which real time no longer moves it
+    int leads[REMINDER_MAX_LEADS];
+    int leadCount;
+    ReminderSink deliver;
+    void* context;
+    FILE* log;
+    uint64_t delivered;
+} ReminderWheel;
+
+#ifndef _WIN32
+// Locks used when server threads share one store. The stripe of a date
+// serialises changes to that day; the structure lock guards everything
+// shared between days (skip list, name index, day table, pools).
+typedef struct storeLocks {
+    pthread_rwlock_t structure;
+    pthread_mutex_t days[DAY_LOCK_STRIPES];
+    pthread_mutex_t journal;
+    pthread_cond_t synced; // a commit's fsync has finished
+    pthread_mutex_t users;
+} StoreLocks;
+
+// Outside server mode, the thread that waits for the signals the server
+// collects in sigwait, so they are handled while the menus wait for input
+typedef struct signalWatcher {
+    pthread_t thread;
+    sigset_t signals;
+    struct appointmentStore* store;
+    struct userStore* users;
+    int wake; // one of signals, sent to make the thread look at stopping
+    int stopping; // read and written with __atomic builtins
+} SignalWatcher;
+
+// What processes started with --shared tell each other, in SHARED_FILE,
+// which each of them maps. The data itself stays in DATA_FILE and the
+// journal: a process catches up by applying the journal records added
+// since it last looked, and loads everything again only after the journal
+// was folded into DATA_FILE. Changed only under an fcntl lock on the file.
+typedef struct sharedState {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t generation; // bumped by every change a process makes
+    uint64_t epoch; // bumped each time the journal is folded in and restarted
+    uint64_t doctors; // doctors in DOCTOR_FILE
+    uint64_t users; // bumped each time USER_FILE is rewritten
+} SharedState;
+
+// One process's view of SHARED_FILE
+typedef struct sharedStore {
+    SharedState* state; // the mapping
+    int fd; // holds the lock
+    int depth; // nested lockSharedStore calls
+    int changed; // something to tell the others when the lock is released
+    uint64_t generation; // the last one this process caught up with
+    uint64_t epoch;
+    uint64_t users;
+} SharedStore;
+#endif
+
+// A doctor with a calendar of their own; also the on-disk record in DOCTOR_FILE
+typedef struct doctor {
+    char name[MAX_NAME_LEN];
+} Doctor;
+
+// Doctors in the order they were added; a doctor's number is its position plus one
+typedef struct doctorList {
+    Doctor* items;
+    size_t count;
+    size_t capacity;
+} DoctorList;
+
+// A recurring booking kept as one rule: occurrence k is interval * k days
+// after the first. Occurrences are worked out from the rule whenever a day
+// is looked at, never stored. Also the on-disk record in SERIES_FILE.
+typedef struct series {
+    int32_t id;
+    int32_t firstDay; // dayNumber() of the first occurrence
+    int32_t interval; // days between occurrences, 7 for weekly
+    int32_t occurrences;
+    int32_t hour;
+    int32_t minute;
+    int32_t duration; // minutes
+    int32_t doctor; // 0 for none
+    uint64_t skipped[SERIES_MAX_OCCURRENCES / 64]; // occurrences cancelled one at a time
+    char name[MAX_NAME_LEN]; // encrypted
+    char illness[MAX_NAME_LEN];
+} Series;
+
+// Series ordered by doctor, so those on one calendar sit together
+typedef struct seriesList {
+    Series* items;
+    size_t count;
+    size_t capacity;
+    int32_t lastId; // highest number given to a series
+} SeriesList;
+
+// What is booked on one day, over every calendar
+typedef struct dayReport {
+    uint32_t appointments;
+    uint32_t slots; // SLOT_MINUTES booked
+    uint32_t heapPosition; // place in the busiest-days heap, 0 when the day is not in it
+} DayReport;
+
+typedef struct monthReport {
+    uint32_t appointments;
+    uint32_t slots;
+} MonthReport;
+
+// Appointments for one illness, keyed by its interned encrypted text
+typedef struct illnessCount {
+    const char* illness; // NULL for an empty bucket
+    uint64_t appointments;
+} IllnessCount;
+
+// Occupancy and case-mix figures, adjusted by every appointment and series
+// occurrence that is added or removed so no report walks the bookings.
+// Days and months are arrays from the day the reports were first used to
+// the booking horizon, like the free-slot tree; bookings outside count in
+// the totals and illnesses only. The busiest days are a max-heap of day
+// numbers, so the top few are found without the others.
+typedef struct reports {
+    DayReport* days; // days[i] is day number firstDay + i
+    size_t dayCount; // days covered
+    int32_t firstDay;
+    MonthReport* months; // months[i] is i months after firstMonth
+    size_t monthCount;
+    int32_t firstMonth; // year * 12 + month - 1 of firstDay
+    int32_t* heap; // heap[1] is the busiest day
+    size_t heapSize;
+    size_t heapCapacity;
+    IllnessCount* illnesses;
+    size_t illnessCount;
+    size_t illnessCapacity; // always a power of two
+    uint64_t appointments;
+    uint64_t slots;
+} Reports;
 
-// Structure for user authentication
+// Appointment list together with the indexes kept in sync with it
+typedef struct appointmentStore {
+    Appointment* head; // sorted by date and time
+    SkipIndex levels[SKIP_MAX_LEVEL]; // sentinel at the start of each index level
+    int level; // number of index levels in use
+    size_t count;
+    uint32_t seed; // state of the tower height generator
+    DaySlotIndex slots;
+    NameIndex names;
+    StringPool strings;
+    DoctorList doctors;
+    SeriesList series;
+    Reports reports;
+    Journal journal;
+    Pool appointmentPool;
+    Pool indexPool; // SkipIndex entries
+    struct storeLocks* locks; // NULL unless the store is shared between threads
+    struct sharedStore* shared; // NULL unless the files are shared between processes (--shared)
+    Metrics* metrics; // NULL unless --metrics is given
+    ReminderWheel* reminders; // NULL unless --reminders is given
+    struct signalWatcher* watcher; // NULL unless a thread waits for signals (menus and batch mode)
+    int granularity; // minutes between bookable start times, 0 for APPOINTMENT_DURATION
+    int loadThreads; // threads that decode and index a load, 0 for one per core
+} AppointmentStore;
+
+// Structure for user authentication; also the on-disk record in USER_FILE
 typedef struct user {
     char username[MAX_NAME_LEN];
     char password[MAX_PASS_LEN];
-    int is_admin; // Flag to denote admin privileges
-    struct user* next;
+    int32_t is_admin; // Flag to denote admin privileges
 } User;
 
+// Users kept contiguously, with an open-addressing hash table on username
+typedef struct userStore {
+    User* users; // dense array in creation order
+    size_t count;
+    size_t capacity;
+    int32_t* table; // positions in users, -1 for an empty bucket
+    size_t tableCapacity; // always a power of two
+    int dirty; // added to since USER_FILE was written (batch mode)
+    StorageStats stats; // writes of USER_FILE
+    Metrics* metrics; // the store's, for sign-ins
+    struct sharedStore* shared; // the store's, with --shared
+} UserStore;
+
+#ifndef _WIN32
+// State shared by the threads of --serve. Connections wait in a ring until
+// a worker takes one; the queue lock also guards active.
+typedef struct server {
+    AppointmentStore* store;
+    UserStore* users;
+    int listener;
+    int queue[SERVER_BACKLOG];
+    size_t queueHead;
+    size_t queueCount;
+    int closed; // stopping: nothing more is queued or taken
+    int active[SERVER_THREADS]; // connection each worker is serving, -1 when idle
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+} Server;
+
+typedef struct serverWorker {
+    Server* server;
+    int id;
+    pthread_t thread;
+} ServerWorker;
+
+// One --loadgen connection and its tallies
+typedef struct loadClient {
+    const char* path;
+    int id;
+    int requests;
+    const Date* days;
+    unsigned int* slotWins; // successful bookings per slot, shared by all clients
+    size_t booked;
+    size_t rejected;
+    size_t failed; // errors other than a taken slot, and requests never answered
+    pthread_t thread;
+} LoadClient;
+#endif
+
+// Destination of the lines batch mode prints for matching appointments
+typedef struct matchPrinter {
+    FILE* out;
+    const AppointmentStore* store; // for doctor names
+} MatchPrinter;
+
+// Destination of the rows --export writes
+typedef struct csvWriter {
+    FILE* out;
+    const AppointmentStore* store; // for doctor names
+    char delimiter;
+} CsvWriter;
+
+// A row read by --import, with its line for error messages
+typedef struct importRow {
+    Appointment node;
+    size_t line;
+} ImportRow;
+
+// A row --import turned away, reported once every row has been looked at
+typedef struct importProblem {
+    size_t line;
+    const char* problem;
+} ImportProblem;
+
+// Reply text gathered while the store is locked, written once it is not
+typedef struct replyBuffer {
+    char* text;
+    size_t length;
+    size_t capacity;
+} ReplyBuffer;
+
+// One thread's share of the records of DATA_FILE being loaded
+typedef struct loadChunk {
+    const char* records;
+    size_t stride; // record size in the file
+    int hasDoctor;
+    int hasDuration;
+    Appointment* nodes; // every node; the chunk fills first to last - 1
+    size_t first;
+    size_t last;
+    int sorted; // its records were already in date and time order
+} LoadChunk;
+
+// One thread's share of the name index built by a bulk load: the names
+// whose interned pointer falls in its part, with their appointments
+typedef struct nameIndexPart {
+    Appointment* nodes;
+    size_t count;
+    int part;
+    int parts;
+    NameEntry** table; // open addressing on the name pointer
+    size_t capacity;
+    size_t entries;
+} NameIndexPart;
+
+// Shape of the synthetic data used by --bench
+typedef struct benchConfig {
+    size_t minSize; // appointments in the smallest and largest runs; each run is 10x the last
+    size_t maxSize;
+    int perDay;
+    int days; // 0 to derive from the size and perDay
+    int users; // distinct patients, also created as accounts
+    double skew; // 0 books every patient equally often
+    uint32_t seed;
+    int journal; // 1 to log every change as the menus do
+    int doctors; // 0 books the shared calendar
+    int metrics; // 1 to time every operation as --metrics does
+} BenchConfig;
+
+// Per-call timings of one operation at one size
+typedef struct benchSeries {
+    const char* name;
+    uint64_t* samples; // nanoseconds
+    size_t count;
+    size_t items; // records handled, when a call handles many
+} BenchSeries;
+
 // Function prototypes
 void clearInputBuffer();
 void encrypt(char* str);
 void decrypt(char* str);
-Appointment* createAppointment();
-void addAppointment(Appointment** head);
-void deleteAppointment(Appointment** head);
-void displayAppointments(Appointment* head);
-void searchAppointmentByName(Appointment* head);
-void modifyAppointment(Appointment** head);
-void saveAppointmentsToFile(Appointment* head);
-void loadAppointmentsFromFile(Appointment** head);
-User* createUser();
-void addUser(User** head);
-int authenticateUser(User* head, char* username, char* password, int* is_admin);
-void saveUsersToFile(User* head);
-void loadUsersFromFile(User** head);
-void adminMenu(Appointment** appointmentList, User** userList);
-void displayAvailableSlots(Appointment* head, Date date);
-void freeAppointmentList(Appointment** head);
-void freeUserList(User** head);
+int createAppointment(BookingRequest* details);
+void addAppointment(AppointmentStore* store);
+void deleteAppointment(AppointmentStore* store);
+void displayAppointments(AppointmentStore* store);
+void displayAppointmentsInRange(AppointmentStore* store);
+int bookAppointment(AppointmentStore* store, BookingRequest* details);
+int cancelAppointment(AppointmentStore* store, Date date, int hour, int minute, int doctor);
+int moveAppointment(AppointmentStore* store, Date oldDate, int oldHour, int oldMinute, int doctor,
+                    Date date, int hour, int minute, int newDoctor);
+int updateIllness(AppointmentStore* store, Date date, int hour, int minute, int doctor, const char* illness);
+void lockDays(AppointmentStore* store, uint32_t firstKey, uint32_t secondKey);
+void unlockDays(AppointmentStore* store, uint32_t firstKey, uint32_t secondKey);
+void lockAllDays(AppointmentStore* store);
+void unlockAllDays(AppointmentStore* store);
+void lockStore(AppointmentStore* store, int exclusive);
+void unlockStore(AppointmentStore* store);
+void lockUsers(AppointmentStore* store);
+void unlockUsers(AppointmentStore* store);
+int loadSharedStore(AppointmentStore* store, UserStore* users);
+void closeSharedStore(AppointmentStore* store, UserStore* users);
+void lockSharedStore(AppointmentStore* store);
+void unlockSharedStore(AppointmentStore* store);
+void refreshSharedStore(AppointmentStore* store);
+void markSharedChange(AppointmentStore* store);
+void lockSharedUsers(UserStore* users);
+void unlockSharedUsers(UserStore* users);
+void refreshSharedUsers(UserStore* users);
+const char* resultMessage(int result);
+void searchAppointmentByName(AppointmentStore* store);
+void modifyAppointment(AppointmentStore* store);
+int saveAppointmentsToFile(AppointmentStore* store);
+void loadAppointmentsFromFile(AppointmentStore* store);
+size_t archivePastAppointments(AppointmentStore* store, Date today);
+size_t queryArchive(Date from, Date to, void (*visit)(const Appointment*, void*), void* context);
+void displayArchivedAppointments(AppointmentStore* store);
+int createUser(User* newUser);
+int addUser(UserStore* users);
+int authenticateUser(UserStore* users, char* username, char* password, int* is_admin);
+void saveUsersToFile(UserStore* users);
+void loadUsersFromFile(UserStore* users);
+void adminMenu(AppointmentStore* appointments, UserStore* users);
+int registerDoctor(AppointmentStore* store, const char* name);
+int findDoctor(const AppointmentStore* store, const char* name);
+const char* doctorName(const AppointmentStore* store, int doctor);
+int chooseDoctor(AppointmentStore* store, int allowAny);
+void addDoctor(AppointmentStore* store);
+int saveDoctorsToFile(AppointmentStore* store);
+void loadDoctorsFromFile(AppointmentStore* store);
+void displayAvailableSlots(AppointmentStore* store, Date date, int doctor);
+int bookSeries(AppointmentStore* store, BookingRequest* details, int interval, int occurrences, int* id);
+int endSeries(AppointmentStore* store, int id);
+int seriesOccurrence(const Series* series, int32_t day);
+int isOccurrenceSkipped(const Series* series, int occurrence);
+void occurrenceAppointment(const Series* series, int occurrence, Appointment* appointment);
+Series* findOccurrence(AppointmentStore* store, int32_t day, int hour, int minute, int doctor, int* occurrence);
+SlotMask seriesSlots(AppointmentStore* store, int32_t day, int doctor);
+int saveSeriesToFile(AppointmentStore* store);
+void loadSeriesFromFile(AppointmentStore* store);
+void addRecurringAppointment(AppointmentStore* store);
+void displaySeries(AppointmentStore* store);
+void endRecurringAppointment(AppointmentStore* store);
+void freeAppointmentStore(AppointmentStore* store);
+void* poolAlloc(Pool* pool);
+void* poolAllocBlock(Pool* pool, size_t count);
+void poolFree(Pool* pool, void* object);
+void poolReleaseAll(Pool* pool);
+Appointment* allocateAppointment(AppointmentStore* store);
+void releaseAppointment(AppointmentStore* store, Appointment* appointment);
+SkipIndex* allocateIndex(AppointmentStore* store);
+void displayMemoryStatistics(AppointmentStore* store, UserStore* users);
+void displayStorageStatistics(AppointmentStore* store, UserStore* users);
+StorageStats readStorageStats(AppointmentStore* store);
+uint64_t operationStart(const Metrics* metrics);
+int recordOperation(Metrics* metrics, int operation, uint64_t started, int result);
+const char* operationName(int operation);
+void displayMetrics(AppointmentStore* store);
+void writeMetrics(AppointmentStore* store, UserStore* users, FILE* out);
+int writeMetricsFile(AppointmentStore* store, UserStore* users);
+int startMetrics(AppointmentStore* store, UserStore* users, const char* path);
+void closeMetrics(AppointmentStore* store, UserStore* users);
+void watchSignals(AppointmentStore* store, UserStore* users);
+void stopWatchingSignals(AppointmentStore* store);
+int startReminders(AppointmentStore* store, const char* path, const char* leads);
+void advanceReminders(AppointmentStore* store, int64_t until);
+void runDueReminders(AppointmentStore* store);
+void logReminder(AppointmentStore* store, const Reminder* reminder, void* context);
+void clearReminders(ReminderWheel* wheel);
+void closeReminders(AppointmentStore* store);
+int64_t currentMinute();
+void freeUserStore(UserStore* users);
+User* findUser(UserStore* users, const char* username);
+int insertUser(UserStore* users, const User* user);
 Date getDate();
+Date currentDate();
+int32_t horizonDay();
 int isDateValid(Date date);
+const char* dateProblem(Date date);
+const char* calendarProblem(Date date);
 int compareDate(Date date1, Date date2);
-int isSlotAvailable(Appointment* head, int hour, int minute, Date date);
+int isSlotAvailable(AppointmentStore* store, int hour, int minute, Date date, int doctor, int duration);
+SlotMask bookedSlots(AppointmentStore* store, Date date, int doctor);
+SlotMask freeStarts(AppointmentStore* store, Date date, int doctor, int duration);
+int firstFreeDoctor(AppointmentStore* store, Date date, int slot, int duration);
+uint32_t dateKey(Date date);
+int32_t dayNumber(Date date);
+Date dateFromDayNumber(int32_t day);
+AppointmentKey makeKey(Date date, int hour, int minute, int doctor);
+Date keyDate(AppointmentKey key);
+void keyTime(AppointmentKey key, int* hour, int* minute);
+int keyDoctor(AppointmentKey key);
+int slotIndex(int hour, int minute);
+int isDurationValid(int minutes);
+int bookingGranularity(const AppointmentStore* store);
+int bookableSlot(const AppointmentStore* store, int hour, int minute, int duration);
+SlotMask slotRun(int slot, int duration);
+int nextFreeGap(SlotMask* freeSlots, int* slot, int* slots);
+DaySlots* findDayEntry(DaySlotIndex* index, uint32_t key, int create);
+SlotMask* findDaySlots(DaySlotIndex* index, uint32_t key, int create);
+SlotMask* findDoctorSlots(DaySlotIndex* index, uint32_t key, int doctor, int create);
+void markSlot(AppointmentStore* store, Appointment* appointment, int booked);
+int findNextFreeSlot(AppointmentStore* store, Date from, int hour, int minute, int doctor, int duration,
+                     Date* date, int* slotHour, int* slotMinute);
+void freeDaySlotIndex(DaySlotIndex* index);
+void addToNameIndex(NameIndex* index, Appointment* appointment);
+void removeFromNameIndex(NameIndex* index, Appointment* appointment);
+size_t searchNameIndex(NameIndex* index, const char* query, int prefix,
+                       void (*visit)(const Appointment*, void*), void* context);
+size_t searchAppointments(AppointmentStore* store, const char* query, int prefix,
+                          void (*visit)(const Appointment*, void*), void* context);
+void freeNameIndex(NameIndex* index);
+const char* internString(StringPool* pool, const char* text);
+void freeStringPool(StringPool* pool);
+int compareAppointments(const Appointment* a, const Appointment* b);
+void trackAppointment(AppointmentStore* store, const Appointment* appointment, int delta);
+void trackOccurrence(AppointmentStore* store, const Series* series, int occurrence, int delta);
+void trackSeries(AppointmentStore* store, const Series* series, int delta);
+DayReport* dayReport(const Reports* reports, int32_t day);
+size_t busiestDays(const Reports* reports, size_t count, int32_t* days);
+void freeReports(Reports* reports);
+void displayReports(AppointmentStore* store);
+void storeInsert(AppointmentStore* store, Appointment* appointment);
+void storeRemove(AppointmentStore* store, Appointment* appointment);
+Appointment* storeFind(AppointmentStore* store, Date date, int hour, int minute, int doctor);
+size_t queryDateRange(AppointmentStore* store, Date from, Date to,
+                      void (*visit)(const Appointment*, void*), void* context);
+uint64_t journalAppend(AppointmentStore* store, int op, const Appointment* before, const Appointment* after);
+uint64_t journalAppendSeries(AppointmentStore* store, int op, const Series* series, int occurrence);
+uint64_t journalAppendOccurrenceMove(AppointmentStore* store, const Series* series, int occurrence,
+                                     const Appointment* before, const Appointment* after);
+void journalCommit(AppointmentStore* store, uint64_t sequence);
+size_t replayJournal(AppointmentStore* store, size_t first);
+void compactJournal(AppointmentStore* store);
+int saveSnapshot(AppointmentStore* store);
+void closeJournal(Journal* journal);
+void storeBulkLoad(AppointmentStore* store, Appointment* nodes, size_t count);
+void storeMerge(AppointmentStore* store, Appointment* nodes, size_t count);
+void buildNameIndex(NameIndex* index, Appointment* nodes, size_t count, int threads);
+int loadThreadCount(const AppointmentStore* store, size_t records);
+int verifyParallelLoad(AppointmentStore* store);
+int mapDataFile(const char* path, uint32_t magic, uint32_t recordSize, uint32_t minRecordSize,
+                MappedFile* file, const FileHeader** header);
+void unmapDataFile(MappedFile* file);
+int writeFileHeader(FILE* file, uint32_t magic, uint32_t recordSize, uint64_t recordCount);
+int syncFile(FILE* file);
+int syncDirectory();
+int commitFile(FILE* file, int written, const char* tempPath, const char* path, StorageStats* stats);
+int convertLegacyFiles();
+int executeCommand(AppointmentStore* store, UserStore* users, char* line, FILE* out);
+int runBatch(AppointmentStore* store, UserStore* users, const char* path);
+size_t importAppointments(AppointmentStore* store, FILE* input, FILE* report, size_t* rejected);
+size_t exportAppointments(AppointmentStore* store, FILE* output, char delimiter);
+int runImport(AppointmentStore* store, const char* path);
+int runExport(AppointmentStore* store, const char* path);
+int runServer(AppointmentStore* store, UserStore* users, const char* path);
+int runLoadGenerator(const char* path, int clients, int requests);
+int runBenchmark(int argc, char* argv[]);
 
-int main() {
-    Appointment* appointmentList = NULL;
-    User* userList = NULL;
+int main(int argc, char* argv[]) {
+    AppointmentStore appointments = {0};
+    UserStore users = {0};
     int choice, is_admin = 0;
     char username[MAX_NAME_LEN], password[MAX_PASS_LEN];
     
-    // Load existing data
-    loadAppointmentsFromFile(&appointmentList);
-    loadUsersFromFile(&userList);
+    const char* batchPath = NULL;
+    const char* socketPath = NULL;
+    const char* importPath = NULL;
+    const char* exportPath = NULL;
+    const char* program = argv[0];
+    const char* reminderPath = NULL;
+    const char* reminderLeads = REMINDER_DEFAULT_LEADS;
+    int verifyLoad = 0;
+    int sharedFiles = 0;
     
-    // If no users exist, create an admin account
-    if (userList == NULL) {
-        printf("No users found. Creating admin account.\n");
-        User* admin = (User*)malloc(sizeof(User));
-        if (admin == NULL) {
-            printf("Memory allocation failed.\n");
+    appointments.journal.commitWindow = COMMIT_WINDOW_DEFAULT;
+    
+    // Several terminals on one host may work on the same files at once
+    if (argc > 1 && strcmp(argv[1], "--shared") == 0) {
+        sharedFiles = 1;
+        argc--;
+        argv++;
+    }
+    
+    // Settings that apply to every mode come first, each with one value
+    while (argc > 2 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--granularity") == 0) {
+            // Start times may be spaced differently from the standard visit length
+            appointments.granularity = atoi(argv[2]);
+            if (!isDurationValid(appointments.granularity)) {
+                printf("The granularity must be a multiple of %d minutes, up to %d.\n", SLOT_MINUTES, DAY_MINUTES);
+                return 1;
+            }
+        } else if (strcmp(argv[1], "--commit-window") == 0) {
+            appointments.journal.commitWindow = atoi(argv[2]);
+            if (appointments.journal.commitWindow < 0 || appointments.journal.commitWindow > COMMIT_WINDOW_MAX) {
+                printf("The commit window must be between 0 and %d microseconds.\n", COMMIT_WINDOW_MAX);
+                return 1;
+            }
+        } else if (strcmp(argv[1], "--load-threads") == 0) {
+            // Threads that decode and index the data file at startup, 0 for one per core
+            appointments.loadThreads = atoi(argv[2]);
+            if (appointments.loadThreads < 0 || appointments.loadThreads > LOAD_MAX_THREADS) {
+                printf("The number of load threads must be between 0 and %d.\n", LOAD_MAX_THREADS);
+                return 1;
+            }
+        } else if (strcmp(argv[1], "--metrics") == 0) {
+            // Operation counts and latencies, written to this file on SIGUSR1 and at exit
+            if (!startMetrics(&appointments, &users, argv[2])) return 1;
+        } else if (strcmp(argv[1], "--reminders") == 0) {
+            // Reminders of upcoming appointments are appended to this file
+            reminderPath = argv[2];
+        } else if (strcmp(argv[1], "--reminder-leads") == 0) {
+            reminderLeads = argv[2];
+        } else {
+            break;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    
+    // Before the load, which schedules the reminders of what it reads
+    if (reminderPath != NULL && !startReminders(&appointments, reminderPath, reminderLeads)) return 1;
+    
+    if (argc > 1) {
+        if (strcmp(argv[1], "--convert-legacy") == 0 && argc == 2) {
+            return convertLegacyFiles() ? 0 : 1;
+        } else if (strcmp(argv[1], "--batch") == 0 && argc <= 3) {
+            batchPath = argc == 3 ? argv[2] : "-";
+        } else if (strcmp(argv[1], "--verify-load") == 0 && argc == 2) {
+            verifyLoad = 1;
+        } else if (strcmp(argv[1], "--import") == 0 && argc == 3) {
+            importPath = argv[2];
+        } else if (strcmp(argv[1], "--export") == 0 && argc == 3) {
+            exportPath = argv[2];
+        } else if (strcmp(argv[1], "--serve") == 0 && argc <= 3) {
+            socketPath = argc == 3 ? argv[2] : SERVER_SOCKET;
+        } else if (strcmp(argv[1], "--bench") == 0) {
+            return runBenchmark(argc - 2, argv + 2) ? 0 : 1;
+        } else if (strcmp(argv[1], "--loadgen") == 0 && argc <= 5) {
+            return runLoadGenerator(argc > 2 ? argv[2] : SERVER_SOCKET,
+                                    argc > 3 ? atoi(argv[3]) : LOADGEN_CLIENTS,
+                                    argc > 4 ? atoi(argv[4]) : LOADGEN_REQUESTS) ? 0 : 1;
+        } else {
+            printf("Usage: %s [--shared] [--granularity minutes] [--commit-window microseconds] [--load-threads n]\n"
+                   "       [--metrics file] [--reminders file] [--reminder-leads minutes,...]\n"
+                   "       [--convert-legacy | --verify-load | --batch [file|-] |\n"
+                   "       --import file|- | --export file|- |\n"
+                   "       --serve [socket] | --loadgen [socket [clients [requests]]] | --bench [option=value ...]]\n",
+                   program);
             return 1;
         }
+    }
+    
+    if (sharedFiles && socketPath != NULL) {
+        printf("--shared is for terminals working on the same files; --serve already shares one store.\n");
+        return 1;
+    }
+    
+    FILE* legacy = fopen(LEGACY_DATA_FILE, "rb");
+    FILE* current = fopen(DATA_FILE, "rb");
+    if (legacy != NULL && current == NULL) {
+        printf("Found %s in the old format. Run with --convert-legacy to import it.\n", LEGACY_DATA_FILE);
+    }
+    if (legacy != NULL) fclose(legacy);
+    if (current != NULL) fclose(current);
+    
+    // Load existing data, with --shared under the lock other processes change it under
+    if (sharedFiles) {
+        if (!loadSharedStore(&appointments, &users)) return 1;
+    } else {
+        loadAppointmentsFromFile(&appointments);
+    }
+    
+    if (verifyLoad) {
+        int ok = verifyParallelLoad(&appointments);
+        closeSharedStore(&appointments, &users);
+        closeMetrics(&appointments, &users);
+        closeReminders(&appointments);
+        closeJournal(&appointments.journal);
+        freeAppointmentStore(&appointments);
+        return ok ? 0 : 1;
+    }
+    
+    if (importPath != NULL || exportPath != NULL) {
+        // Imported rows go straight into the indexes, so other processes wait until they are saved
+        lockSharedStore(&appointments);
+        int ok = importPath != NULL ? runImport(&appointments, importPath) : runExport(&appointments, exportPath);
+        unlockSharedStore(&appointments);
+        closeSharedStore(&appointments, &users);
+        closeMetrics(&appointments, &users);
+        closeReminders(&appointments);
+        closeJournal(&appointments.journal);
+        freeAppointmentStore(&appointments);
+        return ok ? 0 : 1;
+    }
+    
+    loadUsersFromFile(&users);
+    
+    // If no users exist, create an admin account
+    if (users.count == 0) {
+        printf("No users found. Creating admin account.\n");
+        User admin;
         
-        strcpy(admin->username, "admin");
-        strcpy(admin->password, "admin123");
-        admin->is_admin = 1;
-        admin->next = NULL;
-        userList = admin;
-        saveUsersToFile(userList);
+        memset(&admin, 0, sizeof(admin));
+        strcpy(admin.username, "admin");
+        strcpy(admin.password, "admin123");
+        admin.is_admin = 1;
+        insertUser(&users, &admin);
+        saveUsersToFile(&users);
         printf("Admin account created. Username: admin, Password: admin123\n");
     }
     
+    if (batchPath != NULL) {
+        watchSignals(&appointments, &users);
+        int ok = runBatch(&appointments, &users, batchPath);
+        stopWatchingSignals(&appointments);
+        closeSharedStore(&appointments, &users);
+        closeMetrics(&appointments, &users);
+        closeReminders(&appointments);
+        closeJournal(&appointments.journal);
+        freeAppointmentStore(&appointments);
+        freeUserStore(&users);
+        return ok ? 0 : 1;
+    }
+    
+    if (socketPath != NULL) {
+        int ok = runServer(&appointments, &users, socketPath);
+        compactJournal(&appointments);
+        closeMetrics(&appointments, &users);
+        closeReminders(&appointments);
+        closeJournal(&appointments.journal);
+        freeAppointmentStore(&appointments);
+        freeUserStore(&users);
+        return ok ? 0 : 1;
+    }
+    
+    watchSignals(&appointments, &users);
     while (1) {
         printf("\n===== APPOINTMENT SYSTEM =====\n");
         printf("1. Sign Up\n");
@@ -99,7 +1118,8 @@ int main() {
         printf("3. Exit\n");
         printf("Enter your choice: ");
         
-        if (scanf("%d", &choice) != 1) {
+        int read = scanf("%d", &choice);
+        if (read != 1) {
             printf("Invalid input. Please enter a number.\n");
             clearInputBuffer();
             continue;
@@ -107,8 +1127,9 @@ int main() {
         
         switch (choice) {
             case 1:
-                addUser(&userList);
-                saveUsersToFile(userList);
+                if (addUser(&users)) {
+                    saveUsersToFile(&users);
+                }
                 break;
                 
             case 2:
@@ -118,11 +1139,11 @@ int main() {
                 printf("Enter password: ");
                 scanf("%s", password);
                 
-                if (authenticateUser(userList, username, password, &is_admin)) {
+                if (authenticateUser(&users, username, password, &is_admin)) {
                     printf("Login successful!\n");
                     
                     if (is_admin) {
-                        adminMenu(&appointmentList, &userList);
+                        adminMenu(&appointments, &users);
                     } else {
                         // Regular user menu
                         while (1) {
@@ -132,10 +1153,14 @@ int main() {
                             printf("3. Cancel an appointment\n");
                             printf("4. Modify an appointment\n");
                             printf("5. View available slots\n");
-                            printf("6. Log out\n");
+                            printf("6. Book a recurring appointment\n");
+                            printf("7. End a recurring appointment\n");
+                            printf("8. Log out\n");
                             printf("Enter your choice: ");
                             
-                            if (scanf("%d", &choice) != 1) {
+                            int read = scanf("%d", &choice);
+                            refreshSharedStore(&appointments);
+                            if (read != 1) {
                                 printf("Invalid input. Please enter a number.\n");
                                 clearInputBuffer();
                                 continue;
@@ -143,36 +1168,40 @@ int main() {
                             
                             switch (choice) {
                                 case 1:
-                                    addAppointment(&appointmentList);
-                                    saveAppointmentsToFile(appointmentList);
+                                    addAppointment(&appointments);
                                     break;
                                 case 2:
-                                    displayAppointments(appointmentList);
+                                    displayAppointments(&appointments);
                                     break;
                                 case 3:
-                                    deleteAppointment(&appointmentList);
-                                    saveAppointmentsToFile(appointmentList);
+                                    deleteAppointment(&appointments);
                                     break;
                                 case 4:
-                                    modifyAppointment(&appointmentList);
-                                    saveAppointmentsToFile(appointmentList);
+                                    modifyAppointment(&appointments);
                                     break;
                                 case 5:
                                     {
                                         Date date = getDate();
                                         if (isDateValid(date)) {
-                                            displayAvailableSlots(appointmentList, date);
+                                            int doctor = chooseDoctor(&appointments, 1);
+                                            displayAvailableSlots(&appointments, date, doctor);
                                         }
                                     }
                                     break;
                                 case 6:
+                                    addRecurringAppointment(&appointments);
+                                    break;
+                                case 7:
+                                    endRecurringAppointment(&appointments);
+                                    break;
+                                case 8:
                                     printf("Logging out...\n");
                                     break;
                                 default:
                                     printf("Invalid choice. Please try again.\n");
                             }
                             
-                            if (choice == 6) break;
+                            if (choice == 8) break;
                         }
                     }
                 } else {
@@ -182,9 +1211,15 @@ int main() {
                 
             case 3:
                 printf("Thank you for using the Appointment System.\n");
-                // Free memory before exiting
-                freeAppointmentList(&appointmentList);
-                freeUserList(&userList);
+                // Fold the journal into the data file and free memory before exiting
+                compactJournal(&appointments);
+                stopWatchingSignals(&appointments);
+                closeSharedStore(&appointments, &users);
+                closeMetrics(&appointments, &users);
+                closeReminders(&appointments);
+                closeJournal(&appointments.journal);
+                freeAppointmentStore(&appointments);
+                freeUserStore(&users);
                 return 0;
                 
             default:
@@ -214,100 +1249,114 @@ void decrypt(char* str) {
     }
 }
 
-Appointment* createAppointment() {
-    Appointment* newAppointment = (Appointment*)malloc(sizeof(Appointment));
-    if (newAppointment == NULL) {
-        printf("Memory allocation failed.\n");
-        exit(EXIT_FAILURE);
-    }
+int createAppointment(BookingRequest* details) {
+    memset(details, 0, sizeof(*details));
     
     printf("Enter your name: ");
-    scanf("%s", newAppointment->name);
-    encrypt(newAppointment->name);
+    scanf("%s", details->name);
+    encrypt(details->name);
     
     printf("Enter what you are suffering from: ");
-    scanf("%s", newAppointment->illness);
-    encrypt(newAppointment->illness);
+    scanf("%s", details->illness);
+    encrypt(details->illness);
     
     // Get date for the appointment
-    newAppointment->date = getDate();
-    if (!isDateValid(newAppointment->date)) {
-        free(newAppointment);
-        return NULL;
-    }
+    details->date = getDate();
+    return isDateValid(details->date);
+}
+
+// Prompts until a valid appointment length is given
+static int getDuration() {
+    int duration;
     
-    newAppointment->next = NULL;
-    return newAppointment;
+    while (1) {
+        printf("Enter the length of the appointment in minutes (a multiple of %d; %d for a standard visit): ",
+               SLOT_MINUTES, APPOINTMENT_DURATION);
+        if (scanf("%d", &duration) == 1 && isDurationValid(duration)) return duration;
+        printf("Invalid length. Appointments last a multiple of %d minutes, up to %d.\n", SLOT_MINUTES, DAY_MINUTES);
+        clearInputBuffer();
+    }
 }
 
-void addAppointment(Appointment** head) {
-    Appointment* newAppointment = createAppointment();
-    if (newAppointment == NULL) return;
+void addAppointment(AppointmentStore* store) {
+    BookingRequest newAppointment;
+    if (!createAppointment(&newAppointment)) return;
     
-    // Show available slots
-    printf("\nAvailable slots for the selected date:\n");
-    displayAvailableSlots(*head, newAppointment->date);
+    // Without doctors there is one shared calendar, as before
+    newAppointment.doctor = chooseDoctor(store, 1);
+    newAppointment.duration = getDuration();
     
-    // Get time slot from user
+    // Offer the earliest free slot, moving to a later day if this one is full
+    Date nextDate;
     int hour, minute, validSlot = 0;
+    if (findNextFreeSlot(store, newAppointment.date, START_HOUR, 0, newAppointment.doctor, newAppointment.duration,
+                         &nextDate, &hour, &minute) &&
+        compareDate(nextDate, newAppointment.date) != 0) {
+        printf("No slots are free on %02d/%02d/%04d. The earliest free slot is %02d/%02d/%04d at %02d:%02d.\n",
+               newAppointment.date.day, newAppointment.date.month, newAppointment.date.year,
+               nextDate.day, nextDate.month, nextDate.year, hour, minute);
+        printf("Book that slot instead? (1 for Yes, 0 for No): ");
+        int confirm;
+        if (scanf("%d", &confirm) != 1 || !confirm) {
+            printf("Booking cancelled.\n");
+            return;
+        }
+        
+        newAppointment.date = nextDate;
+        validSlot = 1;
+    } else {
+        // Show available slots
+        printf("\nAvailable slots for the selected date:\n");
+        displayAvailableSlots(store, newAppointment.date, newAppointment.doctor);
+    }
     
+    // Get time slot from user
     while (!validSlot) {
-        printf("Enter preferred hour (9-17): ");
+        printf("Enter preferred hour (%d-%d): ", START_HOUR, END_HOUR);
         scanf("%d", &hour);
         
-        printf("Enter preferred minute (0 or 30): ");
+        printf("Enter preferred minute: ");
         scanf("%d", &minute);
         
-        if (hour < START_HOUR || hour > END_HOUR || (minute != 0 && minute != 30)) {
-            printf("Invalid time slot. Please choose a time between 9:00 and 17:30 (30-minute intervals).\n");
+        if (bookableSlot(store, hour, minute, newAppointment.duration) < 0) {
+            printf("Invalid time slot. Appointments start every %d minutes from %02d:00 and end by %02d:%02d.\n",
+                   bookingGranularity(store), START_HOUR, START_HOUR + DAY_MINUTES / 60, DAY_MINUTES % 60);
             continue;
         }
         
-        if (isSlotAvailable(*head, hour, minute, newAppointment->date)) {
+        if (isSlotAvailable(store, hour, minute, newAppointment.date, newAppointment.doctor, newAppointment.duration)) {
             validSlot = 1;
         } else {
-            printf("The selected slot is already booked. Please choose another time.\n");
+            printf("The selected time overlaps another appointment. Please choose another time.\n");
         }
     }
     
-    newAppointment->hour = hour;
-    newAppointment->minute = minute;
+    newAppointment.hour = hour;
+    newAppointment.minute = minute;
     
-    // Add appointment to list (sorted by date and time)
-    if (*head == NULL || 
-        (compareDate(newAppointment->date, (*head)->date) < 0) || 
-        (compareDate(newAppointment->date, (*head)->date) == 0 && 
-         (newAppointment->hour < (*head)->hour || 
-          (newAppointment->hour == (*head)->hour && newAppointment->minute < (*head)->minute)))) {
-        newAppointment->next = *head;
-        *head = newAppointment;
-    } else {
-        Appointment* current = *head;
-        
-        while (current->next != NULL && 
-              (compareDate(newAppointment->date, current->next->date) > 0 || 
-              (compareDate(newAppointment->date, current->next->date) == 0 && 
-               (newAppointment->hour > current->next->hour || 
-                (newAppointment->hour == current->next->hour && newAppointment->minute >= current->next->minute))))) {
-            current = current->next;
-        }
-        
-        newAppointment->next = current->next;
-        current->next = newAppointment;
+    // Add appointment to the store (sorted by date and time)
+    int result = bookAppointment(store, &newAppointment);
+    if (result != RESULT_OK) {
+        printf("%s.\n", resultMessage(result));
+        return;
     }
     
-    printf("Your appointment has been successfully booked for %02d/%02d/%04d at %02d:%02d\n", 
-           newAppointment->date.day, newAppointment->date.month, newAppointment->date.year,
-           newAppointment->hour, newAppointment->minute);
+    printf("Your appointment has been successfully booked for %02d/%02d/%04d at %02d:%02d for %d minutes", 
+           newAppointment.date.day, newAppointment.date.month, newAppointment.date.year,
+           newAppointment.hour, newAppointment.minute, newAppointment.duration);
+    if (newAppointment.doctor != 0) {
+        printf(" with %s", doctorName(store, newAppointment.doctor));
+    }
+    printf("\n");
 }
 
-void deleteAppointment(Appointment** head) {
-    if (*head == NULL) {
+void deleteAppointment(AppointmentStore* store) {
+    if (store->head == NULL && store->series.count == 0) {
         printf("No appointments to delete.\n");
         return;
     }
     
-    displayAppointments(*head);
+    displayAppointments(store);
     
     int day, month, year, hour, minute;
     printf("Enter the date (DD MM YYYY) of the appointment to delete: ");
@@ -316,6 +1365,7 @@ void deleteAppointment(Appointment** head) {
     printf("Enter the time (HH MM) of the appointment to delete: ");
     scanf("%d %d", &hour, &minute);
     
+    int doctor = chooseDoctor(store, 0);
     Date date = {day, month, year};
     
     // Confirm deletion
@@ -328,281 +1378,1022 @@ void deleteAppointment(Appointment** head) {
         return;
     }
     
-    Appointment* current = *head;
-    Appointment* previous = NULL;
-    
-    while (current != NULL) {
-        if (compareDate(current->date, date) == 0 && 
-            current->hour == hour && current->minute == minute) {
-            
-            if (previous == NULL) {
-                *head = current->next;
-            } else {
-                previous->next = current->next;
-            }
-            
-            free(current);
-            printf("Appointment successfully deleted.\n");
-            return;
-        }
-        
-        previous = current;
-        current = current->next;
+    if (cancelAppointment(store, date, hour, minute, doctor) != RESULT_OK) {
+        printf("Appointment not found.\n");
+        return;
     }
     
-    printf("Appointment not found.\n");
+    printf("Appointment successfully deleted.\n");
 }
 
-void displayAppointments(Appointment* head) {
-    if (head == NULL) {
-        printf("No appointments scheduled.\n");
-        return;
+// Books a copy of a filled-in appointment (encrypted name and illness,
+// date, time, doctor and length) if it overlaps nothing on its calendar. A
+// request for DOCTOR_ANY gets the first doctor free throughout, written back
+// into details, as is the default length.
+int bookAppointment(AppointmentStore* store, BookingRequest* details) {
+    uint64_t started = operationStart(store->metrics);
+    if (details->duration == 0) details->duration = APPOINTMENT_DURATION;
+    
+    int slot = bookableSlot(store, details->hour, details->minute, details->duration);
+    if (slot < 0) return recordOperation(store->metrics, METRIC_ADD, started, RESULT_INVALID_SLOT);
+    if (dayNumber(details->date) > horizonDay()) {
+        return recordOperation(store->metrics, METRIC_ADD, started, RESULT_BEYOND_HORIZON);
     }
     
-    printf("\n===== CURRENT APPOINTMENTS =====\n");
-    printf("%-20s %-20s %-12s %-10s\n", "Name", "Illness", "Date", "Time");
-    printf("---------------------------------------------------------------\n");
+    uint32_t key = dateKey(details->date);
     
-    Appointment* current = head;
-    char decryptedName[MAX_NAME_LEN];
-    char decryptedIllness[MAX_NAME_LEN];
+    // Holding the day's stripe keeps the check and the insert together;
+    // bookings for other days only wait for the short insert itself
+    lockDays(store, key, key);
     
-    while (current != NULL) {
-        strcpy(decryptedName, current->name);
-        strcpy(decryptedIllness, current->illness);
-        
-        decrypt(decryptedName);
-        decrypt(decryptedIllness);
-        
-        printf("%-20s %-20s %02d/%02d/%04d  %02d:%02d\n", 
-               decryptedName, decryptedIllness, 
-               current->date.day, current->date.month, current->date.year,
-               current->hour, current->minute);
-        
-        current = current->next;
+    lockStore(store, 0);
+    int doctor = details->doctor, result = RESULT_OK;
+    
+    if (doctor == DOCTOR_ANY) {
+        doctor = firstFreeDoctor(store, details->date, slot, details->duration);
+        if (doctor == 0) result = store->doctors.count == 0 ? RESULT_UNKNOWN_DOCTOR : RESULT_SLOT_TAKEN;
+    } else if (doctor < 0 || doctor > (int)store->doctors.count) {
+        result = RESULT_UNKNOWN_DOCTOR;
+    } else if (bookedSlots(store, details->date, doctor) & slotRun(slot, details->duration)) {
+        result = RESULT_SLOT_TAKEN; // Overlaps an appointment already booked
     }
-}
-
-void searchAppointmentByName(Appointment* head) {
-    if (head == NULL) {
-        printf("No appointments to search.\n");
-        return;
+    unlockStore(store);
+    
+    if (result != RESULT_OK) {
+        unlockDays(store, key, key);
+        return recordOperation(store->metrics, METRIC_ADD, started, result);
     }
     
-    char searchName[MAX_NAME_LEN];
-    printf("Enter the name to search for: ");
-    scanf("%s", searchName);
+    details->doctor = doctor;
     
-    encrypt(searchName); // Encrypt to match stored data
+    lockStore(store, 1);
+    Appointment* appointment = allocateAppointment(store);
+    appointment->key = makeKey(details->date, details->hour, details->minute, doctor);
+    appointment->name = internString(&store->strings, details->name);
+    appointment->illness = internString(&store->strings, details->illness);
+    appointment->next = NULL;
+    appointment->duration = (uint16_t)details->duration;
+    storeInsert(store, appointment);
+    Appointment after = *appointment;
+    unlockStore(store);
     
-    Appointment* current = head;
-    int found = 0;
+    uint64_t sequence = journalAppend(store, JOURNAL_ADD, NULL, &after);
+    unlockDays(store, key, key);
+    journalCommit(store, sequence);
+    return recordOperation(store->metrics, METRIC_ADD, started, RESULT_OK);
+}
+
+// Removes and frees the appointment booked at a date and time with a
+// doctor. One occurrence of a series is cancelled by marking it skipped.
+int cancelAppointment(AppointmentStore* store, Date date, int hour, int minute, int doctor) {
+    uint64_t started = operationStart(store->metrics);
+    uint32_t key = dateKey(date);
     
-    printf("\n===== SEARCH RESULTS =====\n");
+    lockDays(store, key, key);
+    lockStore(store, 1);
     
-    while (current != NULL) {
-        if (strcmp(current->name, searchName) == 0) {
-            char decryptedName[MAX_NAME_LEN];
-            char decryptedIllness[MAX_NAME_LEN];
-            
-            strcpy(decryptedName, current->name);
-            strcpy(decryptedIllness, current->illness);
-            
-            decrypt(decryptedName);
-            decrypt(decryptedIllness);
-            
-            printf("Name: %s\n", decryptedName);
-            printf("Illness: %s\n", decryptedIllness);
-            printf("Date: %02d/%02d/%04d\n", 
-                   current->date.day, current->date.month, current->date.year);
-            printf("Time: %02d:%02d\n\n", current->hour, current->minute);
-            
-            found = 1;
+    Appointment* current = storeFind(store, date, hour, minute, doctor);
+    if (current == NULL) {
+        int occurrence;
+        Series* series = findOccurrence(store, dayNumber(date), hour, minute, doctor, &occurrence);
+        if (series == NULL) {
+            unlockStore(store);
+            unlockDays(store, key, key);
+            return recordOperation(store->metrics, METRIC_DELETE, started, RESULT_NOT_FOUND);
         }
         
-        current = current->next;
+        trackOccurrence(store, series, occurrence, -1);
+        series->skipped[occurrence / 64] |= (uint64_t)1 << (occurrence % 64);
+        Series after = *series;
+        unlockStore(store);
+        
+        uint64_t sequence = journalAppendSeries(store, JOURNAL_SERIES_SKIP, &after, occurrence);
+        unlockDays(store, key, key);
+        journalCommit(store, sequence);
+        return recordOperation(store->metrics, METRIC_DELETE, started, RESULT_OK);
     }
     
-    if (!found) {
-        printf("No appointments found for '%s'.\n", searchName);
-    }
+    Appointment before = *current;
+    storeRemove(store, current);
+    releaseAppointment(store, current);
+    unlockStore(store);
+    
+    uint64_t sequence = journalAppend(store, JOURNAL_DELETE, &before, NULL);
+    unlockDays(store, key, key);
+    journalCommit(store, sequence);
+    return recordOperation(store->metrics, METRIC_DELETE, started, RESULT_OK);
 }
 
-void modifyAppointment(Appointment** head) {
-    if (*head == NULL) {
-        printf("No appointments to modify.\n");
-        return;
-    }
+// Why a booking of the given length on one calendar cannot move to a new
+// date, time and doctor, or RESULT_OK. Moving within its own day and
+// calendar may reuse the slots it already holds.
+static int moveProblem(AppointmentStore* store, Date oldDate, int oldHour, int oldMinute, int doctor, Date date,
+                       int hour, int minute, int newDoctor, int duration) {
+    if (newDoctor < 0 || newDoctor > (int)store->doctors.count) return RESULT_UNKNOWN_DOCTOR;
     
-    displayAppointments(*head);
+    int slot = bookableSlot(store, hour, minute, duration);
+    if (slot < 0) return RESULT_INVALID_SLOT;
+    if (dayNumber(date) > horizonDay()) return RESULT_BEYOND_HORIZON;
     
-    int day, month, year, hour, minute;
-    printf("Enter the date (DD MM YYYY) of the appointment to modify: ");
-    scanf("%d %d %d", &day, &month, &year);
+    SlotMask taken = bookedSlots(store, date, newDoctor);
+    int oldSlot = slotIndex(oldHour, oldMinute);
+    if (newDoctor == doctor && dateKey(date) == dateKey(oldDate) && oldSlot >= 0) {
+        taken &= ~slotRun(oldSlot, duration);
+    }
     
-    printf("Enter the time (HH MM) of the appointment to modify: ");
-    scanf("%d %d", &hour, &minute);
+    return taken & slotRun(slot, duration) ? RESULT_SLOT_TAKEN : RESULT_OK;
+}
+
+// Takes one occurrence of a series out of it and books it as an appointment
+// of its own at the new date, time and doctor; the rest of the series stays
+// as it is. The series list only changes under every stripe, so this takes
+// them all too.
+static int moveOccurrence(AppointmentStore* store, uint64_t started, Date oldDate, int oldHour, int oldMinute,
+                          int doctor, Date date, int hour, int minute, int newDoctor) {
+    lockAllDays(store);
     
-    Date date = {day, month, year};
+    lockStore(store, 0);
+    int occurrence, result = RESULT_NOT_FOUND;
+    Series* series = findOccurrence(store, dayNumber(oldDate), oldHour, oldMinute, doctor, &occurrence);
+    if (series != NULL) {
+        result = moveProblem(store, oldDate, oldHour, oldMinute, doctor, date, hour, minute, newDoctor,
+                             series->duration);
+    }
+    unlockStore(store);
     
-    Appointment* current = *head;
-    
-    while (current != NULL) {
-        if (compareDate(current->date, date) == 0 && 
-            current->hour == hour && current->minute == minute) {
-            
-            printf("\nCurrent appointment details:\n");
-            char decryptedName[MAX_NAME_LEN], decryptedIllness[MAX_NAME_LEN];
-            strcpy(decryptedName, current->name);
-            strcpy(decryptedIllness, current->illness);
-            decrypt(decryptedName);
-            decrypt(decryptedIllness);
-            
-            printf("Name: %s\n", decryptedName);
-            printf("Illness: %s\n", decryptedIllness);
-            printf("Date: %02d/%02d/%04d\n", 
-                   current->date.day, current->date.month, current->date.year);
-            printf("Time: %02d:%02d\n", current->hour, current->minute);
-            
-            printf("\nWhat would you like to modify?\n");
-            printf("1. Date and time\n");
-            printf("2. Illness details\n");
-            printf("3. Cancel modification\n");
-            
-            int choice;
-            printf("Enter your choice: ");
-            scanf("%d", &choice);
-            
-            switch (choice) {
-                case 1:
-                    printf("Enter new date (DD MM YYYY): ");
-                    scanf("%d %d %d", &day, &month, &year);
-                    current->date.day = day;
-                    current->date.month = month;
-                    current->date.year = year;
-                    
-                    printf("Enter new time (HH MM): ");
-                    scanf("%d %d", &hour, &minute);
-                    current->hour = hour;
-                    current->minute = minute;
-                    
-                    printf("Appointment rescheduled successfully.\n");
-                    break;
-                    
-                case 2:
-                    printf("Enter new illness details: ");
-                    char newIllness[MAX_NAME_LEN];
-                    scanf("%s", newIllness);
-                    encrypt(newIllness);
-                    strcpy(current->illness, newIllness);
-                    printf("Illness details updated successfully.\n");
-                    break;
-                    
-                case 3:
-                    printf("Modification cancelled.\n");
-                    break;
-                    
-                default:
-                    printf("Invalid choice.\n");
-            }
-            
-            return;
-        }
-        
-        current = current->next;
+    if (result != RESULT_OK) {
+        unlockAllDays(store);
+        return recordOperation(store->metrics, METRIC_MODIFY, started, result);
     }
     
-    printf("Appointment not found.\n");
+    lockStore(store, 1);
+    Appointment before;
+    occurrenceAppointment(series, occurrence, &before);
+    trackOccurrence(store, series, occurrence, -1);
+    series->skipped[occurrence / 64] |= (uint64_t)1 << (occurrence % 64);
+    
+    Appointment* appointment = allocateAppointment(store);
+    appointment->key = makeKey(date, hour, minute, newDoctor);
+    appointment->name = internString(&store->strings, series->name);
+    appointment->illness = internString(&store->strings, series->illness);
+    appointment->next = NULL;
+    appointment->duration = (uint16_t)series->duration;
+    storeInsert(store, appointment);
+    Appointment after = *appointment;
+    Series moved = *series;
+    unlockStore(store);
+    
+    uint64_t sequence = journalAppendOccurrenceMove(store, &moved, occurrence, &before, &after);
+    unlockAllDays(store);
+    journalCommit(store, sequence);
+    return recordOperation(store->metrics, METRIC_MODIFY, started, RESULT_OK);
 }
 
-void saveAppointmentsToFile(Appointment* head) {
-    FILE* file = fopen(DATA_FILE, "wb");
+// Moves the appointment at one date and time to another date, time and
+// doctor if the new slots overlap nothing else on that calendar. The check
+// and the move happen under the same day locks, so nothing can be booked in
+// between; the node is unlinked and relinked under its new key rather than
+// cancelled and booked again. An occurrence of a series becomes an
+// appointment of its own.
+int moveAppointment(AppointmentStore* store, Date oldDate, int oldHour, int oldMinute, int doctor,
+                    Date date, int hour, int minute, int newDoctor) {
+    uint64_t started = operationStart(store->metrics);
+    uint32_t oldKey = dateKey(oldDate), newKey = dateKey(date);
     
-    if (file == NULL) {
-        printf("Error opening file for writing.\n");
-        return;
+    lockDays(store, oldKey, newKey);
+    
+    lockStore(store, 0);
+    Appointment* appointment = storeFind(store, oldDate, oldHour, oldMinute, doctor);
+    int result = RESULT_OK;
+    if (appointment != NULL) {
+        result = moveProblem(store, oldDate, oldHour, oldMinute, doctor, date, hour, minute, newDoctor,
+                             appointment->duration);
     }
+    unlockStore(store);
     
-    Appointment* current = head;
+    if (appointment == NULL) {
+        unlockDays(store, oldKey, newKey);
+        return moveOccurrence(store, started, oldDate, oldHour, oldMinute, doctor, date, hour, minute, newDoctor);
+    }
     
-    while (current != NULL) {
-        fwrite(current, sizeof(Appointment), 1, file);
-        current = current->next;
+    if (result != RESULT_OK) {
+        unlockDays(store, oldKey, newKey);
+        return recordOperation(store->metrics, METRIC_MODIFY, started, result);
     }
     
-    fclose(file);
+    lockStore(store, 1);
+    Appointment before = *appointment;
+    
+    // Take the node out while its key changes, then reinsert it in order
+    storeRemove(store, appointment);
+    appointment->key = makeKey(date, hour, minute, newDoctor);
+    storeInsert(store, appointment);
+    Appointment after = *appointment;
+    unlockStore(store);
+    
+    uint64_t sequence = journalAppend(store, JOURNAL_MOVE, &before, &after);
+    unlockDays(store, oldKey, newKey);
+    journalCommit(store, sequence);
+    return recordOperation(store->metrics, METRIC_MODIFY, started, RESULT_OK);
 }
 
-void loadAppointmentsFromFile(Appointment** head) {
-    FILE* file = fopen(DATA_FILE, "rb");
+// Replaces an appointment's illness; the text is given unencrypted
+int updateIllness(AppointmentStore* store, Date date, int hour, int minute, int doctor, const char* illness) {
+    uint64_t started = operationStart(store->metrics);
+    uint32_t key = dateKey(date);
     
-    if (file == NULL) {
-        // File doesn't exist yet, not an error
-        return;
+    lockDays(store, key, key);
+    lockStore(store, 1);
+    
+    Appointment* appointment = storeFind(store, date, hour, minute, doctor);
+    if (appointment == NULL) {
+        unlockStore(store);
+        unlockDays(store, key, key);
+        return recordOperation(store->metrics, METRIC_MODIFY, started, RESULT_NOT_FOUND);
     }
     
-    // Free existing list
-    freeAppointmentList(head);
+    char encrypted[MAX_NAME_LEN];
+    strncpy(encrypted, illness, MAX_NAME_LEN - 1);
+    encrypted[MAX_NAME_LEN - 1] = '\0';
+    encrypt(encrypted);
     
-    Appointment temp;
+    Appointment before = *appointment;
+    trackAppointment(store, appointment, -1);
+    appointment->illness = internString(&store->strings, encrypted);
+    trackAppointment(store, appointment, 1);
+    Appointment after = *appointment;
+    unlockStore(store);
     
-    while (fread(&temp, sizeof(Appointment), 1, file) == 1) {
-        Appointment* newAppointment = (Appointment*)malloc(sizeof(Appointment));
-        
-        if (newAppointment == NULL) {
-            printf("Memory allocation failed while loading appointments.\n");
-            fclose(file);
-            return;
-        }
-        
-        *newAppointment = temp;
-        newAppointment->next = NULL;
-        
-        // Insert in sorted order
-        if (*head == NULL || 
-            (compareDate(newAppointment->date, (*head)->date) < 0) ||
-            (compareDate(newAppointment->date, (*head)->date) == 0 && 
-             (newAppointment->hour < (*head)->hour || 
-              (newAppointment->hour == (*head)->hour && newAppointment->minute < (*head)->minute)))) {
-            
-            newAppointment->next = *head;
-            *head = newAppointment;
-        } else {
-            Appointment* current = *head;
-            
-            while (current->next != NULL && 
-                  (compareDate(newAppointment->date, current->next->date) > 0 ||
-                  (compareDate(newAppointment->date, current->next->date) == 0 && 
-                   (newAppointment->hour > current->next->hour || 
-                    (newAppointment->hour == current->next->hour && newAppointment->minute >= current->next->minute))))) {
-                current = current->next;
-            }
-            
-            newAppointment->next = current->next;
-            current->next = newAppointment;
-        }
+    uint64_t sequence = journalAppend(store, JOURNAL_MODIFY, &before, &after);
+    unlockDays(store, key, key);
+    journalCommit(store, sequence);
+    return recordOperation(store->metrics, METRIC_MODIFY, started, RESULT_OK);
+}
+
+const char* resultMessage(int result) {
+    switch (result) {
+        case RESULT_OK: return "OK";
+        case RESULT_INVALID_SLOT: return "Invalid time slot";
+        case RESULT_SLOT_TAKEN: return "The selected time overlaps another appointment";
+        case RESULT_NOT_FOUND: return "Appointment not found";
+        case RESULT_DUPLICATE: return "Username already exists";
+        case RESULT_UNKNOWN_DOCTOR: return "No such doctor";
+        case RESULT_INVALID_SERIES: return "A series repeats every 1 to 365 days, from 1 to 256 times";
+        case RESULT_BEYOND_HORIZON: return "Cannot book appointments more than 10 years ahead";
+        default: return "Unknown error";
     }
-    
-    fclose(file);
 }
 
-User* createUser() {
-    User* newUser = (User*)malloc(sizeof(User));
+static void printAppointmentRow(const Appointment* appointment, void* context) {
+    const AppointmentStore* store = (const AppointmentStore*)context;
+    char decryptedName[MAX_NAME_LEN];
+    char decryptedIllness[MAX_NAME_LEN];
+    int hour, minute;
     
-    if (newUser == NULL) {
-        printf("Memory allocation failed.\n");
-        exit(EXIT_FAILURE);
+    strcpy(decryptedName, appointment->name);
+    strcpy(decryptedIllness, appointment->illness);
+    
+    decrypt(decryptedName);
+    decrypt(decryptedIllness);
+    
+    Date date = keyDate(appointment->key);
+    keyTime(appointment->key, &hour, &minute);
+    int end = hour * 60 + minute + appointment->duration;
+    
+    printf("%-20s %-20s %02d/%02d/%04d  %02d:%02d-%02d:%02d %s\n", 
+           decryptedName, decryptedIllness, 
+           date.day, date.month, date.year, hour, minute, end / 60, end % 60,
+           doctorName(store, keyDoctor(appointment->key)));
+}
+
+static void printAppointmentHeader(const char* title) {
+    printf("\n===== %s =====\n", title);
+    printf("%-20s %-20s %-12s %-11s %s\n", "Name", "Illness", "Date", "Time", "Doctor");
+    printf("---------------------------------------------------------------------------\n");
+}
+
+void displayAppointments(AppointmentStore* store) {
+    if (store->head == NULL && store->series.count == 0) {
+        printf("No appointments scheduled.\n");
+        return;
     }
     
-    printf("Enter username: ");
-    scanf("%s", newUser->username);
+    printAppointmentHeader("CURRENT APPOINTMENTS");
     
-    char password[MAX_PASS_LEN], confirmPassword[MAX_PASS_LEN];
-    int matchingPasswords = 0;
-    int attempts = 3;
+    for (Appointment* current = store->head; current != NULL; current = current->next) {
+        printAppointmentRow(current, store);
+    }
     
-    while (!matchingPasswords && attempts > 0) {
-        printf("Enter password: ");
+    if (store->series.count > 0) displaySeries(store);
+}
+
+// Says what is wrong with a date range, or returns NULL if it is usable
+static const char* rangeProblem(Date from, Date to) {
+    const char* problem = calendarProblem(from);
+    if (problem == NULL) problem = calendarProblem(to);
+    if (problem == NULL && compareDate(from, to) > 0) problem = "The start date is after the end date.";
+    return problem;
+}
+
+// Prompts for two dates; returns 0 if they do not make a range
+static int getDateRange(Date* from, Date* to) {
+    printf("Start date. ");
+    *from = getDate();
+    printf("End date. ");
+    *to = getDate();
+    
+    const char* problem = rangeProblem(*from, *to);
+    if (problem != NULL) {
+        printf("%s\n", problem);
+        return 0;
+    }
+    
+    return 1;
+}
+
+// Lists the appointments between two dates, both included
+void displayAppointmentsInRange(AppointmentStore* store) {
+    Date from, to;
+    if (!getDateRange(&from, &to)) return;
+    
+    printAppointmentHeader("APPOINTMENTS IN RANGE");
+    
+    size_t count = queryDateRange(store, from, to, printAppointmentRow, store);
+    printf("%zu appointment%s from %02d/%02d/%04d to %02d/%02d/%04d.\n", count, count == 1 ? "" : "s",
+           from.day, from.month, from.year, to.day, to.month, to.year);
+}
+
+// Lists appointments from the archives of days that are over, both dates included
+void displayArchivedAppointments(AppointmentStore* store) {
+    Date from, to;
+    if (!getDateRange(&from, &to)) return;
+    
+    printAppointmentHeader("ARCHIVED APPOINTMENTS");
+    
+    size_t count = queryArchive(from, to, printAppointmentRow, store);
+    printf("%zu archived appointment%s from %02d/%02d/%04d to %02d/%02d/%04d.\n", count, count == 1 ? "" : "s",
+           from.day, from.month, from.year, to.day, to.month, to.year);
+}
+
+static void printSearchResult(const Appointment* appointment, void* context) {
+    const AppointmentStore* store = (const AppointmentStore*)context;
+    char decryptedName[MAX_NAME_LEN];
+    char decryptedIllness[MAX_NAME_LEN];
+    
+    strcpy(decryptedName, appointment->name);
+    strcpy(decryptedIllness, appointment->illness);
+    
+    decrypt(decryptedName);
+    decrypt(decryptedIllness);
+    
+    Date date = keyDate(appointment->key);
+    int hour, minute;
+    keyTime(appointment->key, &hour, &minute);
+    
+    printf("Name: %s\n", decryptedName);
+    printf("Illness: %s\n", decryptedIllness);
+    printf("Date: %02d/%02d/%04d\n", date.day, date.month, date.year);
+    printf("Time: %02d:%02d (%d minutes)\n", hour, minute, appointment->duration);
+    if (keyDoctor(appointment->key) != 0) {
+        printf("Doctor: %s\n", doctorName(store, keyDoctor(appointment->key)));
+    }
+    printf("\n");
+}
+
+void searchAppointmentByName(AppointmentStore* store) {
+    if (store->head == NULL && store->series.count == 0) {
+        printf("No appointments to search.\n");
+        return;
+    }
+    
+    char searchName[MAX_NAME_LEN];
+    printf("Enter the name to search for (end with * to match a prefix): ");
+    scanf("%s", searchName);
+    
+    // A trailing '*' asks for every name starting with what precedes it
+    size_t length = strlen(searchName);
+    int prefix = length > 0 && searchName[length - 1] == '*';
+    
+    char query[MAX_NAME_LEN];
+    strcpy(query, searchName);
+    if (prefix) query[length - 1] = '\0';
+    encrypt(query); // Encrypt to match stored data
+    
+    printf("\n===== SEARCH RESULTS =====\n");
+    
+    uint64_t started = operationStart(store->metrics);
+    size_t matched = searchAppointments(store, query, prefix, printSearchResult, store);
+    recordOperation(store->metrics, METRIC_SEARCH, started, RESULT_OK);
+    
+    if (matched == 0) {
+        printf("No appointments found for '%s'.\n", searchName);
+    }
+}
+
+void modifyAppointment(AppointmentStore* store) {
+    if (store->head == NULL && store->series.count == 0) {
+        printf("No appointments to modify.\n");
+        return;
+    }
+    
+    displayAppointments(store);
+    
+    int day, month, year, hour, minute;
+    printf("Enter the date (DD MM YYYY) of the appointment to modify: ");
+    scanf("%d %d %d", &day, &month, &year);
+    
+    printf("Enter the time (HH MM) of the appointment to modify: ");
+    scanf("%d %d", &hour, &minute);
+    
+    int doctor = chooseDoctor(store, 0);
+    Date date = {day, month, year};
+    
+    Appointment* current = storeFind(store, date, hour, minute, doctor);
+    Appointment occurrenceCopy;
+    int seriesId = 0;
+    
+    // One occurrence of a series can be moved out of it on its own
+    if (current == NULL) {
+        int occurrence;
+        Series* series = findOccurrence(store, dayNumber(date), hour, minute, doctor, &occurrence);
+        if (series == NULL) {
+            printf("Appointment not found.\n");
+            return;
+        }
+        
+        occurrenceAppointment(series, occurrence, &occurrenceCopy);
+        seriesId = series->id;
+        current = &occurrenceCopy;
+    }
+    
+    Date booked = keyDate(current->key);
+    int bookedHour, bookedMinute;
+    keyTime(current->key, &bookedHour, &bookedMinute);
+    
+    printf("\nCurrent appointment details:\n");
+    char decryptedName[MAX_NAME_LEN], decryptedIllness[MAX_NAME_LEN];
+    strcpy(decryptedName, current->name);
+    strcpy(decryptedIllness, current->illness);
+    decrypt(decryptedName);
+    decrypt(decryptedIllness);
+    
+    printf("Name: %s\n", decryptedName);
+    printf("Illness: %s\n", decryptedIllness);
+    printf("Date: %02d/%02d/%04d\n", booked.day, booked.month, booked.year);
+    printf("Time: %02d:%02d (%d minutes)\n", bookedHour, bookedMinute, current->duration);
+    if (doctor != 0) printf("Doctor: %s\n", doctorName(store, doctor));
+    if (seriesId != 0) printf("Part of recurring series %d; a new date takes it out of the series.\n", seriesId);
+    
+    printf("\nWhat would you like to modify?\n");
+    printf("1. Date and time\n");
+    printf("2. Illness details\n");
+    printf("3. Cancel modification\n");
+    
+    int choice, result;
+    printf("Enter your choice: ");
+    scanf("%d", &choice);
+    
+    switch (choice) {
+        case 1:
+            printf("Enter new date (DD MM YYYY): ");
+            scanf("%d %d %d", &day, &month, &year);
+            
+            printf("Enter new time (HH MM): ");
+            scanf("%d %d", &hour, &minute);
+            
+            Date newDate = {day, month, year};
+            if (!isDateValid(newDate)) break;
+            
+            // Keeps the same doctor unless another is chosen
+            int newDoctor = doctor;
+            if (store->doctors.count > 0) {
+                printf("Move to another doctor? (y/n): ");
+                char answer[4];
+                if (scanf("%3s", answer) == 1 && (answer[0] == 'y' || answer[0] == 'Y')) {
+                    newDoctor = chooseDoctor(store, 0);
+                }
+            }
+            
+            result = moveAppointment(store, booked, bookedHour, bookedMinute, doctor,
+                                     newDate, hour, minute, newDoctor);
+            
+            if (result == RESULT_SLOT_TAKEN) {
+                printf("%s.\n", resultMessage(result));
+                displayAvailableSlots(store, newDate, newDoctor);
+                break;
+            }
+            if (result != RESULT_OK) {
+                printf("%s.\n", resultMessage(result));
+                break;
+            }
+            printf("Appointment rescheduled successfully.\n");
+            break;
+            
+        case 2:
+            if (seriesId != 0) {
+                printf("Every appointment of a recurring series has the same illness details.\n");
+                break;
+            }
+            
+            printf("Enter new illness details: ");
+            char newIllness[MAX_NAME_LEN];
+            scanf("%49s", newIllness);
+            
+            // Another process may have changed the appointment since it was shown
+            result = updateIllness(store, booked, bookedHour, bookedMinute, doctor, newIllness);
+            if (result != RESULT_OK) {
+                printf("%s.\n", resultMessage(result));
+                break;
+            }
+            printf("Illness details updated successfully.\n");
+            break;
+            
+        case 3:
+            printf("Modification cancelled.\n");
+            break;
+            
+        default:
+            printf("Invalid choice.\n");
+    }
+}
+
+// Fills the on-disk form of an appointment
+static void encodeAppointment(const Appointment* appointment, AppointmentRecord* record) {
+    Date date = keyDate(appointment->key);
+    int hour, minute;
+    keyTime(appointment->key, &hour, &minute);
+    
+    memset(record, 0, sizeof(*record));
+    record->day = date.day;
+    record->month = date.month;
+    record->year = date.year;
+    record->hour = hour;
+    record->minute = minute;
+    strncpy(record->name, appointment->name, MAX_NAME_LEN - 1);
+    strncpy(record->illness, appointment->illness, MAX_NAME_LEN - 1);
+    record->doctor = keyDoctor(appointment->key);
+    record->duration = appointment->duration;
+}
+
+int saveAppointmentsToFile(AppointmentStore* store) {
+    uint64_t started = operationStart(store->metrics);
+    
+    // Write a complete copy aside so a crash never leaves DATA_FILE half-written
+    FILE* file = fopen(SNAPSHOT_TEMP_FILE, "wb");
+    
+    if (file == NULL) {
+        printf("Error opening file for writing.\n");
+        recordOperation(store->metrics, METRIC_SAVE, started, 1);
+        return 0;
+    }
+    
+    int ok = writeFileHeader(file, APPOINTMENT_FILE_MAGIC, sizeof(AppointmentRecord), store->count);
+    Appointment* current = store->head;
+    AppointmentRecord record;
+    
+    while (current != NULL && ok) {
+        encodeAppointment(current, &record);
+        ok = fwrite(&record, sizeof(record), 1, file) == 1;
+        current = current->next;
+    }
+    
+    if (!commitFile(file, ok, SNAPSHOT_TEMP_FILE, DATA_FILE, &store->journal.stats)) {
+        printf("Error writing appointments file.\n");
+        recordOperation(store->metrics, METRIC_SAVE, started, 1);
+        return 0;
+    }
+    
+    recordOperation(store->metrics, METRIC_SAVE, started, RESULT_OK);
+    return 1;
+}
+
+static int compareAppointmentNodes(const void* a, const void* b) {
+    return compareAppointments((const Appointment*)a, (const Appointment*)b);
+}
+
+// Orders loaded nodes by date and time, then by their contents, so nodes
+// that tie are identical and any sort leaves the same sequence
+static int compareLoadedNodes(const void* a, const void* b) {
+    const Appointment* first = (const Appointment*)a;
+    const Appointment* second = (const Appointment*)b;
+    
+    int order = compareAppointments(first, second);
+    if (order == 0) order = (first->duration > second->duration) - (first->duration < second->duration);
+    if (order == 0) order = strcmp(first->name, second->name);
+    if (order == 0) order = strcmp(first->illness, second->illness);
+    return order;
+}
+
+// Threads to load this many records with: --load-threads, or one per core
+// once there are enough records to be worth it
+int loadThreadCount(const AppointmentStore* store, size_t records) {
+    if (store->loadThreads > 0) return store->loadThreads;
+    if (records < LOAD_PARALLEL_MIN) return 1;
+    
+#ifndef _WIN32
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores < 1 ? 1 : cores > LOAD_MAX_THREADS ? LOAD_MAX_THREADS : (int)cores;
+#else
+    return 1;
+#endif
+}
+
+// Runs work on each of count tasks laid out taskSize bytes apart, all but
+// the first on threads of their own, and returns when all are done
+static void runInParallel(void* (*work)(void*), void* tasks, size_t taskSize, int count) {
+#ifndef _WIN32
+    pthread_t threads[LOAD_MAX_THREADS];
+    int started[LOAD_MAX_THREADS];
+    
+    for (int i = 1; i < count; i++) {
+        started[i] = pthread_create(&threads[i], NULL, work, (char*)tasks + i * taskSize) == 0;
+    }
+    
+    work(tasks);
+    
+    // A task whose thread could not be started runs here instead
+    for (int i = 1; i < count; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            work((char*)tasks + i * taskSize);
+        }
+    }
+#else
+    for (int i = 0; i < count; i++) {
+        work((char*)tasks + i * taskSize);
+    }
+#endif
+}
+
+// Fills in the keys and lengths of one chunk of records and notes whether
+// they are in order. Names are interned afterwards, on one thread.
+static void* decodeChunk(void* argument) {
+    LoadChunk* chunk = (LoadChunk*)argument;
+    
+    chunk->sorted = 1;
+    for (size_t i = chunk->first; i < chunk->last; i++) {
+        Appointment* node = &chunk->nodes[i];
+        const AppointmentRecord* record = (const AppointmentRecord*)(chunk->records + i * chunk->stride);
+        Date date = {record->day, record->month, record->year};
+        
+        node->key = makeKey(date, record->hour, record->minute, chunk->hasDoctor ? record->doctor : 0);
+        node->duration = chunk->hasDuration && record->duration > 0 && record->duration <= DAY_MINUTES
+                             ? (uint16_t)record->duration : APPOINTMENT_DURATION;
+        node->next = NULL;
+        
+        if (i > chunk->first && chunk->nodes[i - 1].key > node->key) chunk->sorted = 0;
+    }
+    
+    return NULL;
+}
+
+static void* sortChunk(void* argument) {
+    LoadChunk* chunk = (LoadChunk*)argument;
+    qsort(chunk->nodes + chunk->first, chunk->last - chunk->first, sizeof(Appointment), compareLoadedNodes);
+    return NULL;
+}
+
+// Puts loaded nodes in order unless they already are: each chunk is sorted
+// on its own thread, then the chunks are merged, ties going to the earlier
+// chunk. The sequence is the same whatever the number of chunks.
+static void sortLoadedNodes(Appointment* nodes, size_t count, LoadChunk* chunks, int parts) {
+    int sorted = 1;
+    for (int t = 0; t < parts; t++) {
+        if (!chunks[t].sorted) sorted = 0;
+        if (t > 0 && chunks[t].first > 0 && chunks[t].first < count &&
+            nodes[chunks[t].first - 1].key > nodes[chunks[t].first].key) {
+            sorted = 0;
+        }
+    }
+    
+    // Snapshots are written in order, so this only runs on hand-made files
+    if (sorted) return;
+    
+    runInParallel(sortChunk, chunks, sizeof(LoadChunk), parts);
+    if (parts == 1) return;
+    
+    Appointment* merged = (Appointment*)malloc(count * sizeof(Appointment));
+    if (merged == NULL) {
+        printf("Memory allocation failed while loading appointments.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    size_t next[LOAD_MAX_THREADS];
+    for (int t = 0; t < parts; t++) next[t] = chunks[t].first;
+    
+    for (size_t i = 0; i < count; i++) {
+        int best = -1;
+        for (int t = 0; t < parts; t++) {
+            if (next[t] < chunks[t].last &&
+                (best < 0 || compareLoadedNodes(&nodes[next[t]], &nodes[next[best]]) < 0)) {
+                best = t;
+            }
+        }
+        merged[i] = nodes[next[best]++];
+    }
+    
+    memcpy(nodes, merged, count * sizeof(Appointment));
+    free(merged);
+}
+
+void loadAppointmentsFromFile(AppointmentStore* store) {
+    uint64_t started = operationStart(store->metrics);
+    
+    // Free existing list
+    freeAppointmentStore(store);
+    
+    MappedFile file;
+    const FileHeader* header;
+    
+    // Doctors first: appointments and series refer to them by number
+    loadDoctorsFromFile(store);
+    loadSeriesFromFile(store);
+    
+    // Files from before doctors or lengths existed have records that stop
+    // short of those fields
+    if (mapDataFile(DATA_FILE, APPOINTMENT_FILE_MAGIC, sizeof(AppointmentRecord),
+                    offsetof(AppointmentRecord, doctor), &file, &header)) {
+        const char* records = (const char*)(header + 1);
+        size_t stride = header->recordSize;
+        int hasDoctor = stride >= offsetof(AppointmentRecord, duration);
+        int hasDuration = stride >= sizeof(AppointmentRecord);
+        size_t count = (size_t)header->recordCount;
+        
+        // One slab for every node instead of one allocation per record
+        store->appointmentPool.objectSize = sizeof(Appointment);
+        Appointment* nodes = (Appointment*)poolAllocBlock(&store->appointmentPool, count);
+        
+        // Large files are decoded in one chunk per thread
+        int threads = loadThreadCount(store, count);
+        LoadChunk chunks[LOAD_MAX_THREADS];
+        
+        for (int t = 0; t < threads; t++) {
+            chunks[t].records = records;
+            chunks[t].stride = stride;
+            chunks[t].hasDoctor = hasDoctor;
+            chunks[t].hasDuration = hasDuration;
+            chunks[t].nodes = nodes;
+            chunks[t].first = count * (size_t)t / (size_t)threads;
+            chunks[t].last = count * (size_t)(t + 1) / (size_t)threads;
+        }
+        runInParallel(decodeChunk, chunks, sizeof(LoadChunk), threads);
+        
+        // The string pool is shared by every record, so interning stays on this thread
+        char text[MAX_NAME_LEN];
+        text[MAX_NAME_LEN - 1] = '\0';
+        
+        for (size_t i = 0; i < count; i++) {
+            const AppointmentRecord* record = (const AppointmentRecord*)(records + i * stride);
+            
+            // Record fields are not trusted to be terminated
+            memcpy(text, record->name, MAX_NAME_LEN - 1);
+            nodes[i].name = internString(&store->strings, text);
+            memcpy(text, record->illness, MAX_NAME_LEN - 1);
+            nodes[i].illness = internString(&store->strings, text);
+        }
+        
+        unmapDataFile(&file);
+        sortLoadedNodes(nodes, count, chunks, threads);
+        storeBulkLoad(store, nodes, count);
+    }
+    
+    // Bring the snapshot up to date with changes logged after it was taken,
+    // move out whatever is over by now and start from a clean snapshot
+    replayJournal(store, 0);
+    size_t archived = archivePastAppointments(store, currentDate());
+    store->journal.records += archived;
+    
+    // Each compaction makes every other --shared process load everything
+    // again, so those only fold the log in when it is long or must shrink
+    if (store->shared == NULL || archived > 0 || store->journal.records >= JOURNAL_COMPACT_THRESHOLD) {
+        compactJournal(store);
+    }
+    recordOperation(store->metrics, METRIC_LOAD, started, RESULT_OK);
+}
+
+// Opens the archive of one month for appending, creating it with a header
+// if needed. A record torn by a crash mid-append is cut off first so the
+// records after it stay aligned.
+static FILE* openArchive(int year, int month) {
+    char path[ARCHIVE_PATH_LEN];
+    snprintf(path, sizeof(path), ARCHIVE_FILE_PATTERN, year, month);
+    
+    FILE* file = fopen(path, "ab");
+    if (file == NULL) return NULL;
+    
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    long aligned = 0;
+    if (size >= (long)sizeof(FileHeader)) {
+        aligned = size - (long)((size - sizeof(FileHeader)) % sizeof(AppointmentRecord));
+    }
+    
+    if (aligned != size) {
+#ifndef _WIN32
+        int cut = ftruncate(fileno(file), aligned) == 0;
+#else
+        int cut = _chsize_s(_fileno(file), aligned) == 0;
+#endif
+        if (!cut) {
+            fclose(file);
+            return NULL;
+        }
+    }
+    
+    // The count stays 0: an archive holds as many records as fit in it
+    if (aligned == 0 && !writeFileHeader(file, ARCHIVE_FILE_MAGIC, sizeof(AppointmentRecord), 0)) {
+        fclose(file);
+        return NULL;
+    }
+    
+    return file;
+}
+
+static int closeArchive(FILE* file, StorageStats* stats) {
+    int ok = syncFile(file);
+    if (fclose(file) != 0) ok = 0;
+    stats->archiveSyncs++;
+    return ok;
+}
+
+// Appends a record to the archive of its month, moving on to the next file
+// when the month changes; *month is the open file's, counted from year 0
+static int archiveRecord(FILE** file, int* month, const AppointmentRecord* record, StorageStats* stats) {
+    int recordMonth = record->year * 12 + record->month - 1;
+    
+    if (*file == NULL || recordMonth != *month) {
+        int ok = *file == NULL || closeArchive(*file, stats);
+        *file = ok ? openArchive(record->year, record->month) : NULL;
+        *month = recordMonth;
+        if (*file == NULL) return 0;
+    }
+    
+    if (fwrite(record, sizeof(*record), 1, *file) != 1) return 0;
+    stats->archiveBytes += sizeof(*record);
+    return 1;
+}
+
+// Moves appointments on days before today, and series whose last
+// occurrence is before today, out of the store into the archives, which
+// are only ever appended to and are read back only by history queries. The
+// archives are on disk before anything is removed; the caller must then
+// rewrite DATA_FILE and SERIES_FILE. Returns the number of changes made.
+size_t archivePastAppointments(AppointmentStore* store, Date today) {
+    uint32_t todayKey = dateKey(today);
+    StorageStats* stats = &store->journal.stats;
+    FILE* file = NULL;
+    int month = 0, ok = 1;
+    size_t moved = 0, finished = 0, occurrences = 0;
+    AppointmentRecord record;
+    Appointment occurrence;
+    
+    // The list is in date order, so what is over is a prefix of it
+    for (Appointment* current = store->head; current != NULL && ok; current = current->next) {
+        if ((uint32_t)(current->key >> 32) >= todayKey) break;
+        
+        encodeAppointment(current, &record);
+        ok = archiveRecord(&file, &month, &record, stats);
+        if (ok) moved++;
+    }
+    
+    // A finished series is archived as the occurrences that were kept
+    for (size_t i = 0; i < store->series.count && ok; i++) {
+        const Series* series = &store->series.items[i];
+        if (series->firstDay + (series->occurrences - 1) * series->interval >= dayNumber(today)) continue;
+        
+        for (int k = 0; k < series->occurrences && ok; k++) {
+            if (isOccurrenceSkipped(series, k)) continue;
+            occurrenceAppointment(series, k, &occurrence);
+            encodeAppointment(&occurrence, &record);
+            ok = archiveRecord(&file, &month, &record, stats);
+            if (ok) occurrences++;
+        }
+        finished++;
+    }
+    
+    if (file != NULL && !closeArchive(file, stats)) ok = 0;
+    
+    // New archive files must survive a crash before DATA_FILE stops holding their contents
+    if (ok && moved + occurrences > 0) {
+        syncDirectory();
+        stats->archiveSyncs++;
+    }
+    
+    if (!ok) {
+        printf("Error writing the appointment archive; past appointments are kept for now.\n");
+        return 0;
+    }
+    
+    for (size_t i = 0; i < moved; i++) {
+        Appointment* past = store->head;
+        storeRemove(store, past);
+        releaseAppointment(store, past);
+    }
+    
+    size_t kept = 0;
+    for (size_t i = 0; i < store->series.count; i++) {
+        const Series* series = &store->series.items[i];
+        if (series->firstDay + (series->occurrences - 1) * series->interval >= dayNumber(today)) {
+            store->series.items[kept++] = *series;
+        } else {
+            trackSeries(store, series, -1);
+        }
+    }
+    store->series.count = kept;
+    stats->archived += moved + occurrences;
+    
+    return moved + finished;
+}
+
+// Orders archived records by key; identical records, which a crash
+// between archiving and rewriting DATA_FILE can leave behind, end up adjacent
+static int compareArchivedRecords(const void* a, const void* b) {
+    const AppointmentRecord* first = (const AppointmentRecord*)a;
+    const AppointmentRecord* second = (const AppointmentRecord*)b;
+    AppointmentKey firstKey = makeKey((Date){first->day, first->month, first->year},
+                                      first->hour, first->minute, first->doctor);
+    AppointmentKey secondKey = makeKey((Date){second->day, second->month, second->year},
+                                       second->hour, second->minute, second->doctor);
+    
+    if (firstKey != secondKey) return firstKey < secondKey ? -1 : 1;
+    return memcmp(first, second, sizeof(AppointmentRecord));
+}
+
+// Visits the archived appointments between two dates, both included, in
+// date and time order. Only the archives of the months in range are read,
+// and nothing is kept once the query is over. Returns the number visited.
+size_t queryArchive(Date from, Date to, void (*visit)(const Appointment*, void*), void* context) {
+    uint32_t fromKey = dateKey(from), toKey = dateKey(to);
+    size_t visited = 0;
+    
+    // Months are numbered from year 0 so the range is one loop
+    for (int months = from.year * 12 + from.month - 1; months <= to.year * 12 + to.month - 1; months++) {
+        int year = months / 12, month = months % 12 + 1;
+        char path[ARCHIVE_PATH_LEN];
+        snprintf(path, sizeof(path), ARCHIVE_FILE_PATTERN, year, month);
+        
+        MappedFile file;
+        const FileHeader* header;
+        if (!mapDataFile(path, ARCHIVE_FILE_MAGIC, sizeof(AppointmentRecord), 0, &file, &header)) continue;
+        
+        const AppointmentRecord* records = (const AppointmentRecord*)(header + 1);
+        size_t count = (file.size - sizeof(FileHeader)) / sizeof(AppointmentRecord);
+        AppointmentRecord* matches = (AppointmentRecord*)malloc((count > 0 ? count : 1) * sizeof(AppointmentRecord));
+        if (matches == NULL) {
+            printf("Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        
+        size_t matched = 0;
+        for (size_t i = 0; i < count; i++) {
+            uint32_t key = dateKey((Date){records[i].day, records[i].month, records[i].year});
+            if (key < fromKey || key > toKey) continue;
+            
+            // Record fields are not trusted to be terminated
+            matches[matched] = records[i];
+            matches[matched].name[MAX_NAME_LEN - 1] = '\0';
+            matches[matched].illness[MAX_NAME_LEN - 1] = '\0';
+            matched++;
+        }
+        
+        unmapDataFile(&file);
+        qsort(matches, matched, sizeof(AppointmentRecord), compareArchivedRecords);
+        
+        for (size_t i = 0; i < matched; i++) {
+            if (i > 0 && compareArchivedRecords(&matches[i - 1], &matches[i]) == 0) continue;
+            
+            const AppointmentRecord* record = &matches[i];
+            Appointment appointment = {0};
+            appointment.key = makeKey((Date){record->day, record->month, record->year},
+                                      record->hour, record->minute, record->doctor);
+            appointment.name = record->name;
+            appointment.illness = record->illness;
+            appointment.duration = record->duration > 0 && record->duration <= DAY_MINUTES
+                                       ? (uint16_t)record->duration : APPOINTMENT_DURATION;
+            visit(&appointment, context);
+            visited++;
+        }
+        
+        free(matches);
+    }
+    
+    return visited;
+}
+
+// Prompts for a new account's details; returns 0 if they were not confirmed
+int createUser(User* newUser) {
+    memset(newUser, 0, sizeof(*newUser));
+    
+    printf("Enter username: ");
+    scanf("%s", newUser->username);
+    
+    char password[MAX_PASS_LEN], confirmPassword[MAX_PASS_LEN];
+    int matchingPasswords = 0;
+    int attempts = 3;
+    
+    while (!matchingPasswords && attempts > 0) {
+        printf("Enter password: ");
         scanf("%s", password);
         
         printf("Confirm password: ");
@@ -617,212 +2408,6426 @@ User* createUser() {
         }
     }
     
-    if (!matchingPasswords) {
-        printf("Failed to create account due to password mismatch.\n");
-        free(newUser);
-        return NULL;
+    if (!matchingPasswords) {
+        printf("Failed to create account due to password mismatch.\n");
+        return 0;
+    }
+    
+    newUser->is_admin = 0; // Default to regular user
+    
+    return 1;
+}
+
+int addUser(UserStore* users) {
+    User newUser;
+    
+    if (!createUser(&newUser)) return 0;
+    
+    // Username must be unique
+    if (!insertUser(users, &newUser)) {
+        printf("Username already exists. Please choose a different username.\n");
+        return 0;
+    }
+    
+    printf("User account created successfully.\n");
+    return 1;
+}
+
+int authenticateUser(UserStore* users, char* username, char* password, int* is_admin) {
+    uint64_t started = operationStart(users->metrics);
+    refreshSharedUsers(users);
+    User* user = findUser(users, username);
+    
+    if (user != NULL && strcmp(user->password, password) == 0) {
+        *is_admin = user->is_admin;
+        recordOperation(users->metrics, METRIC_AUTHENTICATE, started, RESULT_OK);
+        return 1; // Authentication successful
+    }
+    
+    recordOperation(users->metrics, METRIC_AUTHENTICATE, started, 1);
+    return 0; // Authentication failed
+}
+
+// FNV-1a over a string
+static size_t hashString(const char* username) {
+    uint32_t hash = 2166136261u;
+    
+    for (const unsigned char* c = (const unsigned char*)username; *c != '\0'; c++) {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+    
+    return (size_t)hash;
+}
+
+// Returns the bucket holding username, or the empty bucket it would go in
+static size_t findUserBucket(UserStore* users, const char* username) {
+    size_t mask = users->tableCapacity - 1;
+    size_t i = hashString(username) & mask;
+    
+    while (users->table[i] >= 0 && strcmp(users->users[users->table[i]].username, username) != 0) {
+        i = (i + 1) & mask;
+    }
+    
+    return i;
+}
+
+// Sizes the hash table for the current users and fills it from the array
+static void rebuildUserTable(UserStore* users, size_t capacity) {
+    free(users->table);
+    users->table = (int32_t*)malloc(capacity * sizeof(int32_t));
+    if (users->table == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    users->tableCapacity = capacity;
+    memset(users->table, 0xff, capacity * sizeof(int32_t)); // every bucket -1
+    
+    for (size_t i = 0; i < users->count; i++) {
+        users->table[findUserBucket(users, users->users[i].username)] = (int32_t)i;
+    }
+}
+
+User* findUser(UserStore* users, const char* username) {
+    if (users->tableCapacity == 0) return NULL;
+    
+    int32_t position = users->table[findUserBucket(users, username)];
+    return position >= 0 ? &users->users[position] : NULL;
+}
+
+// Adds a user unless the username is taken; returns 0 in that case
+int insertUser(UserStore* users, const User* user) {
+    if (findUser(users, user->username) != NULL) return 0;
+    
+    if (users->count == users->capacity) {
+        size_t capacity = users->capacity > 0 ? users->capacity * 2 : USER_TABLE_INITIAL_CAPACITY;
+        User* grown = (User*)realloc(users->users, capacity * sizeof(User));
+        if (grown == NULL) {
+            printf("Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        users->users = grown;
+        users->capacity = capacity;
+    }
+    
+    users->users[users->count] = *user;
+    users->users[users->count].username[MAX_NAME_LEN - 1] = '\0';
+    users->users[users->count].password[MAX_PASS_LEN - 1] = '\0';
+    users->count++;
+    
+    // Keep the load factor under 0.5
+    if (users->count * 2 > users->tableCapacity) {
+        size_t capacity = users->tableCapacity > 0 ? users->tableCapacity : USER_TABLE_INITIAL_CAPACITY;
+        while (users->count * 2 > capacity) capacity *= 2;
+        rebuildUserTable(users, capacity);
+    } else {
+        users->table[findUserBucket(users, user->username)] = (int32_t)(users->count - 1);
+    }
+    
+    return 1;
+}
+
+void saveUsersToFile(UserStore* users) {
+    // With --shared, users other processes saved meanwhile are kept
+    lockSharedUsers(users);
+    FILE* file = fopen(USER_TEMP_FILE, "wb");
+    
+    if (file == NULL) {
+        printf("Error opening user file for writing.\n");
+        unlockSharedUsers(users);
+        return;
+    }
+    
+    // Users hold no pointers, so the dense array is the file's record section
+    int ok = writeFileHeader(file, USER_FILE_MAGIC, sizeof(User), users->count) &&
+             fwrite(users->users, sizeof(User), users->count, file) == users->count;
+    
+    if (!commitFile(file, ok, USER_TEMP_FILE, USER_FILE, &users->stats)) {
+        printf("Error writing user file.\n");
+    }
+    unlockSharedUsers(users);
+}
+
+void loadUsersFromFile(UserStore* users) {
+    MappedFile file;
+    const FileHeader* header;
+    
+    if (!mapDataFile(USER_FILE, USER_FILE_MAGIC, sizeof(User), 0, &file, &header)) {
+        // File doesn't exist yet, not an error
+        return;
+    }
+    
+    freeUserStore(users);
+    
+    size_t count = (size_t)header->recordCount;
+    size_t capacity = USER_TABLE_INITIAL_CAPACITY;
+    while (capacity < count) capacity *= 2;
+    
+    users->users = (User*)malloc(capacity * sizeof(User));
+    if (users->users == NULL) {
+        printf("Memory allocation failed while loading users.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    memcpy(users->users, header + 1, count * sizeof(User));
+    users->count = count;
+    users->capacity = capacity;
+    unmapDataFile(&file);
+    
+    for (size_t i = 0; i < count; i++) {
+        users->users[i].username[MAX_NAME_LEN - 1] = '\0';
+        users->users[i].password[MAX_PASS_LEN - 1] = '\0';
+    }
+    
+    rebuildUserTable(users, capacity * 2);
+}
+
+// Adds a doctor and saves the list straight away, so DOCTOR_FILE always
+// knows every doctor the journal can mention. Returns the new doctor's
+// number, or 0 if the name is taken or there are too many doctors.
+int registerDoctor(AppointmentStore* store, const char* name) {
+    lockSharedStore(store);
+    lockStore(store, 1);
+    
+    if (findDoctor(store, name) != 0 || store->doctors.count >= MAX_DOCTORS) {
+        unlockStore(store);
+        unlockSharedStore(store);
+        return 0;
+    }
+    
+    DoctorList* doctors = &store->doctors;
+    if (doctors->count == doctors->capacity) {
+        size_t capacity = doctors->capacity == 0 ? 16 : doctors->capacity * 2;
+        Doctor* items = (Doctor*)realloc(doctors->items, capacity * sizeof(Doctor));
+        if (items == NULL) {
+            printf("Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        doctors->items = items;
+        doctors->capacity = capacity;
+    }
+    
+    Doctor* doctor = &doctors->items[doctors->count++];
+    memset(doctor, 0, sizeof(*doctor));
+    strncpy(doctor->name, name, MAX_NAME_LEN - 1);
+    int number = (int)doctors->count;
+    
+    saveDoctorsToFile(store);
+    markSharedChange(store);
+    unlockStore(store);
+    unlockSharedStore(store);
+    return number;
+}
+
+// Returns the number of the doctor with a name, or 0 if there is none
+int findDoctor(const AppointmentStore* store, const char* name) {
+    for (size_t i = 0; i < store->doctors.count; i++) {
+        if (strcmp(store->doctors.items[i].name, name) == 0) return (int)i + 1;
+    }
+    return 0;
+}
+
+const char* doctorName(const AppointmentStore* store, int doctor) {
+    if (doctor == 0) return "-";
+    if (doctor > (int)store->doctors.count) return "(unknown)";
+    return store->doctors.items[doctor - 1].name;
+}
+
+// Lists the doctors and asks for one. Returns 0 straight away when there
+// are none, and DOCTOR_ANY when allowAny is set and the user enters 0.
+int chooseDoctor(AppointmentStore* store, int allowAny) {
+    if (store->doctors.count == 0) return 0;
+    
+    printf("\nDoctors:\n");
+    for (size_t i = 0; i < store->doctors.count; i++) {
+        printf("%zu. %s\n", i + 1, store->doctors.items[i].name);
+    }
+    
+    int doctor;
+    while (1) {
+        printf(allowAny ? "Choose a doctor (0 for whichever doctor is free): "
+                        : "Enter the doctor's number (0 if none): ");
+        if (scanf("%d", &doctor) == 1 && doctor >= 0 && doctor <= (int)store->doctors.count) break;
+        printf("Invalid doctor. Please try again.\n");
+        clearInputBuffer();
+    }
+    
+    return doctor == 0 && allowAny ? DOCTOR_ANY : doctor;
+}
+
+void addDoctor(AppointmentStore* store) {
+    char name[MAX_NAME_LEN];
+    printf("Enter the doctor's name: ");
+    scanf("%49s", name);
+    
+    int number = registerDoctor(store, name);
+    if (number == 0) {
+        printf("A doctor with that name already exists.\n");
+        return;
+    }
+    
+    printf("Doctor %s added as number %d.\n", name, number);
+}
+
+int saveDoctorsToFile(AppointmentStore* store) {
+    FILE* file = fopen(DOCTOR_TEMP_FILE, "wb");
+    
+    if (file == NULL) {
+        printf("Error opening doctor file for writing.\n");
+        return 0;
+    }
+    
+    int ok = writeFileHeader(file, DOCTOR_FILE_MAGIC, sizeof(Doctor), store->doctors.count) &&
+             fwrite(store->doctors.items, sizeof(Doctor), store->doctors.count, file) == store->doctors.count;
+    
+    if (!commitFile(file, ok, DOCTOR_TEMP_FILE, DOCTOR_FILE, &store->journal.stats)) {
+        printf("Error writing doctor file.\n");
+        return 0;
+    }
+    
+    return 1;
+}
+
+void loadDoctorsFromFile(AppointmentStore* store) {
+    MappedFile file;
+    const FileHeader* header;
+    
+    if (!mapDataFile(DOCTOR_FILE, DOCTOR_FILE_MAGIC, sizeof(Doctor), 0, &file, &header)) {
+        return; // No doctors yet
+    }
+    
+    size_t count = (size_t)header->recordCount;
+    Doctor* items = (Doctor*)malloc((count > 0 ? count : 1) * sizeof(Doctor));
+    if (items == NULL) {
+        printf("Memory allocation failed while loading doctors.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    memcpy(items, header + 1, count * sizeof(Doctor));
+    unmapDataFile(&file);
+    
+    for (size_t i = 0; i < count; i++) {
+        items[i].name[MAX_NAME_LEN - 1] = '\0';
+    }
+    
+    free(store->doctors.items);
+    store->doctors.items = items;
+    store->doctors.count = count;
+    store->doctors.capacity = count > 0 ? count : 1;
+}
+
+// Position of the first series on a doctor's calendar, or where one would go
+static size_t firstSeriesOf(const SeriesList* list, int doctor) {
+    size_t low = 0, high = list->count;
+    
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (list->items[middle].doctor < doctor) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    
+    return low;
+}
+
+static Series* findSeries(SeriesList* list, int id) {
+    for (size_t i = 0; i < list->count; i++) {
+        if (list->items[i].id == id) return &list->items[i];
+    }
+    return NULL;
+}
+
+// Adds a copy of a series after the others on its calendar
+static void insertSeries(SeriesList* list, const Series* series) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+        Series* items = (Series*)realloc(list->items, capacity * sizeof(Series));
+        if (items == NULL) {
+            printf("Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+    
+    size_t position = firstSeriesOf(list, series->doctor + 1);
+    memmove(&list->items[position + 1], &list->items[position], (list->count - position) * sizeof(Series));
+    list->items[position] = *series;
+    list->count++;
+    if (series->id > list->lastId) list->lastId = series->id;
+}
+
+static void removeSeries(SeriesList* list, Series* series) {
+    size_t position = (size_t)(series - list->items);
+    memmove(series, series + 1, (list->count - position - 1) * sizeof(Series));
+    list->count--;
+}
+
+// Which occurrence of a series falls on a day, cancelled or not, or -1
+int seriesOccurrence(const Series* series, int32_t day) {
+    int32_t offset = day - series->firstDay;
+    if (offset < 0 || offset % series->interval != 0) return -1;
+    
+    int32_t occurrence = offset / series->interval;
+    return occurrence < series->occurrences ? (int)occurrence : -1;
+}
+
+int isOccurrenceSkipped(const Series* series, int occurrence) {
+    return (int)((series->skipped[occurrence / 64] >> (occurrence % 64)) & 1);
+}
+
+// Fills in one occurrence of a series as an appointment; its name and
+// illness point into the series
+void occurrenceAppointment(const Series* series, int occurrence, Appointment* appointment) {
+    Date date = dateFromDayNumber(series->firstDay + occurrence * series->interval);
+    
+    memset(appointment, 0, sizeof(*appointment));
+    appointment->key = makeKey(date, series->hour, series->minute, series->doctor);
+    appointment->name = series->name;
+    appointment->illness = series->illness;
+    appointment->duration = (uint16_t)series->duration;
+}
+
+// The series with an occurrence that has not been cancelled at a day and
+// time on a calendar, or NULL; its number goes in *occurrence
+Series* findOccurrence(AppointmentStore* store, int32_t day, int hour, int minute, int doctor, int* occurrence) {
+    SeriesList* list = &store->series;
+    
+    for (size_t i = firstSeriesOf(list, doctor); i < list->count && list->items[i].doctor == doctor; i++) {
+        Series* series = &list->items[i];
+        if (series->hour != hour || series->minute != minute) continue;
+        
+        int found = seriesOccurrence(series, day);
+        if (found >= 0 && !isOccurrenceSkipped(series, found)) {
+            *occurrence = found;
+            return series;
+        }
+    }
+    
+    return NULL;
+}
+
+// Slots a calendar's series take on a day, worked out from their rules
+// rather than stored, so a series costs nothing on the days it never reaches
+SlotMask seriesSlots(AppointmentStore* store, int32_t day, int doctor) {
+    SeriesList* list = &store->series;
+    SlotMask taken = 0;
+    
+    for (size_t i = firstSeriesOf(list, doctor); i < list->count && list->items[i].doctor == doctor; i++) {
+        const Series* series = &list->items[i];
+        int occurrence = seriesOccurrence(series, day);
+        if (occurrence >= 0 && !isOccurrenceSkipped(series, occurrence)) {
+            taken |= slotRun(slotIndex(series->hour, series->minute), series->duration);
+        }
+    }
+    
+    return taken;
+}
+
+// Books a recurring series (encrypted name and illness, first date, time,
+// doctor and length taken from details) if none of its occurrences
+// overlaps anything on its calendar. The check looks up each occurrence's
+// day once; the series itself is kept, logged and saved as one record
+// however many occurrences it has. Its number goes in *id.
+int bookSeries(AppointmentStore* store, BookingRequest* details, int interval, int occurrences, int* id) {
+    uint64_t started = operationStart(store->metrics);
+    if (details->duration == 0) details->duration = APPOINTMENT_DURATION;
+    if (interval < 1 || interval > SERIES_MAX_INTERVAL || occurrences < 1 || occurrences > SERIES_MAX_OCCURRENCES) {
+        return recordOperation(store->metrics, METRIC_ADD, started, RESULT_INVALID_SERIES);
+    }
+    
+    int slot = bookableSlot(store, details->hour, details->minute, details->duration);
+    if (slot < 0) return recordOperation(store->metrics, METRIC_ADD, started, RESULT_INVALID_SLOT);
+    
+    // Every occurrence must be one that could be booked on its own
+    if (dayNumber(details->date) + (occurrences - 1) * interval > horizonDay()) {
+        return recordOperation(store->metrics, METRIC_ADD, started, RESULT_BEYOND_HORIZON);
+    }
+    
+    // The series reaches days on every stripe, so none may change meanwhile
+    lockAllDays(store);
+    
+    lockStore(store, 0);
+    int doctor = details->doctor, result = RESULT_OK;
+    int32_t first = dayNumber(details->date);
+    SlotMask run = slotRun(slot, details->duration);
+    
+    if (doctor < 0 || doctor > (int)store->doctors.count) result = RESULT_UNKNOWN_DOCTOR;
+    for (int i = 0; i < occurrences && result == RESULT_OK; i++) {
+        if (bookedSlots(store, dateFromDayNumber(first + i * interval), doctor) & run) result = RESULT_SLOT_TAKEN;
+    }
+    unlockStore(store);
+    
+    if (result != RESULT_OK) {
+        unlockAllDays(store);
+        return recordOperation(store->metrics, METRIC_ADD, started, result);
+    }
+    
+    Series series;
+    memset(&series, 0, sizeof(series));
+    series.firstDay = first;
+    series.interval = interval;
+    series.occurrences = occurrences;
+    series.hour = details->hour;
+    series.minute = details->minute;
+    series.duration = details->duration;
+    series.doctor = doctor;
+    strcpy(series.name, details->name);
+    strcpy(series.illness, details->illness);
+    
+    lockStore(store, 1);
+    series.id = store->series.lastId + 1;
+    insertSeries(&store->series, &series);
+    trackSeries(store, &series, 1);
+    unlockStore(store);
+    
+    uint64_t sequence = journalAppendSeries(store, JOURNAL_SERIES_ADD, &series, 0);
+    unlockAllDays(store);
+    journalCommit(store, sequence);
+    
+    *id = series.id;
+    return recordOperation(store->metrics, METRIC_ADD, started, RESULT_OK);
+}
+
+// Removes a series with all its occurrences that are still to come
+int endSeries(AppointmentStore* store, int id) {
+    uint64_t started = operationStart(store->metrics);
+    lockAllDays(store);
+    lockStore(store, 1);
+    
+    Series* series = findSeries(&store->series, id);
+    if (series == NULL) {
+        unlockStore(store);
+        unlockAllDays(store);
+        return recordOperation(store->metrics, METRIC_DELETE, started, RESULT_NOT_FOUND);
+    }
+    
+    Series before = *series;
+    trackSeries(store, series, -1);
+    removeSeries(&store->series, series);
+    unlockStore(store);
+    
+    uint64_t sequence = journalAppendSeries(store, JOURNAL_SERIES_END, &before, 0);
+    unlockAllDays(store);
+    journalCommit(store, sequence);
+    return recordOperation(store->metrics, METRIC_DELETE, started, RESULT_OK);
+}
+
+int saveSeriesToFile(AppointmentStore* store) {
+    FILE* file = fopen(SERIES_TEMP_FILE, "wb");
+    
+    if (file == NULL) {
+        printf("Error opening series file for writing.\n");
+        return 0;
+    }
+    
+    int ok = writeFileHeader(file, SERIES_FILE_MAGIC, sizeof(Series), store->series.count) &&
+             (store->series.count == 0 ||
+              fwrite(store->series.items, sizeof(Series), store->series.count, file) == store->series.count);
+    
+    if (!commitFile(file, ok, SERIES_TEMP_FILE, SERIES_FILE, &store->journal.stats)) {
+        printf("Error writing series file.\n");
+        return 0;
+    }
+    
+    return 1;
+}
+
+static int compareSeries(const void* a, const void* b) {
+    const Series* first = (const Series*)a;
+    const Series* second = (const Series*)b;
+    
+    if (first->doctor != second->doctor) return first->doctor < second->doctor ? -1 : 1;
+    return (first->id > second->id) - (first->id < second->id);
+}
+
+void loadSeriesFromFile(AppointmentStore* store) {
+    MappedFile file;
+    const FileHeader* header;
+    
+    if (!mapDataFile(SERIES_FILE, SERIES_FILE_MAGIC, sizeof(Series), 0, &file, &header)) {
+        return; // No series yet
+    }
+    
+    size_t count = (size_t)header->recordCount;
+    Series* items = (Series*)malloc((count > 0 ? count : 1) * sizeof(Series));
+    if (items == NULL) {
+        printf("Memory allocation failed while loading series.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    memcpy(items, header + 1, count * sizeof(Series));
+    unmapDataFile(&file);
+    
+    // Rules that could not have been booked are dropped rather than trusted
+    size_t kept = 0;
+    int32_t lastId = 0;
+    for (size_t i = 0; i < count; i++) {
+        Series* series = &items[i];
+        if (series->interval < 1 || series->interval > SERIES_MAX_INTERVAL || series->occurrences < 1 ||
+            series->occurrences > SERIES_MAX_OCCURRENCES || !isDurationValid(series->duration) ||
+            slotIndex(series->hour, series->minute) < 0) {
+            continue;
+        }
+        
+        series->name[MAX_NAME_LEN - 1] = '\0';
+        series->illness[MAX_NAME_LEN - 1] = '\0';
+        if (series->id > lastId) lastId = series->id;
+        items[kept++] = *series;
+    }
+    
+    qsort(items, kept, sizeof(Series), compareSeries);
+    
+    free(store->series.items);
+    store->series.items = items;
+    store->series.count = kept;
+    store->series.capacity = count > 0 ? count : 1;
+    store->series.lastId = lastId;
+    
+    for (size_t i = 0; i < kept; i++) {
+        trackSeries(store, &items[i], 1);
+    }
+}
+
+// One line describing a series, for the menus
+static void printSeriesRow(const AppointmentStore* store, const Series* series) {
+    char decryptedName[MAX_NAME_LEN];
+    char decryptedIllness[MAX_NAME_LEN];
+    
+    strcpy(decryptedName, series->name);
+    strcpy(decryptedIllness, series->illness);
+    decrypt(decryptedName);
+    decrypt(decryptedIllness);
+    
+    Date first = dateFromDayNumber(series->firstDay);
+    int end = series->hour * 60 + series->minute + series->duration;
+    int skipped = 0;
+    for (int i = 0; i < SERIES_MAX_OCCURRENCES / 64; i++) {
+        skipped += __builtin_popcountll(series->skipped[i]);
+    }
+    
+    printf("%-4d %-20s %-20s from %02d/%02d/%04d  %02d:%02d-%02d:%02d every %d days, %d times (%d cancelled) %s\n",
+           series->id, decryptedName, decryptedIllness, first.day, first.month, first.year,
+           series->hour, series->minute, end / 60, end % 60, series->interval, series->occurrences, skipped,
+           doctorName(store, series->doctor));
+}
+
+void displaySeries(AppointmentStore* store) {
+    printf("\n===== RECURRING APPOINTMENTS =====\n");
+    for (size_t i = 0; i < store->series.count; i++) {
+        printSeriesRow(store, &store->series.items[i]);
+    }
+}
+
+// Prompts for a series: its first appointment as for a single booking, then
+// how often it repeats and until when
+void addRecurringAppointment(AppointmentStore* store) {
+    BookingRequest request;
+    if (!createAppointment(&request)) return;
+    
+    request.doctor = chooseDoctor(store, 0);
+    request.duration = getDuration();
+    
+    printf("Enter the hour of each appointment (%d-%d): ", START_HOUR, END_HOUR);
+    scanf("%d", &request.hour);
+    printf("Enter the minute: ");
+    scanf("%d", &request.minute);
+    
+    int interval, occurrences;
+    printf("Repeat every how many days? (7 for weekly): ");
+    if (scanf("%d", &interval) != 1) interval = 0;
+    
+    printf("How many appointments? (0 to give an end date instead): ");
+    if (scanf("%d", &occurrences) != 1) occurrences = 0;
+    
+    if (occurrences == 0 && interval > 0) {
+        printf("Last date. ");
+        Date until = getDate();
+        if (calendarProblem(until) != NULL || compareDate(until, request.date) < 0) {
+            printf("The last date must be a real date on or after the first.\n");
+            return;
+        }
+        occurrences = (dayNumber(until) - dayNumber(request.date)) / interval + 1;
+    }
+    
+    int id;
+    int result = bookSeries(store, &request, interval, occurrences, &id);
+    if (result != RESULT_OK) {
+        printf("%s.\n", resultMessage(result));
+        return;
+    }
+    
+    printf("Your recurring appointment (series %d) has been booked: %d appointments every %d days "
+           "from %02d/%02d/%04d at %02d:%02d\n", id, occurrences, interval,
+           request.date.day, request.date.month, request.date.year, request.hour, request.minute);
+}
+
+// Ends a series chosen from the list; single occurrences are cancelled
+// like any other appointment
+void endRecurringAppointment(AppointmentStore* store) {
+    if (store->series.count == 0) {
+        printf("No recurring appointments.\n");
+        return;
+    }
+    
+    displaySeries(store);
+    
+    int id, confirm;
+    printf("Enter the number of the series to end: ");
+    if (scanf("%d", &id) != 1) {
+        clearInputBuffer();
+        return;
+    }
+    
+    printf("Are you sure you want to cancel every remaining appointment in it? (1 for Yes, 0 for No): ");
+    if (scanf("%d", &confirm) != 1 || !confirm) {
+        printf("Nothing was cancelled.\n");
+        return;
+    }
+    
+    if (endSeries(store, id) != RESULT_OK) {
+        printf("No such series.\n");
+        return;
+    }
+    
+    printf("Series %d ended.\n", id);
+}
+
+void adminMenu(AppointmentStore* appointments, UserStore* users) {
+    int choice;
+    
+    while (1) {
+        printf("\n===== ADMIN MENU =====\n");
+        printf("1. View all appointments\n");
+        printf("2. Search appointments by name\n");
+        printf("3. Delete an appointment\n");
+        printf("4. Create a new user\n");
+        printf("5. View memory statistics\n");
+        printf("6. View appointments in a date range\n");
+        printf("7. Add a doctor\n");
+        printf("8. View storage statistics\n");
+        printf("9. View archived appointments\n");
+        printf("10. View operation metrics\n");
+        printf("11. View occupancy and illness reports\n");
+        printf("12. Log out\n");
+        printf("Enter your choice: ");
+        
+        int read = scanf("%d", &choice);
+        refreshSharedStore(appointments);
+        if (read != 1) {
+            printf("Invalid input. Please enter a number.\n");
+            clearInputBuffer();
+            continue;
+        }
+        
+        switch (choice) {
+            case 1:
+                displayAppointments(appointments);
+                break;
+            case 2:
+                searchAppointmentByName(appointments);
+                break;
+            case 3:
+                deleteAppointment(appointments);
+                break;
+            case 4:
+                if (addUser(users)) {
+                    saveUsersToFile(users);
+                }
+                break;
+            case 5:
+                displayMemoryStatistics(appointments, users);
+                break;
+            case 6:
+                displayAppointmentsInRange(appointments);
+                break;
+            case 7:
+                addDoctor(appointments);
+                break;
+            case 8:
+                displayStorageStatistics(appointments, users);
+                break;
+            case 9:
+                displayArchivedAppointments(appointments);
+                break;
+            case 10:
+                displayMetrics(appointments);
+                break;
+            case 11:
+                displayReports(appointments);
+                break;
+            case 12:
+                printf("Logging out from admin account...\n");
+                return;
+            default:
+                printf("Invalid choice. Please try again.\n");
+        }
+    }
+}
+
+void displayAvailableSlots(AppointmentStore* store, Date date, int doctor) {
+    printf("\n===== AVAILABLE SLOTS FOR %02d/%02d/%04d =====\n", 
+           date.day, date.month, date.year);
+    
+    // One lookup gives the whole day; the free gaps are the runs of clear bits
+    uint64_t started = operationStart(store->metrics);
+    SlotMask freeSlots = ALL_SLOTS_MASK & ~bookedSlots(store, date, doctor);
+    recordOperation(store->metrics, METRIC_SLOTS, started, RESULT_OK);
+    int slot, slots;
+    
+    if (freeSlots == 0) {
+        printf("No available slots for this date.\n");
+        return;
+    }
+    
+    while (nextFreeGap(&freeSlots, &slot, &slots)) {
+        int start = slot * SLOT_MINUTES, end = (slot + slots) * SLOT_MINUTES;
+        printf("%02d:%02d - %02d:%02d (%d minutes free)\n", START_HOUR + start / 60, start % 60,
+               START_HOUR + end / 60, end % 60, end - start);
+    }
+    printf("Appointments start every %d minutes from %02d:00.\n", bookingGranularity(store), START_HOUR);
+}
+
+// Whether an appointment of the given length can start at a time without
+// overlapping another on the calendar; one AND against the day's bitmap
+int isSlotAvailable(AppointmentStore* store, int hour, int minute, Date date, int doctor, int duration) {
+    int slot = bookableSlot(store, hour, minute, duration);
+    if (slot < 0) return 0; // Outside office hours or off the start grid
+    
+    if (doctor == DOCTOR_ANY) {
+        return firstFreeDoctor(store, date, slot, duration) != 0;
+    }
+    
+    if (bookedSlots(store, date, doctor) & slotRun(slot, duration)) {
+        return 0; // Overlaps an appointment already booked
+    }
+    
+    return 1; // Slot is available
+}
+
+// Slots taken on doctor i + 1's calendar on a day, given its table entry
+static SlotMask doctorDaySlots(AppointmentStore* store, const DaySlots* day, int32_t number, size_t i) {
+    SlotMask booked = day != NULL && i < day->doctorCount ? day->doctors[i] : 0;
+    return booked | seriesSlots(store, number, (int)i + 1);
+}
+
+// Slots of a day taken on one calendar: doctor 0 for appointments without a
+// doctor, a doctor's number, or DOCTOR_ANY for the slots at which every
+// doctor is taken
+SlotMask bookedSlots(AppointmentStore* store, Date date, int doctor) {
+    if (doctor != DOCTOR_ANY) {
+        SlotMask* booked = findDoctorSlots(&store->slots, dateKey(date), doctor, 0);
+        return (booked != NULL ? *booked : 0) | seriesSlots(store, dayNumber(date), doctor);
+    }
+    
+    size_t count = store->doctors.count;
+    if (count == 0) return ALL_SLOTS_MASK; // Nobody to see
+    
+    DaySlots* day = findDayEntry(&store->slots, dateKey(date), 0);
+    if (store->series.count > 0) {
+        // Series take slots on days without entries, so each doctor is looked at
+        SlotMask all = ALL_SLOTS_MASK;
+        for (size_t i = 0; i < count && all != 0; i++) {
+            all &= doctorDaySlots(store, day, dayNumber(date), i);
+        }
+        return all;
+    }
+    
+    // A doctor with nothing booked that day has no entry yet
+    if (day == NULL || day->doctorCount < count) return 0;
+    
+    // The day's bitmaps sit side by side, so this is a plain AND over one
+    // array; four running results let the compiler keep it in vector registers
+    const SlotMask* masks = day->doctors;
+    SlotMask a = ALL_SLOTS_MASK, b = ALL_SLOTS_MASK, c = ALL_SLOTS_MASK, d = ALL_SLOTS_MASK;
+    size_t i = 0;
+    
+    for (; i + 4 <= count; i += 4) {
+        a &= masks[i];
+        b &= masks[i + 1];
+        c &= masks[i + 2];
+        d &= masks[i + 3];
+    }
+    for (; i < count; i++) {
+        a &= masks[i];
+    }
+    
+    return a & b & c & d;
+}
+
+// Bits of the slots at which a run of free slots at least that long begins.
+// Each step doubles the run checked so far, so 90 minutes takes three ANDs.
+static SlotMask runStarts(SlotMask freeSlots, int slots) {
+    SlotMask fits = freeSlots;
+    
+    for (int width = 1; width < slots; ) {
+        int step = width < slots - width ? width : slots - width;
+        fits &= fits >> step;
+        width += step;
+    }
+    
+    return fits;
+}
+
+// Start slots of a day on the booking grid at which an appointment of the
+// given length overlaps nothing on one calendar (see bookedSlots); for
+// DOCTOR_ANY, those at which some doctor is free throughout
+SlotMask freeStarts(AppointmentStore* store, Date date, int doctor, int duration) {
+    int slots = (duration + SLOT_MINUTES - 1) / SLOT_MINUTES;
+    int step = bookingGranularity(store) / SLOT_MINUTES;
+    SlotMask grid = 0;
+    
+    for (int slot = 0; slot < SLOTS_PER_DAY; slot += step) {
+        grid |= (SlotMask)1 << slot;
+    }
+    
+    // Clear bits above the day stop runs from reaching past its end
+    if (doctor != DOCTOR_ANY || slots == 1) {
+        return grid & runStarts(ALL_SLOTS_MASK & ~bookedSlots(store, date, doctor), slots);
+    }
+    
+    // Longer visits need one doctor free for all of it, which the AND over
+    // doctors cannot tell, so each doctor's runs are found separately
+    size_t count = store->doctors.count;
+    if (count == 0) return 0;
+    
+    DaySlots* day = findDayEntry(&store->slots, dateKey(date), 0);
+    if ((day == NULL || day->doctorCount < count) && store->series.count == 0) {
+        return grid & runStarts(ALL_SLOTS_MASK, slots);
+    }
+    
+    SlotMask starts = 0;
+    for (size_t i = 0; i < count && (starts & grid) != grid; i++) {
+        starts |= runStarts(ALL_SLOTS_MASK & ~doctorDaySlots(store, day, dayNumber(date), i), slots);
+    }
+    
+    return grid & starts;
+}
+
+// Number of the first doctor free from a slot of a day for the given length,
+// or 0 if none is
+int firstFreeDoctor(AppointmentStore* store, Date date, int slot, int duration) {
+    size_t count = store->doctors.count;
+    if (count == 0) return 0;
+    
+    DaySlots* day = findDayEntry(&store->slots, dateKey(date), 0);
+    int32_t number = dayNumber(date);
+    
+    SlotMask run = slotRun(slot, duration);
+    for (size_t i = 0; i < count; i++) {
+        if (!(doctorDaySlots(store, day, number, i) & run)) return (int)i + 1;
+    }
+    
+    return 0;
+}
+
+// Day number with its sign bit flipped, so unsigned order is date order;
+// never 0 for a real date, which leaves 0 free to mark an empty bucket
+uint32_t dateKey(Date date) {
+    return (uint32_t)dayNumber(date) ^ 0x80000000u;
+}
+
+// Days since 1 January 1970 in the proleptic Gregorian calendar
+int32_t dayNumber(Date date) {
+    int year = date.year - (date.month <= 2);
+    int era = (year >= 0 ? year : year - 399) / 400;
+    int yearOfEra = year - era * 400;
+    int dayOfYear = (153 * (date.month + (date.month > 2 ? -3 : 9)) + 2) / 5 + date.day - 1;
+    int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + dayOfEra - 719468;
+}
+
+Date dateFromDayNumber(int32_t day) {
+    day += 719468;
+    int era = (day >= 0 ? day : day - 146096) / 146097;
+    int dayOfEra = day - era * 146097;
+    int yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    int dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    int monthIndex = (5 * dayOfYear + 2) / 153; // counted from March
+    Date date;
+    
+    date.day = dayOfYear - (153 * monthIndex + 2) / 5 + 1;
+    date.month = monthIndex < 10 ? monthIndex + 3 : monthIndex - 9;
+    date.year = yearOfEra + era * 400 + (date.month <= 2);
+    return date;
+}
+
+AppointmentKey makeKey(Date date, int hour, int minute, int doctor) {
+    return ((AppointmentKey)dateKey(date) << 32) | ((AppointmentKey)(uint16_t)(hour * 60 + minute) << 16) |
+           (uint16_t)doctor;
+}
+
+Date keyDate(AppointmentKey key) {
+    return dateFromDayNumber((int32_t)((uint32_t)(key >> 32) ^ 0x80000000u));
+}
+
+void keyTime(AppointmentKey key, int* hour, int* minute) {
+    int minutes = (int)(int16_t)(uint16_t)(key >> 16);
+    *hour = minutes / 60;
+    *minute = minutes % 60;
+}
+
+int keyDoctor(AppointmentKey key) {
+    return (int)(uint16_t)key;
+}
+
+// Returns the bit position of a time within a day, or -1 if it is not a slot
+int slotIndex(int hour, int minute) {
+    if (hour < START_HOUR || minute < 0 || minute >= 60 || minute % SLOT_MINUTES != 0) {
+        return -1;
+    }
+    
+    int slot = ((hour - START_HOUR) * 60 + minute) / SLOT_MINUTES;
+    return slot < SLOTS_PER_DAY ? slot : -1;
+}
+
+// Appointment lengths and granularities are whole slots and fit in a day
+int isDurationValid(int minutes) {
+    return minutes > 0 && minutes <= DAY_MINUTES && minutes % SLOT_MINUTES == 0;
+}
+
+// Minutes between the times at which appointments may start
+int bookingGranularity(const AppointmentStore* store) {
+    return store->granularity != 0 ? store->granularity : APPOINTMENT_DURATION;
+}
+
+// Returns the slot of a start time if an appointment of the given length may
+// begin there: on the start grid, and over before the day ends. -1 otherwise.
+int bookableSlot(const AppointmentStore* store, int hour, int minute, int duration) {
+    int slot = slotIndex(hour, minute);
+    
+    if (slot < 0 || !isDurationValid(duration) || slot * SLOT_MINUTES % bookingGranularity(store) != 0 ||
+        slot * SLOT_MINUTES + duration > DAY_MINUTES) {
+        return -1;
+    }
+    
+    return slot;
+}
+
+// Bits of the slots an appointment of the given length covers from a start
+// slot; a part past the end of the day is cut off
+SlotMask slotRun(int slot, int duration) {
+    int slots = (duration + SLOT_MINUTES - 1) / SLOT_MINUTES;
+    if (slot >= SLOTS_PER_DAY || slots <= 0) return 0;
+    if (slots > SLOTS_PER_DAY) slots = SLOTS_PER_DAY;
+    
+    return ((((SlotMask)1 << slots) - 1) << slot) & ALL_SLOTS_MASK;
+}
+
+// Takes the earliest run of set bits out of freeSlots and reports where it
+// starts and how many slots it spans; returns 0 once none are left
+int nextFreeGap(SlotMask* freeSlots, int* slot, int* slots) {
+    if (*freeSlots == 0) return 0;
+    
+    *slot = __builtin_ctzll(*freeSlots);
+    
+    // SLOTS_PER_DAY < 64, so the run always ends at a clear bit
+    *slots = __builtin_ctzll(~(*freeSlots >> *slot));
+    *freeSlots &= ~((((SlotMask)1 << *slots) - 1) << *slot);
+    return 1;
+}
+
+static size_t hashDateKey(uint32_t key) {
+    uint32_t h = key * 2654435761u;
+    return (size_t)(h ^ (h >> 16));
+}
+
+// Finds the entry for a day; with create set, adds an empty one if missing
+DaySlots* findDayEntry(DaySlotIndex* index, uint32_t key, int create) {
+    if (index->capacity == 0) {
+        if (!create) return NULL;
+        
+        index->buckets = (DaySlots*)calloc(DAY_INDEX_INITIAL_CAPACITY, sizeof(DaySlots));
+        if (index->buckets == NULL) {
+            printf("Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        index->capacity = DAY_INDEX_INITIAL_CAPACITY;
+    } else if (create && (index->count + 1) * 10 > index->capacity * 7) {
+        // Keep the load factor under 0.7 so probe sequences stay short
+        DaySlots* old = index->buckets;
+        size_t oldCapacity = index->capacity;
+        
+        index->capacity *= 2;
+        index->buckets = (DaySlots*)calloc(index->capacity, sizeof(DaySlots));
+        if (index->buckets == NULL) {
+            printf("Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        
+        for (size_t i = 0; i < oldCapacity; i++) {
+            if (old[i].key == 0) continue;
+            
+            size_t j = hashDateKey(old[i].key) & (index->capacity - 1);
+            while (index->buckets[j].key != 0) {
+                j = (j + 1) & (index->capacity - 1);
+            }
+            index->buckets[j] = old[i];
+        }
+        
+        free(old);
+    }
+    
+    size_t i = hashDateKey(key) & (index->capacity - 1);
+    
+    while (index->buckets[i].key != 0) {
+        if (index->buckets[i].key == key) {
+            return &index->buckets[i];
+        }
+        i = (i + 1) & (index->capacity - 1);
+    }
+    
+    if (!create) return NULL;
+    
+    memset(&index->buckets[i], 0, sizeof(DaySlots));
+    index->buckets[i].key = key;
+    index->count++;
+    return &index->buckets[i];
+}
+
+// Finds the bitmap of appointments without a doctor for a day
+SlotMask* findDaySlots(DaySlotIndex* index, uint32_t key, int create) {
+    DaySlots* day = findDayEntry(index, key, create);
+    return day != NULL ? &day->booked : NULL;
+}
+
+// Finds one doctor's bitmap for a day, or the no-doctor bitmap for doctor 0
+SlotMask* findDoctorSlots(DaySlotIndex* index, uint32_t key, int doctor, int create) {
+    DaySlots* day = findDayEntry(index, key, create);
+    if (day == NULL) return NULL;
+    if (doctor == 0) return &day->booked;
+    
+    if ((uint32_t)doctor > day->doctorCount) {
+        if (!create) return NULL;
+        
+        SlotMask* doctors = (SlotMask*)realloc(day->doctors, (size_t)doctor * sizeof(SlotMask));
+        if (doctors == NULL) {
+            printf("Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        
+        memset(doctors + day->doctorCount, 0, (doctor - day->doctorCount) * sizeof(SlotMask));
+        day->doctors = doctors;
+        day->doctorCount = (uint32_t)doctor;
+    }
+    
+    return &day->doctors[doctor - 1];
+}
+
+// Rebuilds a tree over more days; new days have nothing booked
+static void growBookedTree(BookedTree* tree, size_t days) {
+    size_t size = tree->days != 0 ? tree->days : FREE_TREE_INITIAL_DAYS;
+    while (size < days) size *= 2;
+    
+    uint32_t* sums = (uint32_t*)realloc(tree->sums, (size + 1) * sizeof(uint32_t));
+    if (sums == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    // Undo the partial sums to get per-day counts back, extend, then redo them
+    for (size_t i = tree->days; i >= 1; i--) {
+        size_t parent = i + (i & -i);
+        if (parent <= tree->days) sums[parent] -= sums[i];
+    }
+    memset(sums + tree->days + 1, 0, (size - tree->days) * sizeof(uint32_t));
+    for (size_t i = 1; i <= size; i++) {
+        size_t parent = i + (i & -i);
+        if (parent <= size) sums[parent] += sums[i];
+    }
+    
+    sums[0] = 0;
+    tree->sums = sums;
+    tree->days = size;
+}
+
+// The tree of a calendar, added empty when a doctor's is first needed
+static BookedTree* calendarTree(DaySlotIndex* index, int doctor) {
+    if ((size_t)doctor >= index->treeCount) {
+        size_t count = (size_t)doctor + 1;
+        BookedTree* trees = (BookedTree*)realloc(index->trees, count * sizeof(BookedTree));
+        if (trees == NULL) {
+            printf("Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        
+        memset(trees + index->treeCount, 0, (count - index->treeCount) * sizeof(BookedTree));
+        index->trees = trees;
+        index->treeCount = count;
+    }
+    
+    return &index->trees[doctor];
+}
+
+// Adjusts the booked count of one day. Only days from the base day to the
+// booking horizon are tracked, so a record far in the future (or the past)
+// loaded from an older file costs nothing here.
+static void updateBookedTree(DaySlotIndex* index, BookedTree* tree, int32_t day, int delta) {
+    if (index->treeBase == 0) index->treeBase = dayNumber(currentDate());
+    if (day < index->treeBase || day - index->treeBase > HORIZON_DAYS) return;
+    
+    size_t offset = (size_t)(day - index->treeBase);
+    if (offset >= tree->days) growBookedTree(tree, offset + 1);
+    
+    for (size_t i = offset + 1; i <= tree->days; i += i & -i) {
+        tree->sums[i] += (uint32_t)delta;
+    }
+}
+
+// Sets or clears the bits of the slots an appointment covers in the day index
+void markSlot(AppointmentStore* store, Appointment* appointment, int booked) {
+    int hour, minute;
+    keyTime(appointment->key, &hour, &minute);
+    
+    int slot = slotIndex(hour, minute);
+    if (slot < 0) return; // Not on the slot grid, nothing to track
+    
+    int doctor = keyDoctor(appointment->key);
+    SlotMask* day = findDoctorSlots(&store->slots, (uint32_t)(appointment->key >> 32), doctor, booked);
+    if (day == NULL) return;
+    
+    SlotMask before = *day;
+    SlotMask run = slotRun(slot, appointment->duration);
+    if (booked) {
+        *day |= run;
+    } else {
+        *day &= ~run;
+    }
+    
+    // The trees follow the calendar and, for a doctor, all doctors together
+    if (*day != before) {
+        int32_t number = (int32_t)((uint32_t)(appointment->key >> 32) ^ 0x80000000u);
+        int delta = __builtin_popcountll(*day) - __builtin_popcountll(before);
+        updateBookedTree(&store->slots, calendarTree(&store->slots, doctor), number, delta);
+        if (doctor != 0) updateBookedTree(&store->slots, &store->slots.anyDoctor, number, delta);
+    }
+}
+
+// Earliest day on or after the given one on which fewer than perDay slots
+// are booked, as far as the tree knows. Days outside it are returned as
+// they are, for the caller to look at itself.
+static int32_t nextDayWithRoom(const DaySlotIndex* index, const BookedTree* tree, uint64_t perDay, int32_t day) {
+    if (tree == NULL || day < index->treeBase || (size_t)(day - index->treeBase) >= tree->days) return day;
+    
+    // Free slots before the day, then the first prefix that exceeds them.
+    // A step of the descent always covers step whole days.
+    size_t offset = (size_t)(day - index->treeBase);
+    uint64_t target = perDay * offset + 1;
+    for (size_t i = offset; i > 0; i -= i & -i) {
+        target -= tree->sums[i];
+    }
+    
+    size_t position = 0;
+    for (size_t step = tree->days; step > 0; step >>= 1) {
+        if (position + step > tree->days) continue;
+        
+        uint64_t free = perDay * step - tree->sums[position + step];
+        if (free < target) {
+            position += step;
+            target -= free;
+        }
+    }
+    
+    // Tree entry position + 1 is the day position days after the base; a
+    // search that runs off the end lands on the first uncovered day
+    return index->treeBase + (int32_t)position;
+}
+
+// Finds the earliest time at or after a date and time at which an appointment
+// of the given length fits on one calendar (see bookedSlots). Returns 0 if
+// the date is out of range for the calendar, the length is not valid or
+// there is no such doctor.
+int findNextFreeSlot(AppointmentStore* store, Date from, int hour, int minute, int doctor, int duration,
+                     Date* date, int* slotHour, int* slotMinute) {
+    if (calendarProblem(from) != NULL || !isDurationValid(duration)) return 0;
+    if (doctor != 0 && (store->doctors.count == 0 || doctor > (int)store->doctors.count)) return 0;
+    
+    int32_t day = dayNumber(from);
+    
+    // Start slots on the first day that are not earlier than the given time
+    int first = (hour - START_HOUR) * 60 + minute;
+    first = first <= 0 ? 0 : (first + SLOT_MINUTES - 1) / SLOT_MINUTES;
+    SlotMask later = first >= SLOTS_PER_DAY ? 0 : ALL_SLOTS_MASK & ~(((SlotMask)1 << first) - 1);
+    SlotMask starts = later & freeStarts(store, from, doctor, duration);
+    
+    // The trees skip days on which the calendar is fully booked, or for
+    // DOCTOR_ANY every doctor's is; a day they land on may still have no gap
+    // long enough, or be taken by series they do not count, in which case
+    // the search carries on from the day after. Only days with bookings or
+    // series can be full, and every series ends, so the walk ends.
+    const BookedTree* tree = NULL;
+    uint64_t perDay = SLOTS_PER_DAY;
+    if (doctor == DOCTOR_ANY) {
+        tree = &store->slots.anyDoctor;
+        perDay *= store->doctors.count;
+    } else if ((size_t)doctor < store->slots.treeCount) {
+        tree = &store->slots.trees[doctor];
+    }
+    
+    while (starts == 0) {
+        day = nextDayWithRoom(&store->slots, tree, perDay, day + 1);
+        starts = freeStarts(store, dateFromDayNumber(day), doctor, duration);
+    }
+    
+    int minutes = __builtin_ctzll(starts) * SLOT_MINUTES;
+    *date = dateFromDayNumber(day);
+    *slotHour = START_HOUR + minutes / 60;
+    *slotMinute = minutes % 60;
+    return 1;
+}
+
+void freeDaySlotIndex(DaySlotIndex* index) {
+    for (size_t i = 0; i < index->capacity; i++) {
+        free(index->buckets[i].doctors);
+    }
+    free(index->buckets);
+    index->buckets = NULL;
+    index->capacity = 0;
+    index->count = 0;
+    for (size_t i = 0; i < index->treeCount; i++) {
+        free(index->trees[i].sums);
+    }
+    free(index->trees);
+    free(index->anyDoctor.sums);
+    index->trees = NULL;
+    index->treeCount = 0;
+    memset(&index->anyDoctor, 0, sizeof(BookedTree));
+    index->treeBase = 0;
+}
+
+// Finds the entry for an encrypted name; with create set, adds an empty one,
+// in which case name must be interned
+static NameEntry* findNameEntry(NameIndex* index, const char* name, int create) {
+    if (index->tableCapacity == 0) {
+        if (!create) return NULL;
+        
+        index->tableCapacity = NAME_INDEX_INITIAL_CAPACITY;
+        index->table = (NameEntry**)calloc(index->tableCapacity, sizeof(NameEntry*));
+        if (index->table == NULL) {
+            printf("Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    size_t mask = index->tableCapacity - 1;
+    size_t i = hashString(name) & mask;
+    
+    while (index->table[i] != NULL) {
+        if (strcmp(index->table[i]->name, name) == 0) {
+            return index->table[i];
+        }
+        i = (i + 1) & mask;
+    }
+    
+    if (!create) return NULL;
+    
+    NameEntry* entry = (NameEntry*)calloc(1, sizeof(NameEntry));
+    if (entry == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    entry->name = name;
+    index->table[i] = entry;
+    
+    // Insert into the name-ordered array at its sorted position
+    if (index->count == index->sortedCapacity) {
+        index->sortedCapacity = index->sortedCapacity > 0 ? index->sortedCapacity * 2 : NAME_INDEX_INITIAL_CAPACITY;
+        NameEntry** grown = (NameEntry**)realloc(index->sorted, index->sortedCapacity * sizeof(NameEntry*));
+        if (grown == NULL) {
+            printf("Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        index->sorted = grown;
+    }
+    
+    size_t low = 0, high = index->count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (strcmp(index->sorted[mid]->name, name) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    
+    memmove(&index->sorted[low + 1], &index->sorted[low], (index->count - low) * sizeof(NameEntry*));
+    index->sorted[low] = entry;
+    index->count++;
+    
+    // Keep the hash table under half full
+    if (index->count * 2 > index->tableCapacity) {
+        NameEntry** old = index->table;
+        size_t oldCapacity = index->tableCapacity;
+        
+        index->tableCapacity *= 2;
+        index->table = (NameEntry**)calloc(index->tableCapacity, sizeof(NameEntry*));
+        if (index->table == NULL) {
+            printf("Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        
+        for (size_t j = 0; j < oldCapacity; j++) {
+            if (old[j] == NULL) continue;
+            
+            size_t k = hashString(old[j]->name) & (index->tableCapacity - 1);
+            while (index->table[k] != NULL) {
+                k = (k + 1) & (index->tableCapacity - 1);
+            }
+            index->table[k] = old[j];
+        }
+        
+        free(old);
+    }
+    
+    return entry;
+}
+
+// Position of the first appointment in an entry not ordered before target
+static size_t lowerBoundInEntry(const NameEntry* entry, const Appointment* target) {
+    size_t low = 0, high = entry->count;
+    
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (entry->items[mid]->key < target->key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    
+    return low;
+}
+
+static void growNameEntry(NameEntry* entry) {
+    entry->capacity = entry->capacity > 0 ? entry->capacity * 2 : 4;
+    Appointment** grown = (Appointment**)realloc(entry->items, entry->capacity * sizeof(Appointment*));
+    if (grown == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    entry->items = grown;
+}
+
+// Adds an appointment under its name, keeping the entry in date order
+void addToNameIndex(NameIndex* index, Appointment* appointment) {
+    NameEntry* entry = findNameEntry(index, appointment->name, 1);
+    
+    if (entry->count == entry->capacity) growNameEntry(entry);
+    
+    // Appends in the common case of a later booking, so bulk loads stay linear
+    size_t position = entry->count;
+    if (position > 0 && entry->items[position - 1]->key > appointment->key) {
+        position = lowerBoundInEntry(entry, appointment);
+    }
+    
+    memmove(&entry->items[position + 1], &entry->items[position],
+            (entry->count - position) * sizeof(Appointment*));
+    entry->items[position] = appointment;
+    entry->count++;
+}
+
+// Names are interned, so while building the index the pointer stands for
+// the text. The top bits pick the part of a parallel build, lower ones the
+// bucket within it.
+static uint64_t hashNamePointer(const char* name) {
+    return (uint64_t)(uintptr_t)name * 0x9E3779B97F4A7C15ull;
+}
+
+static int namePart(const char* name, int parts) {
+    return (int)(((hashNamePointer(name) >> 32) * (uint64_t)parts) >> 32);
+}
+
+// Groups the appointments of one part's names by name, in node order
+static void* buildNameIndexPart(void* argument) {
+    NameIndexPart* part = (NameIndexPart*)argument;
+    
+    for (size_t i = 0; i < part->count; i++) {
+        Appointment* node = &part->nodes[i];
+        if (part->parts > 1 && namePart(node->name, part->parts) != part->part) continue;
+        
+        if (part->entries * 2 >= part->capacity) {
+            NameEntry** old = part->table;
+            size_t oldCapacity = part->capacity;
+            
+            part->capacity = oldCapacity > 0 ? oldCapacity * 2 : NAME_INDEX_INITIAL_CAPACITY;
+            part->table = (NameEntry**)calloc(part->capacity, sizeof(NameEntry*));
+            if (part->table == NULL) {
+                printf("Memory allocation failed.\n");
+                exit(EXIT_FAILURE);
+            }
+            
+            for (size_t j = 0; j < oldCapacity; j++) {
+                if (old[j] == NULL) continue;
+                
+                size_t k = (size_t)(hashNamePointer(old[j]->name) >> 16) & (part->capacity - 1);
+                while (part->table[k] != NULL) k = (k + 1) & (part->capacity - 1);
+                part->table[k] = old[j];
+            }
+            free(old);
+        }
+        
+        size_t k = (size_t)(hashNamePointer(node->name) >> 16) & (part->capacity - 1);
+        while (part->table[k] != NULL && part->table[k]->name != node->name) {
+            k = (k + 1) & (part->capacity - 1);
+        }
+        
+        NameEntry* entry = part->table[k];
+        if (entry == NULL) {
+            entry = (NameEntry*)calloc(1, sizeof(NameEntry));
+            if (entry == NULL) {
+                printf("Memory allocation failed.\n");
+                exit(EXIT_FAILURE);
+            }
+            entry->name = node->name;
+            part->table[k] = entry;
+            part->entries++;
+        }
+        
+        if (entry->count == entry->capacity) growNameEntry(entry);
+        entry->items[entry->count++] = node;
+    }
+    
+    return NULL;
+}
+
+static int compareNameEntries(const void* a, const void* b) {
+    return strcmp((*(NameEntry* const*)a)->name, (*(NameEntry* const*)b)->name);
+}
+
+// Fills an empty name index from nodes in date and time order. Each thread
+// groups the appointments of its share of the names, then the entries are
+// hashed and sorted once, instead of being looked up per appointment.
+void buildNameIndex(NameIndex* index, Appointment* nodes, size_t count, int threads) {
+    NameIndexPart parts[LOAD_MAX_THREADS];
+    
+    memset(parts, 0, sizeof(parts));
+    for (int t = 0; t < threads; t++) {
+        parts[t].nodes = nodes;
+        parts[t].count = count;
+        parts[t].part = t;
+        parts[t].parts = threads;
+    }
+    runInParallel(buildNameIndexPart, parts, sizeof(NameIndexPart), threads);
+    
+    size_t entries = 0;
+    for (int t = 0; t < threads; t++) entries += parts[t].entries;
+    if (entries == 0) return;
+    
+    // Sized as adding the names one at a time would have left them
+    index->tableCapacity = NAME_INDEX_INITIAL_CAPACITY;
+    while (entries * 2 > index->tableCapacity) index->tableCapacity *= 2;
+    index->sortedCapacity = NAME_INDEX_INITIAL_CAPACITY;
+    while (entries > index->sortedCapacity) index->sortedCapacity *= 2;
+    
+    index->table = (NameEntry**)calloc(index->tableCapacity, sizeof(NameEntry*));
+    index->sorted = (NameEntry**)malloc(index->sortedCapacity * sizeof(NameEntry*));
+    if (index->table == NULL || index->sorted == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    size_t mask = index->tableCapacity - 1;
+    for (int t = 0; t < threads; t++) {
+        for (size_t j = 0; j < parts[t].capacity; j++) {
+            NameEntry* entry = parts[t].table[j];
+            if (entry == NULL) continue;
+            
+            size_t i = hashString(entry->name) & mask;
+            while (index->table[i] != NULL) i = (i + 1) & mask;
+            index->table[i] = entry;
+            index->sorted[index->count++] = entry;
+        }
+        free(parts[t].table);
+    }
+    
+    qsort(index->sorted, index->count, sizeof(NameEntry*), compareNameEntries);
+}
+
+// Drops an appointment from its name's entry. Empty entries stay behind so
+// the hash table never needs tombstones; prefix queries skip them.
+void removeFromNameIndex(NameIndex* index, Appointment* appointment) {
+    NameEntry* entry = findNameEntry(index, appointment->name, 0);
+    if (entry == NULL) return;
+    
+    size_t position = lowerBoundInEntry(entry, appointment);
+    while (position < entry->count && entry->items[position] != appointment) {
+        position++;
+    }
+    if (position == entry->count) return;
+    
+    memmove(&entry->items[position], &entry->items[position + 1],
+            (entry->count - position - 1) * sizeof(Appointment*));
+    entry->count--;
+}
+
+// Visits the appointments whose encrypted name equals query, or starts with
+// it when prefix is set, in date and time order. Returns how many matched.
+size_t searchNameIndex(NameIndex* index, const char* query, int prefix,
+                       void (*visit)(const Appointment*, void*), void* context) {
+    if (!prefix) {
+        NameEntry* entry = findNameEntry(index, query, 0);
+        if (entry == NULL) return 0;
+        
+        for (size_t i = 0; i < entry->count; i++) {
+            visit(entry->items[i], context);
+        }
+        return entry->count;
+    }
+    
+    // Names sharing the prefix form one run of the sorted array
+    size_t length = strlen(query);
+    size_t low = 0, high = index->count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (strcmp(index->sorted[mid]->name, query) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    
+    size_t end = low;
+    while (end < index->count && strncmp(index->sorted[end]->name, query, length) == 0) {
+        end++;
+    }
+    
+    // Merge the matching entries by date with a min-heap of cursors
+    size_t heapSize = 0;
+    NameCursor* heap = (NameCursor*)malloc((end - low + 1) * sizeof(NameCursor));
+    if (heap == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    for (size_t i = low; i < end; i++) {
+        if (index->sorted[i]->count == 0) continue;
+        
+        NameCursor cursor = {index->sorted[i], 0};
+        size_t child = heapSize++;
+        while (child > 0) {
+            size_t parent = (child - 1) / 2;
+            if (compareAppointments(heap[parent].entry->items[heap[parent].position],
+                                    cursor.entry->items[0]) <= 0) break;
+            heap[child] = heap[parent];
+            child = parent;
+        }
+        heap[child] = cursor;
+    }
+    
+    size_t matched = 0;
+    
+    while (heapSize > 0) {
+        NameCursor* top = &heap[0];
+        visit(top->entry->items[top->position], context);
+        matched++;
+        
+        NameCursor cursor = *top;
+        cursor.position++;
+        if (cursor.position == cursor.entry->count) {
+            cursor = heap[--heapSize];
+            if (heapSize == 0) break;
+        }
+        
+        // Sift the cursor down from the root
+        size_t parent = 0;
+        while (1) {
+            size_t child = parent * 2 + 1;
+            if (child >= heapSize) break;
+            if (child + 1 < heapSize &&
+                compareAppointments(heap[child + 1].entry->items[heap[child + 1].position],
+                                    heap[child].entry->items[heap[child].position]) < 0) {
+                child++;
+            }
+            if (compareAppointments(heap[child].entry->items[heap[child].position],
+                                    cursor.entry->items[cursor.position]) >= 0) break;
+            heap[parent] = heap[child];
+            parent = child;
+        }
+        heap[parent] = cursor;
+    }
+    
+    free(heap);
+    return matched;
+}
+
+void freeNameIndex(NameIndex* index) {
+    for (size_t i = 0; i < index->count; i++) {
+        free(index->sorted[i]->items);
+        free(index->sorted[i]);
+    }
+    
+    free(index->sorted);
+    free(index->table);
+    memset(index, 0, sizeof(*index));
+}
+
+// Returns the pooled copy of text, adding it on first use. The copy lives
+// until the pool is freed, so appointments can share it.
+const char* internString(StringPool* pool, const char* text) {
+    if (pool->count * 2 >= pool->capacity) {
+        // Keep the table under half full
+        const char** old = pool->table;
+        size_t oldCapacity = pool->capacity;
+        
+        pool->capacity = oldCapacity > 0 ? oldCapacity * 2 : STRING_TABLE_INITIAL_CAPACITY;
+        pool->table = (const char**)calloc(pool->capacity, sizeof(const char*));
+        if (pool->table == NULL) {
+            printf("Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        
+        for (size_t i = 0; i < oldCapacity; i++) {
+            if (old[i] == NULL) continue;
+            
+            size_t j = hashString(old[i]) & (pool->capacity - 1);
+            while (pool->table[j] != NULL) {
+                j = (j + 1) & (pool->capacity - 1);
+            }
+            pool->table[j] = old[i];
+        }
+        
+        free(old);
+    }
+    
+    size_t i = hashString(text) & (pool->capacity - 1);
+    
+    while (pool->table[i] != NULL) {
+        if (strcmp(pool->table[i], text) == 0) return pool->table[i];
+        i = (i + 1) & (pool->capacity - 1);
+    }
+    
+    size_t length = strlen(text) + 1;
+    if (pool->chunks == NULL || pool->chunks->used + length > STRING_CHUNK_BYTES) {
+        StringChunk* chunk = (StringChunk*)malloc(sizeof(StringChunk));
+        if (chunk == NULL) {
+            printf("Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        chunk->next = pool->chunks;
+        chunk->used = 0;
+        pool->chunks = chunk;
+    }
+    
+    char* copy = pool->chunks->text + pool->chunks->used;
+    memcpy(copy, text, length);
+    pool->chunks->used += length;
+    pool->bytes += length;
+    pool->table[i] = copy;
+    pool->count++;
+    return copy;
+}
+
+void freeStringPool(StringPool* pool) {
+    while (pool->chunks != NULL) {
+        StringChunk* next = pool->chunks->next;
+        free(pool->chunks);
+        pool->chunks = next;
+    }
+    
+    free(pool->table);
+    memset(pool, 0, sizeof(*pool));
+}
+
+// Orders appointments by date, then time
+int compareAppointments(const Appointment* a, const Appointment* b) {
+    return (a->key > b->key) - (a->key < b->key);
+}
+
+// Draws a tower height with P(height >= k) = SKIP_BRANCHING^-k
+static int randomSkipLevel(AppointmentStore* store) {
+    int level = 0;
+    
+    // xorshift32; the seed only has to be non-zero
+    if (store->seed == 0) store->seed = 2463534242u;
+    store->seed ^= store->seed << 13;
+    store->seed ^= store->seed >> 17;
+    store->seed ^= store->seed << 5;
+    
+    uint32_t bits = store->seed;
+    while (level < SKIP_MAX_LEVEL && bits % SKIP_BRANCHING == 0) {
+        level++;
+        bits /= SKIP_BRANCHING;
+    }
+    
+    return level;
+}
+
+// Descends the index to the last node ordered before target (or, with
+// inclusive set, not after it). Records the index entry it left each level
+// from in update, when given.
+static Appointment* skipSearch(AppointmentStore* store, AppointmentKey target,
+                               int inclusive, SkipIndex** update) {
+    Appointment* pred = NULL;
+    SkipIndex* x = store->level > 0 ? &store->levels[store->level - 1] : NULL;
+    
+    for (int level = store->level - 1; level >= 0; level--) {
+        while (x->right != NULL && (x->right->key < target || (inclusive && x->right->key == target))) {
+            x = x->right;
+        }
+        
+        if (update != NULL) update[level] = x;
+        if (x->node != NULL) pred = x->node;
+        x = x->down;
+    }
+    
+    // Finish along the appointment list itself
+    Appointment* current = pred != NULL ? pred->next : store->head;
+    while (current != NULL && (current->key < target || (inclusive && current->key == target))) {
+        pred = current;
+        current = current->next;
+    }
+    
+    return pred;
+}
+
+// Extends the day counts to cover a day number; new days have nothing booked
+static void growDayReports(Reports* reports, size_t days) {
+    size_t size = reports->dayCount != 0 ? reports->dayCount : FREE_TREE_INITIAL_DAYS;
+    while (size < days) size *= 2;
+    
+    DayReport* grown = (DayReport*)realloc(reports->days, size * sizeof(DayReport));
+    if (grown == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    memset(&grown[reports->dayCount], 0, (size - reports->dayCount) * sizeof(DayReport));
+    reports->days = grown;
+    reports->dayCount = size;
+}
+
+static void growMonthReports(Reports* reports, size_t months) {
+    size_t size = reports->monthCount != 0 ? reports->monthCount : REPORT_INITIAL_MONTHS;
+    while (size < months) size *= 2;
+    
+    MonthReport* grown = (MonthReport*)realloc(reports->months, size * sizeof(MonthReport));
+    if (grown == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    memset(&grown[reports->monthCount], 0, (size - reports->monthCount) * sizeof(MonthReport));
+    reports->months = grown;
+    reports->monthCount = size;
+}
+
+// The counts of a day number the reports cover
+DayReport* dayReport(const Reports* reports, int32_t day) {
+    return &reports->days[day - reports->firstDay];
+}
+
+// Whether one day ranks above another: more slots booked, then more
+// appointments, then the earlier day
+static int busierDay(const Reports* reports, int32_t day, int32_t other) {
+    const DayReport* first = dayReport(reports, day);
+    const DayReport* second = dayReport(reports, other);
+    
+    if (first->slots != second->slots) return first->slots > second->slots;
+    if (first->appointments != second->appointments) return first->appointments > second->appointments;
+    return day < other;
+}
+
+static void placeInHeap(Reports* reports, size_t position, int32_t day) {
+    reports->heap[position] = day;
+    dayReport(reports, day)->heapPosition = (uint32_t)position;
+}
+
+// Moves a day up or down the heap to where its counts now put it
+static void siftDay(Reports* reports, int32_t day) {
+    size_t position = dayReport(reports, day)->heapPosition;
+    
+    while (position > 1 && busierDay(reports, day, reports->heap[position / 2])) {
+        placeInHeap(reports, position, reports->heap[position / 2]);
+        position /= 2;
+    }
+    
+    while (position * 2 <= reports->heapSize) {
+        size_t child = position * 2;
+        if (child < reports->heapSize && busierDay(reports, reports->heap[child + 1], reports->heap[child])) child++;
+        if (!busierDay(reports, reports->heap[child], day)) break;
+        placeInHeap(reports, position, reports->heap[child]);
+        position = child;
+    }
+    
+    placeInHeap(reports, position, day);
+}
+
+// Keeps a day in the heap for as long as anything is booked on it
+static void updateDayHeap(Reports* reports, int32_t day) {
+    DayReport* report = dayReport(reports, day);
+    
+    if (report->heapPosition == 0) {
+        if (report->appointments == 0) return;
+        
+        if (reports->heapSize + 1 >= reports->heapCapacity) {
+            size_t capacity = reports->heapCapacity == 0 ? 64 : reports->heapCapacity * 2;
+            int32_t* heap = (int32_t*)realloc(reports->heap, capacity * sizeof(int32_t));
+            if (heap == NULL) {
+                printf("Memory allocation failed.\n");
+                exit(EXIT_FAILURE);
+            }
+            reports->heap = heap;
+            reports->heapCapacity = capacity;
+        }
+        
+        placeInHeap(reports, ++reports->heapSize, day);
+    } else if (report->appointments == 0) {
+        // The last day in the heap takes the emptied day's place
+        size_t position = report->heapPosition;
+        int32_t last = reports->heap[reports->heapSize--];
+        report->heapPosition = 0;
+        if (last == day) return;
+        
+        placeInHeap(reports, position, last);
+        day = last;
+    }
+    
+    siftDay(reports, day);
+}
+
+// The counter for an illness, added at zero the first time it is seen.
+// Illnesses are interned, so the pointer stands for the text.
+static IllnessCount* findIllnessCount(Reports* reports, const char* illness) {
+    if (reports->illnessCount * 2 >= reports->illnessCapacity) {
+        size_t capacity = reports->illnessCapacity == 0 ? REPORT_ILLNESS_INITIAL_CAPACITY : reports->illnessCapacity * 2;
+        IllnessCount* table = (IllnessCount*)calloc(capacity, sizeof(IllnessCount));
+        if (table == NULL) {
+            printf("Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        
+        for (size_t i = 0; i < reports->illnessCapacity; i++) {
+            if (reports->illnesses[i].illness == NULL) continue;
+            
+            size_t k = (size_t)(hashNamePointer(reports->illnesses[i].illness) >> 16) & (capacity - 1);
+            while (table[k].illness != NULL) k = (k + 1) & (capacity - 1);
+            table[k] = reports->illnesses[i];
+        }
+        
+        free(reports->illnesses);
+        reports->illnesses = table;
+        reports->illnessCapacity = capacity;
+    }
+    
+    size_t mask = reports->illnessCapacity - 1;
+    size_t k = (size_t)(hashNamePointer(illness) >> 16) & mask;
+    while (reports->illnesses[k].illness != NULL && reports->illnesses[k].illness != illness) k = (k + 1) & mask;
+    
+    if (reports->illnesses[k].illness == NULL) {
+        reports->illnesses[k].illness = illness;
+        reports->illnessCount++;
+    }
+    return &reports->illnesses[k];
+}
+
+static size_t reminderBucket(const ReminderWheel* wheel, AppointmentKey key) {
+    return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & (wheel->bucketCount - 1);
+}
+
+// Puts a reminder in the slot for its due time, on the lowest level it is
+// less than a lap ahead on. A level's slot is only ever entered at its
+// start, so a reminder a whole lap ahead on its level still waits there.
+static void placeReminder(ReminderWheel* wheel, Reminder* reminder) {
+    int level = 0;
+    while (level < REMINDER_WHEEL_LEVELS &&
+           (reminder->due >> (REMINDER_WHEEL_BITS * level)) - (wheel->now >> (REMINDER_WHEEL_BITS * level)) >=
+               REMINDER_WHEEL_SLOTS) {
+        level++;
+    }
+    
+    Reminder** head = &wheel->overflow;
+    reminder->level = (uint8_t)level;
+    if (level < REMINDER_WHEEL_LEVELS) {
+        reminder->slot = (uint8_t)((reminder->due >> (REMINDER_WHEEL_BITS * level)) & (REMINDER_WHEEL_SLOTS - 1));
+        head = &wheel->slots[level][reminder->slot];
+        wheel->occupied[level] |= (uint64_t)1 << reminder->slot;
+    }
+    
+    reminder->prev = NULL;
+    reminder->next = *head;
+    if (*head != NULL) (*head)->prev = reminder;
+    *head = reminder;
+}
+
+static void unlinkReminder(ReminderWheel* wheel, Reminder* reminder) {
+    Reminder** head = reminder->level < REMINDER_WHEEL_LEVELS ? &wheel->slots[reminder->level][reminder->slot]
+                                                              : &wheel->overflow;
+    
+    if (reminder->prev != NULL) reminder->prev->next = reminder->next; else *head = reminder->next;
+    if (reminder->next != NULL) reminder->next->prev = reminder->prev;
+    if (*head == NULL && reminder->level < REMINDER_WHEEL_LEVELS) {
+        wheel->occupied[reminder->level] &= ~((uint64_t)1 << reminder->slot);
+    }
+}
+
+static void growReminderBuckets(ReminderWheel* wheel) {
+    size_t count = wheel->bucketCount == 0 ? REMINDER_INITIAL_BUCKETS : wheel->bucketCount * 2;
+    Reminder** buckets = (Reminder**)calloc(count, sizeof(Reminder*));
+    if (buckets == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    Reminder** old = wheel->buckets;
+    size_t oldCount = wheel->bucketCount;
+    wheel->buckets = buckets;
+    wheel->bucketCount = count;
+    
+    for (size_t i = 0; i < oldCount; i++) {
+        while (old[i] != NULL) {
+            Reminder* reminder = old[i];
+            old[i] = reminder->sameBucket;
+            size_t bucket = reminderBucket(wheel, reminder->key);
+            reminder->sameBucket = buckets[bucket];
+            buckets[bucket] = reminder;
+        }
+    }
+    free(old);
+}
+
+// Sets up the reminders of an appointment, one per lead time, leaving out
+// those whose time has already passed
+static void scheduleReminders(ReminderWheel* wheel, AppointmentKey key, const char* name) {
+    int hour, minute;
+    keyTime(key, &hour, &minute);
+    int64_t start = (int64_t)((int32_t)((uint32_t)(key >> 32) ^ 0x80000000u)) * 1440 + hour * 60 + minute;
+    
+    for (int i = 0; i < wheel->leadCount; i++) {
+        if (start - wheel->leads[i] <= wheel->now) continue;
+        
+        if (wheel->count >= wheel->bucketCount) growReminderBuckets(wheel);
+        
+        wheel->pool.objectSize = sizeof(Reminder);
+        Reminder* reminder = (Reminder*)poolAlloc(&wheel->pool);
+        reminder->key = key;
+        reminder->due = start - wheel->leads[i];
+        reminder->name = name;
+        reminder->lead = wheel->leads[i];
+        placeReminder(wheel, reminder);
+        
+        size_t bucket = reminderBucket(wheel, key);
+        reminder->sameBucket = wheel->buckets[bucket];
+        wheel->buckets[bucket] = reminder;
+        wheel->count++;
+    }
+}
+
+// Takes a reminder out of its hash chain
+static void forgetReminder(ReminderWheel* wheel, Reminder* reminder) {
+    Reminder** link = &wheel->buckets[reminderBucket(wheel, reminder->key)];
+    while (*link != reminder) link = &(*link)->sameBucket;
+    *link = reminder->sameBucket;
+    wheel->count--;
+}
+
+// Drops the reminders still to come for an appointment
+static void cancelReminders(ReminderWheel* wheel, AppointmentKey key) {
+    if (wheel->count == 0) return;
+    
+    Reminder** link = &wheel->buckets[reminderBucket(wheel, key)];
+    while (*link != NULL) {
+        Reminder* reminder = *link;
+        if (reminder->key != key) {
+            link = &reminder->sameBucket;
+            continue;
+        }
+        
+        *link = reminder->sameBucket;
+        unlinkReminder(wheel, reminder);
+        poolFree(&wheel->pool, reminder);
+        wheel->count--;
+    }
+}
+
+// Moves the reminders of one slot a level or more down, now that the clock
+// has reached its start
+static void cascadeReminders(ReminderWheel* wheel, Reminder** head) {
+    Reminder* reminder = *head;
+    *head = NULL;
+    
+    while (reminder != NULL) {
+        Reminder* next = reminder->next;
+        placeReminder(wheel, reminder);
+        reminder = next;
+    }
+}
+
+// First minute after the wheel's clock at which a slot holding reminders
+// starts, or INT64_MAX when none does
+static int64_t nextReminderEvent(const ReminderWheel* wheel) {
+    int64_t next = INT64_MAX;
+    
+    for (int level = 0; level < REMINDER_WHEEL_LEVELS; level++) {
+        if (wheel->occupied[level] == 0) continue;
+        
+        // Slots after the current one are in this lap; the rest, the
+        // current one included, are in the next
+        int shift = REMINDER_WHEEL_BITS * level;
+        int64_t block = wheel->now >> shift;
+        int current = (int)(block & (REMINDER_WHEEL_SLOTS - 1));
+        int rotate = (current + 1) & (REMINDER_WHEEL_SLOTS - 1);
+        uint64_t ahead = rotate == 0 ? wheel->occupied[level]
+                                     : (wheel->occupied[level] >> rotate) | (wheel->occupied[level] << (64 - rotate));
+        int64_t start = (block + __builtin_ctzll(ahead) + 1) << shift;
+        if (start < next) next = start;
+    }
+    
+    // The overflow is looked at again whenever the top level moves on a slot
+    if (wheel->overflow != NULL) {
+        int shift = REMINDER_WHEEL_BITS * (REMINDER_WHEEL_LEVELS - 1);
+        int64_t start = ((wheel->now >> shift) + 1) << shift;
+        if (start < next) next = start;
+    }
+    
+    return next;
+}
+
+// Moves the wheel's clock forward to a minute, sending every reminder that
+// falls due on the way to the wheel's sink in due order. Empty stretches
+// are skipped in one step. The caller holds the structure lock.
+void advanceReminders(AppointmentStore* store, int64_t until) {
+    ReminderWheel* wheel = store->reminders;
+    
+    while (wheel->now < until) {
+        int64_t next = nextReminderEvent(wheel);
+        if (next > until) {
+            wheel->now = until;
+            break;
+        }
+        
+        wheel->now = next;
+        for (int level = REMINDER_WHEEL_LEVELS - 1; level > 0; level--) {
+            int shift = REMINDER_WHEEL_BITS * level;
+            if ((next & (((int64_t)1 << shift) - 1)) != 0) continue;
+            
+            int slot = (int)((next >> shift) & (REMINDER_WHEEL_SLOTS - 1));
+            wheel->occupied[level] &= ~((uint64_t)1 << slot);
+            cascadeReminders(wheel, &wheel->slots[level][slot]);
+            if (level == REMINDER_WHEEL_LEVELS - 1) cascadeReminders(wheel, &wheel->overflow);
+        }
+        
+        // Everything left in this level 0 slot is due now
+        int slot = (int)(next & (REMINDER_WHEEL_SLOTS - 1));
+        Reminder* due = wheel->slots[0][slot];
+        wheel->slots[0][slot] = NULL;
+        wheel->occupied[0] &= ~((uint64_t)1 << slot);
+        
+        while (due != NULL) {
+            Reminder* reminder = due;
+            due = reminder->next;
+            forgetReminder(wheel, reminder);
+            wheel->deliver(store, reminder, wheel->context);
+            wheel->delivered++;
+            poolFree(&wheel->pool, reminder);
+        }
+    }
+    
+    if (wheel->log != NULL) fflush(wheel->log);
+}
+
+// Adds (delta 1) or takes away (delta -1) one appointment, stored or an
+// occurrence of a series, in every count it belongs to, and schedules or
+// drops its reminders. Slots are those of the day bitmaps, so appointments
+// off the slot grid count as appointments only; days before 1970 count
+// only in the totals.
+static void trackBooking(AppointmentStore* store, AppointmentKey key, int duration, const char* name,
+                         const char* illness, int delta) {
+    Reports* reports = &store->reports;
+    int hour, minute;
+    keyTime(key, &hour, &minute);
+    
+    int32_t day = (int32_t)((uint32_t)(key >> 32) ^ 0x80000000u);
+    int slot = slotIndex(hour, minute);
+    uint32_t slots = slot >= 0 ? (uint32_t)__builtin_popcountll(slotRun(slot, duration)) : 0;
+    
+    if (store->reminders != NULL) {
+        if (delta > 0) {
+            scheduleReminders(store->reminders, key, name);
+        } else {
+            cancelReminders(store->reminders, key);
+        }
+    }
+    
+    reports->appointments += (uint64_t)(int64_t)delta;
+    reports->slots += (uint64_t)(int64_t)delta * slots;
+    findIllnessCount(reports, illness)->appointments += (uint64_t)(int64_t)delta;
+    
+    if (reports->dayCount == 0) {
+        Date today = currentDate();
+        reports->firstDay = dayNumber(today);
+        reports->firstMonth = today.year * 12 + today.month - 1;
+    }
+    if (day < reports->firstDay || day - reports->firstDay > HORIZON_DAYS) return;
+    
+    size_t offset = (size_t)(day - reports->firstDay);
+    if (offset >= reports->dayCount) growDayReports(reports, offset + 1);
+    reports->days[offset].appointments += (uint32_t)delta;
+    reports->days[offset].slots += (uint32_t)delta * slots;
+    updateDayHeap(reports, day);
+    
+    Date date = dateFromDayNumber(day);
+    size_t month = (size_t)(date.year * 12 + date.month - 1 - reports->firstMonth);
+    if (month >= reports->monthCount) growMonthReports(reports, month + 1);
+    reports->months[month].appointments += (uint32_t)delta;
+    reports->months[month].slots += (uint32_t)delta * slots;
+}
+
+void trackAppointment(AppointmentStore* store, const Appointment* appointment, int delta) {
+    trackBooking(store, appointment->key, appointment->duration, appointment->name, appointment->illness, delta);
+}
+
+// A series keeps its name and illness in the rule; interning them makes
+// the occurrences count together with appointments for the same illness
+// and gives reminders a name that stays put when the series list moves
+void trackOccurrence(AppointmentStore* store, const Series* series, int occurrence, int delta) {
+    Date date = dateFromDayNumber(series->firstDay + occurrence * series->interval);
+    trackBooking(store, makeKey(date, series->hour, series->minute, series->doctor), series->duration,
+                 internString(&store->strings, series->name), internString(&store->strings, series->illness), delta);
+}
+
+// Tracks every occurrence of a series that has not been cancelled
+void trackSeries(AppointmentStore* store, const Series* series, int delta) {
+    const char* name = internString(&store->strings, series->name);
+    const char* illness = internString(&store->strings, series->illness);
+    
+    for (int k = 0; k < series->occurrences; k++) {
+        if (isOccurrenceSkipped(series, k)) continue;
+        
+        Date date = dateFromDayNumber(series->firstDay + k * series->interval);
+        trackBooking(store, makeKey(date, series->hour, series->minute, series->doctor), series->duration, name,
+                     illness, delta);
+    }
+}
+
+// Fills days with up to count of the busiest days, busiest first. The next
+// busiest is always a child in the heap of one already taken, so this looks
+// at fewer than 2 * count entries however many days are booked.
+size_t busiestDays(const Reports* reports, size_t count, int32_t* days) {
+    size_t waiting[REPORT_MAX_DAYS + 1];
+    size_t candidates = 0, found = 0;
+    
+    if (count > REPORT_MAX_DAYS) count = REPORT_MAX_DAYS;
+    if (reports->heapSize > 0) waiting[candidates++] = 1;
+    
+    while (found < count && candidates > 0) {
+        size_t best = 0;
+        for (size_t i = 1; i < candidates; i++) {
+            if (busierDay(reports, reports->heap[waiting[i]], reports->heap[waiting[best]])) best = i;
+        }
+        
+        size_t position = waiting[best];
+        waiting[best] = waiting[--candidates];
+        days[found++] = reports->heap[position];
+        
+        for (size_t child = position * 2; child <= position * 2 + 1 && child <= reports->heapSize; child++) {
+            waiting[candidates++] = child;
+        }
+    }
+    
+    return found;
+}
+
+void freeReports(Reports* reports) {
+    free(reports->days);
+    free(reports->months);
+    free(reports->heap);
+    free(reports->illnesses);
+    memset(reports, 0, sizeof(*reports));
+}
+
+// Links an appointment into the store in date and time order
+void storeInsert(AppointmentStore* store, Appointment* appointment) {
+    SkipIndex* update[SKIP_MAX_LEVEL];
+    
+    // Equal keys go after the existing ones, as the list always did
+    Appointment* pred = skipSearch(store, appointment->key, 1, update);
+    
+    if (pred == NULL) {
+        appointment->next = store->head;
+        store->head = appointment;
+    } else {
+        appointment->next = pred->next;
+        pred->next = appointment;
+    }
+    
+    int height = randomSkipLevel(store);
+    
+    while (store->level < height) {
+        SkipIndex* sentinel = &store->levels[store->level];
+        sentinel->node = NULL;
+        sentinel->right = NULL;
+        sentinel->down = store->level > 0 ? &store->levels[store->level - 1] : NULL;
+        update[store->level] = sentinel;
+        store->level++;
+    }
+    
+    SkipIndex* below = NULL;
+    
+    for (int level = 0; level < height; level++) {
+        SkipIndex* index = allocateIndex(store);
+        index->key = appointment->key;
+        index->node = appointment;
+        index->down = below;
+        index->right = update[level]->right;
+        update[level]->right = index;
+        below = index;
+    }
+    
+    store->count++;
+    markSlot(store, appointment, 1);
+    trackAppointment(store, appointment, 1);
+    addToNameIndex(&store->names, appointment);
+}
+
+// Unlinks an appointment from the store without freeing it
+void storeRemove(AppointmentStore* store, Appointment* appointment) {
+    Appointment* pred = NULL;
+    SkipIndex* x = store->level > 0 ? &store->levels[store->level - 1] : NULL;
+    
+    for (int level = store->level - 1; level >= 0; level--) {
+        while (x->right != NULL && x->right->key < appointment->key) {
+            x = x->right;
+        }
+        
+        // Duplicate keys are possible in old data, so match on identity
+        SkipIndex* scan = x;
+        while (scan->right != NULL && scan->right->node != appointment &&
+               scan->right->key == appointment->key) {
+            scan = scan->right;
+        }
+        
+        if (scan->right != NULL && scan->right->node == appointment) {
+            SkipIndex* dead = scan->right;
+            scan->right = dead->right;
+            poolFree(&store->indexPool, dead);
+        }
+        
+        if (x->node != NULL) pred = x->node;
+        x = x->down;
+    }
+    
+    Appointment* current = pred != NULL ? pred->next : store->head;
+    while (current != NULL && current != appointment) {
+        pred = current;
+        current = current->next;
+    }
+    
+    if (current == NULL) return; // Not in this store
+    
+    if (pred == NULL) {
+        store->head = current->next;
+    } else {
+        pred->next = current->next;
+    }
+    current->next = NULL;
+    
+    // Drop index levels that no longer hold any entries
+    while (store->level > 0 && store->levels[store->level - 1].right == NULL) {
+        store->level--;
+    }
+    
+    store->count--;
+    markSlot(store, appointment, 0);
+    trackAppointment(store, appointment, -1);
+    removeFromNameIndex(&store->names, appointment);
+}
+
+// Looks up the appointment booked at a given date and time with a doctor
+Appointment* storeFind(AppointmentStore* store, Date date, int hour, int minute, int doctor) {
+    AppointmentKey key = makeKey(date, hour, minute, doctor);
+    
+    Appointment* pred = skipSearch(store, key, 0, NULL);
+    Appointment* candidate = pred != NULL ? pred->next : store->head;
+    
+    if (candidate != NULL && candidate->key == key) {
+        return candidate;
+    }
+    
+    return NULL;
+}
+
+// Numbers of the first and last occurrences of a series between two day
+// numbers, both included; last is below first if none falls between them
+static void occurrencesBetween(const Series* series, int32_t from, int32_t to, int32_t* first, int32_t* last) {
+    *first = from <= series->firstDay ? 0 : (from - series->firstDay + series->interval - 1) / series->interval;
+    *last = to < series->firstDay ? -1 : (to - series->firstDay) / series->interval;
+    if (*last >= series->occurrences) *last = series->occurrences - 1;
+}
+
+// Occurrences of every series between two day numbers, both included,
+// that have not been cancelled, in key order; NULL if there are none
+static Appointment* expandOccurrences(AppointmentStore* store, int32_t from, int32_t to, size_t* count) {
+    SeriesList* list = &store->series;
+    int32_t first, last;
+    size_t total = 0;
+    
+    *count = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        occurrencesBetween(&list->items[i], from, to, &first, &last);
+        for (int32_t k = first; k <= last; k++) {
+            if (!isOccurrenceSkipped(&list->items[i], k)) total++;
+        }
+    }
+    
+    if (total == 0) return NULL;
+    
+    Appointment* occurrences = (Appointment*)malloc(total * sizeof(Appointment));
+    if (occurrences == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    for (size_t i = 0; i < list->count; i++) {
+        occurrencesBetween(&list->items[i], from, to, &first, &last);
+        for (int32_t k = first; k <= last; k++) {
+            if (!isOccurrenceSkipped(&list->items[i], k)) {
+                occurrenceAppointment(&list->items[i], k, &occurrences[(*count)++]);
+            }
+        }
+    }
+    
+    qsort(occurrences, total, sizeof(Appointment), compareAppointmentNodes);
+    return occurrences;
+}
+
+// Visits the appointments from the start of one day to the end of another
+// in date and time order, and returns how many there were. The skip list
+// finds the first in O(log N); the rest are read straight off the list.
+size_t queryDateRange(AppointmentStore* store, Date from, Date to,
+                      void (*visit)(const Appointment*, void*), void* context) {
+    uint32_t last = dateKey(to);
+    
+    Appointment* pred = skipSearch(store, (AppointmentKey)dateKey(from) << 32, 0, NULL);
+    Appointment* current = pred != NULL ? pred->next : store->head;
+    size_t count = 0;
+    
+    // Occurrences of series are made up for the range alone and merged in
+    size_t expanded = 0, next = 0;
+    Appointment* occurrences = expandOccurrences(store, dayNumber(from), dayNumber(to), &expanded);
+    
+    while ((current != NULL && (uint32_t)(current->key >> 32) <= last) || next < expanded) {
+        if (next < expanded &&
+            (current == NULL || (uint32_t)(current->key >> 32) > last || occurrences[next].key < current->key)) {
+            visit(&occurrences[next++], context);
+        } else {
+            visit(current, context);
+            current = current->next;
+        }
+        count++;
+    }
+    
+    free(occurrences);
+    return count;
+}
+
+// Occurrences not cancelled of the series booked under an encrypted name,
+// or under names starting with it when prefix is set, in key order; NULL
+// if there are none
+static Appointment* occurrencesNamed(AppointmentStore* store, const char* query, int prefix, size_t* count) {
+    SeriesList* list = &store->series;
+    size_t length = strlen(query), total = 0;
+    
+    *count = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        const Series* series = &list->items[i];
+        if (prefix ? strncmp(series->name, query, length) != 0 : strcmp(series->name, query) != 0) continue;
+        
+        for (int k = 0; k < series->occurrences; k++) {
+            if (!isOccurrenceSkipped(series, k)) total++;
+        }
+    }
+    
+    if (total == 0) return NULL;
+    
+    Appointment* occurrences = (Appointment*)malloc(total * sizeof(Appointment));
+    if (occurrences == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    for (size_t i = 0; i < list->count; i++) {
+        const Series* series = &list->items[i];
+        if (prefix ? strncmp(series->name, query, length) != 0 : strcmp(series->name, query) != 0) continue;
+        
+        for (int k = 0; k < series->occurrences; k++) {
+            if (!isOccurrenceSkipped(series, k)) occurrenceAppointment(series, k, &occurrences[(*count)++]);
+        }
+    }
+    
+    qsort(occurrences, total, sizeof(Appointment), compareAppointmentNodes);
+    return occurrences;
+}
+
+// Passes on the occurrences due before a name index hit, then the hit
+static void visitMerged(const Appointment* appointment, void* context) {
+    NameMerge* merge = (NameMerge*)context;
+    
+    while (merge->next < merge->count && merge->occurrences[merge->next].key < appointment->key) {
+        merge->visit(&merge->occurrences[merge->next++], merge->context);
+    }
+    merge->visit(appointment, merge->context);
+}
+
+// Visits the appointments booked under an encrypted name, or a prefix of
+// one, series occurrences included, in date and time order. Returns how
+// many matched.
+size_t searchAppointments(AppointmentStore* store, const char* query, int prefix,
+                          void (*visit)(const Appointment*, void*), void* context) {
+    NameMerge merge = {NULL, 0, 0, visit, context};
+    merge.occurrences = occurrencesNamed(store, query, prefix, &merge.count);
+    
+    size_t matched = searchNameIndex(&store->names, query, prefix, visitMerged, &merge);
+    while (merge.next < merge.count) {
+        visit(&merge.occurrences[merge.next++], context);
+    }
+    
+    free(merge.occurrences);
+    return matched + merge.count;
+}
+
+// Puts a node at the end of the list and of every index level it reaches,
+// given the last entry of each level so far
+static void appendToStore(AppointmentStore* store, SkipIndex** tails, Appointment** last, Appointment* node) {
+    node->next = NULL;
+    
+    if (*last == NULL) {
+        store->head = node;
+    } else {
+        (*last)->next = node;
+    }
+    *last = node;
+    
+    int height = randomSkipLevel(store);
+    
+    while (store->level < height) {
+        SkipIndex* sentinel = &store->levels[store->level];
+        sentinel->node = NULL;
+        sentinel->right = NULL;
+        sentinel->down = store->level > 0 ? &store->levels[store->level - 1] : NULL;
+        tails[store->level] = sentinel;
+        store->level++;
+    }
+    
+    SkipIndex* below = NULL;
+    
+    for (int level = 0; level < height; level++) {
+        SkipIndex* index = allocateIndex(store);
+        index->key = node->key;
+        index->node = node;
+        index->down = below;
+        index->right = NULL;
+        tails[level]->right = index;
+        tails[level] = index;
+        below = index;
+    }
+}
+
+// Links nodes that are already in date and time order into an empty
+// store in one pass, keeping the tail of every level instead of searching
+void storeBulkLoad(AppointmentStore* store, Appointment* nodes, size_t count) {
+    SkipIndex* tails[SKIP_MAX_LEVEL];
+    Appointment* last = NULL;
+    
+    for (size_t i = 0; i < count; i++) {
+        Appointment* node = &nodes[i];
+        appendToStore(store, tails, &last, node);
+        
+        store->count++;
+        markSlot(store, node, 1);
+        trackAppointment(store, node, 1);
+    }
+    
+    // Into an empty index the names go in one pass of their own
+    if (store->names.count == 0) {
+        buildNameIndex(&store->names, nodes, count, loadThreadCount(store, count));
+    } else {
+        for (size_t i = 0; i < count; i++) addToNameIndex(&store->names, &nodes[i]);
+    }
+}
+
+// Merges nodes that are already in date and time order into a store that
+// holds appointments in one pass over both: the two lists are interleaved
+// and the index is dropped and built again over the result, as
+// storeBulkLoad builds it, rather than searched once per node
+void storeMerge(AppointmentStore* store, Appointment* nodes, size_t count) {
+    SkipIndex* tails[SKIP_MAX_LEVEL];
+    Appointment* last = NULL;
+    Appointment* existing = store->head;
+    size_t i = 0;
+    
+    poolReleaseAll(&store->indexPool);
+    for (int level = 0; level < SKIP_MAX_LEVEL; level++) {
+        store->levels[level].right = NULL;
+    }
+    store->head = NULL;
+    store->level = 0;
+    
+    while (existing != NULL || i < count) {
+        // Equal keys keep the stored appointment first, as storeInsert would
+        if (existing != NULL && (i == count || existing->key <= nodes[i].key)) {
+            Appointment* node = existing;
+            existing = existing->next;
+            appendToStore(store, tails, &last, node);
+            continue;
+        }
+        
+        Appointment* node = &nodes[i++];
+        appendToStore(store, tails, &last, node);
+        store->count++;
+        markSlot(store, node, 1);
+        trackAppointment(store, node, 1);
+        addToNameIndex(&store->names, node);
+    }
+}
+
+void freeAppointmentStore(AppointmentStore* store) {
+    // Every node and index entry lives in a pool, so this is a few frees
+    poolReleaseAll(&store->appointmentPool);
+    poolReleaseAll(&store->indexPool);
+    
+    for (int level = 0; level < SKIP_MAX_LEVEL; level++) {
+        store->levels[level].right = NULL;
+    }
+    
+    store->head = NULL;
+    store->level = 0;
+    store->count = 0;
+    freeDaySlotIndex(&store->slots);
+    freeNameIndex(&store->names);
+    freeStringPool(&store->strings);
+    free(store->doctors.items);
+    memset(&store->doctors, 0, sizeof(store->doctors));
+    free(store->series.items);
+    memset(&store->series, 0, sizeof(store->series));
+    freeReports(&store->reports);
+    if (store->reminders != NULL) clearReminders(store->reminders);
+}
+
+static void poolAddSlab(Pool* pool, size_t objects) {
+    // Objects must be able to hold the free-list link
+    if (pool->objectSize < sizeof(void*)) pool->objectSize = sizeof(void*);
+    
+    size_t bytes = sizeof(PoolSlab) + objects * pool->objectSize;
+    PoolSlab* slab = (PoolSlab*)malloc(bytes);
+    if (slab == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->cursor = (char*)(slab + 1);
+    pool->limit = pool->cursor + objects * pool->objectSize;
+    pool->slabBytes += bytes;
+}
+
+// Hands out one object, preferring a released one over fresh slab space
+void* poolAlloc(Pool* pool) {
+    void* object;
+    
+    if (pool->freeList != NULL) {
+        object = pool->freeList;
+        pool->freeList = *(void**)object;
+        pool->reused++;
+    } else {
+        if (pool->cursor == pool->limit) {
+            poolAddSlab(pool, POOL_SLAB_OBJECTS);
+        }
+        object = pool->cursor;
+        pool->cursor += pool->objectSize;
+    }
+    
+    pool->live++;
+    if (pool->live > pool->peak) pool->peak = pool->live;
+    return object;
+}
+
+// Carves count consecutive objects out of one dedicated slab, for loads
+void* poolAllocBlock(Pool* pool, size_t count) {
+    if (count == 0) return NULL;
+    
+    // Whatever was left of the current slab stays reachable for poolAlloc
+    char* cursor = pool->cursor;
+    char* limit = pool->limit;
+    
+    poolAddSlab(pool, count);
+    void* block = pool->cursor;
+    
+    pool->cursor = cursor;
+    pool->limit = limit;
+    pool->live += count;
+    if (pool->live > pool->peak) pool->peak = pool->live;
+    return block;
+}
+
+// Returns an object to the pool's free list for the next poolAlloc
+void poolFree(Pool* pool, void* object) {
+    if (object == NULL) return;
+    
+    *(void**)object = pool->freeList;
+    pool->freeList = object;
+    pool->live--;
+}
+
+// Frees every slab at once; statistics other than live survive
+void poolReleaseAll(Pool* pool) {
+    PoolSlab* slab = pool->slabs;
+    
+    while (slab != NULL) {
+        PoolSlab* next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    
+    pool->slabs = NULL;
+    pool->freeList = NULL;
+    pool->cursor = NULL;
+    pool->limit = NULL;
+    pool->live = 0;
+    pool->slabBytes = 0;
+}
+
+Appointment* allocateAppointment(AppointmentStore* store) {
+    store->appointmentPool.objectSize = sizeof(Appointment);
+    Appointment* appointment = (Appointment*)poolAlloc(&store->appointmentPool);
+    appointment->next = NULL;
+    return appointment;
+}
+
+void releaseAppointment(AppointmentStore* store, Appointment* appointment) {
+    poolFree(&store->appointmentPool, appointment);
+}
+
+SkipIndex* allocateIndex(AppointmentStore* store) {
+    store->indexPool.objectSize = sizeof(SkipIndex);
+    return (SkipIndex*)poolAlloc(&store->indexPool);
+}
+
+// Bytes written to disk per byte of appointment data changed
+static double writeAmplification(const StorageStats* stats) {
+    if (stats->changes == 0) return 0.0;
+    return (double)(stats->logBytes + stats->snapshotBytes) / ((double)stats->changes * sizeof(AppointmentRecord));
+}
+
+void displayStorageStatistics(AppointmentStore* store, UserStore* users) {
+    StorageStats stats = readStorageStats(store);
+    
+    printf("\n===== STORAGE STATISTICS =====\n");
+    printf("Changes: %llu, %llu of them waited for the disk\n",
+           (unsigned long long)stats.changes, (unsigned long long)stats.commits);
+    printf("Journal: %llu records, %llu bytes, %llu fsyncs (%.1f changes per fsync)\n",
+           (unsigned long long)stats.logRecords, (unsigned long long)stats.logBytes, (unsigned long long)stats.logSyncs,
+           stats.logSyncs > 0 ? (double)stats.commits / stats.logSyncs : 0.0);
+    printf("Snapshots: %llu written, %llu bytes, %llu fsyncs\n",
+           (unsigned long long)stats.snapshots, (unsigned long long)stats.snapshotBytes,
+           (unsigned long long)stats.snapshotSyncs);
+    printf("Archive: %llu past appointments moved out, %llu bytes, %llu fsyncs\n",
+           (unsigned long long)stats.archived, (unsigned long long)stats.archiveBytes,
+           (unsigned long long)stats.archiveSyncs);
+    printf("Users file: %llu written, %llu bytes, %llu fsyncs\n",
+           (unsigned long long)users->stats.snapshots, (unsigned long long)users->stats.snapshotBytes,
+           (unsigned long long)users->stats.snapshotSyncs);
+    printf("Write amplification: %.2f bytes written per byte of appointment data changed\n",
+           writeAmplification(&stats));
+    if (store->shared != NULL) {
+        printf("Shared files: %llu records from other processes applied, %llu full loads after they compacted\n",
+               (unsigned long long)stats.caughtUp, (unsigned long long)stats.reloads);
+    }
+    printf("Commit window: %d microseconds\n", store->journal.commitWindow);
+}
+
+static void printPoolStatistics(const char* label, const Pool* pool) {
+    printf("%-14s %10zu %10zu %10zu %12zu\n", label, pool->live, pool->peak, pool->reused, pool->slabBytes);
+}
+
+void displayMemoryStatistics(AppointmentStore* store, UserStore* users) {
+    printf("\n===== MEMORY STATISTICS =====\n");
+    printf("%-14s %10s %10s %10s %12s\n", "Pool", "Live", "Peak", "Reused", "Slab bytes");
+    printf("---------------------------------------------------------------\n");
+    printPoolStatistics("Appointments", &store->appointmentPool);
+    printPoolStatistics("Skip index", &store->indexPool);
+    printf("Strings: %zu distinct names and illnesses in %zu bytes\n", store->strings.count, store->strings.bytes);
+    printf("Users: %zu of %zu slots in one contiguous array\n", users->count, users->capacity);
+    printf("Doctors: %zu, each with a bitmap per booked day\n", store->doctors.count);
+    if (store->reminders != NULL) {
+        printf("Reminders: %zu waiting in the timer wheel, %llu sent\n", store->reminders->count,
+               (unsigned long long)store->reminders->delivered);
+    }
+}
+
+// Orders illness counters by appointments, most first
+static int compareIllnessCounts(const void* a, const void* b) {
+    const IllnessCount* first = (const IllnessCount*)a;
+    const IllnessCount* second = (const IllnessCount*)b;
+    return (first->appointments < second->appointments) - (first->appointments > second->appointments);
+}
+
+// Copies out the illnesses with appointments, most first; the caller frees
+// the array. Only these few are ever decrypted for a report.
+static IllnessCount* sortedIllnessCounts(const Reports* reports, size_t* listed) {
+    IllnessCount* counts = (IllnessCount*)malloc((reports->illnessCount > 0 ? reports->illnessCount : 1) *
+                                                 sizeof(IllnessCount));
+    if (counts == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    *listed = 0;
+    for (size_t i = 0; i < reports->illnessCapacity; i++) {
+        if (reports->illnesses[i].illness != NULL && reports->illnesses[i].appointments > 0) {
+            counts[(*listed)++] = reports->illnesses[i];
+        }
+    }
+    
+    qsort(counts, *listed, sizeof(IllnessCount), compareIllnessCounts);
+    return counts;
+}
+
+// Share of the slots of some days on every calendar that is booked
+static double utilization(const AppointmentStore* store, uint64_t slots, int days) {
+    size_t calendars = store->doctors.count > 0 ? store->doctors.count : 1;
+    return 100.0 * (double)slots / ((double)days * SLOTS_PER_DAY * (double)calendars);
+}
+
+// Prints the counts kept in store->reports; nothing here looks at the
+// appointments themselves
+void displayReports(AppointmentStore* store) {
+    Reports* reports = &store->reports;
+    int32_t days[REPORT_TOP_DAYS];
+    
+    lockStore(store, 0);
+    printf("\n===== OCCUPANCY AND ILLNESS REPORT =====\n");
+    printf("Booked: %llu appointments, %.1f hours\n", (unsigned long long)reports->appointments,
+           (double)reports->slots * SLOT_MINUTES / 60.0);
+    
+    printf("\nBusiest days            Appointments  Utilization\n");
+    size_t found = busiestDays(reports, REPORT_TOP_DAYS, days);
+    for (size_t i = 0; i < found; i++) {
+        Date date = dateFromDayNumber(days[i]);
+        const DayReport* day = dayReport(reports, days[i]);
+        printf("%02d/%02d/%04d              %12u  %10.1f%%\n", date.day, date.month, date.year, day->appointments,
+               utilization(store, day->slots, 1));
+    }
+    
+    printf("\nMonth                   Appointments  Utilization\n");
+    for (size_t month = 0; month < reports->monthCount; month++) {
+        const MonthReport* report = &reports->months[month];
+        if (report->appointments == 0) continue;
+        
+        int number = reports->firstMonth + (int)month;
+        Date first = {1, number % 12 + 1, number / 12};
+        Date next = {1, first.month % 12 + 1, first.year + (first.month == 12)};
+        printf("%02d/%04d                 %12u  %10.1f%%\n", first.month, first.year, report->appointments,
+               utilization(store, report->slots, dayNumber(next) - dayNumber(first)));
+    }
+    
+    size_t listed;
+    IllnessCount* counts = sortedIllnessCounts(reports, &listed);
+    
+    printf("\nIllness                 Appointments        Share\n");
+    for (size_t i = 0; i < listed; i++) {
+        char decrypted[MAX_NAME_LEN];
+        strcpy(decrypted, counts[i].illness);
+        decrypt(decrypted);
+        printf("%-20s    %12llu  %10.1f%%\n", decrypted, (unsigned long long)counts[i].appointments,
+               100.0 * (double)counts[i].appointments / (double)reports->appointments);
+    }
+    unlockStore(store);
+    
+    free(counts);
+}
+
+static uint64_t clockNs() {
+    struct timespec now;
+#ifndef _WIN32
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#else
+    timespec_get(&now, TIME_UTC);
+#endif
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+const char* operationName(int operation) {
+    switch (operation) {
+        case METRIC_ADD: return "add";
+        case METRIC_DELETE: return "delete";
+        case METRIC_MODIFY: return "modify";
+        case METRIC_SEARCH: return "search";
+        case METRIC_SLOTS: return "slots";
+        case METRIC_SAVE: return "save";
+        case METRIC_LOAD: return "load";
+        case METRIC_AUTHENTICATE: return "authenticate";
+        default: return "unknown";
+    }
+}
+
+// Histogram bucket of a latency: the top METRICS_SUB_BITS + 1 bits of it
+static int latencyBucket(uint64_t ns) {
+    if (ns < METRICS_SUB_BUCKETS) return (int)ns;
+    
+    int exponent = 63 - __builtin_clzll(ns);
+    int bucket = (exponent - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS +
+                 (int)((ns >> (exponent - METRICS_SUB_BITS)) - METRICS_SUB_BUCKETS);
+    return bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS - 1;
+}
+
+// Smallest latency that falls in a bucket
+static uint64_t bucketFloor(int bucket) {
+    if (bucket < METRICS_SUB_BUCKETS) return (uint64_t)bucket;
+    
+    int exponent = bucket / METRICS_SUB_BUCKETS + METRICS_SUB_BITS - 1;
+    uint64_t mantissa = METRICS_SUB_BUCKETS + (uint64_t)(bucket % METRICS_SUB_BUCKETS);
+    return mantissa << (exponent - METRICS_SUB_BITS);
+}
+
+// Clock reading to pass to recordOperation, or 0 when metrics are off
+uint64_t operationStart(const Metrics* metrics) {
+    return metrics != NULL ? clockNs() : 0;
+}
+
+// Counts a call that began at started and returns its result, so callers
+// can record on the way out; any result other than 0 counts as an error
+int recordOperation(Metrics* metrics, int operation, uint64_t started, int result) {
+    if (metrics == NULL) return result;
+    
+    uint64_t elapsed = clockNs() - started;
+    OperationMetrics* counters = &metrics->operations[operation];
+    
+    // Server threads record at the same time, so every update is atomic
+    __atomic_fetch_add(&counters->calls, 1, __ATOMIC_RELAXED);
+    if (result != 0) __atomic_fetch_add(&counters->errors, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counters->totalNs, elapsed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counters->buckets[latencyBucket(elapsed)], 1, __ATOMIC_RELAXED);
+    
+    uint64_t longest = __atomic_load_n(&counters->maxNs, __ATOMIC_RELAXED);
+    while (elapsed > longest &&
+           !__atomic_compare_exchange_n(&counters->maxNs, &longest, elapsed, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    return result;
+}
+
+// Copies one operation's counters while other threads may be adding to them
+static void readOperationMetrics(const OperationMetrics* counters, OperationMetrics* copy) {
+    copy->calls = __atomic_load_n(&counters->calls, __ATOMIC_RELAXED);
+    copy->errors = __atomic_load_n(&counters->errors, __ATOMIC_RELAXED);
+    copy->totalNs = __atomic_load_n(&counters->totalNs, __ATOMIC_RELAXED);
+    copy->maxNs = __atomic_load_n(&counters->maxNs, __ATOMIC_RELAXED);
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        copy->buckets[i] = __atomic_load_n(&counters->buckets[i], __ATOMIC_RELAXED);
+    }
+}
+
+// Latency below which a share q of the calls finished, to within a bucket
+static uint64_t latencyQuantile(const OperationMetrics* copy, double q) {
+    uint64_t total = 0, seen = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) total += copy->buckets[i];
+    if (total == 0) return 0;
+    
+    uint64_t rank = (uint64_t)ceil(q * (double)total);
+    if (rank < 1) rank = 1;
+    
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        seen += copy->buckets[i];
+        if (seen >= rank) {
+            uint64_t top = bucketFloor(i + 1) - 1;
+            return top < copy->maxNs ? top : copy->maxNs;
+        }
+    }
+    return copy->maxNs;
+}
+
+void displayMetrics(AppointmentStore* store) {
+    if (store->metrics == NULL) {
+        printf("Metrics are off. Start the program with --metrics file to collect them.\n");
+        return;
+    }
+    
+    OperationMetrics copy;
+    
+    printf("\n===== OPERATION METRICS =====\n");
+    printf("%-13s %9s %7s %10s %10s %10s %10s\n", "Operation", "Calls", "Errors", "Mean us", "p50 us", "p99 us",
+           "Max us");
+    printf("------------------------------------------------------------------------\n");
+    for (int i = 0; i < METRIC_OPERATIONS; i++) {
+        readOperationMetrics(&store->metrics->operations[i], &copy);
+        printf("%-13s %9llu %7llu %10.1f %10.1f %10.1f %10.1f\n", operationName(i),
+               (unsigned long long)copy.calls, (unsigned long long)copy.errors,
+               copy.calls > 0 ? (double)copy.totalNs / copy.calls / 1e3 : 0.0,
+               latencyQuantile(&copy, 0.5) / 1e3, latencyQuantile(&copy, 0.99) / 1e3, copy.maxNs / 1e3);
+    }
+    printf("Sizes, memory and I/O figures are written with these to %s on SIGUSR1 and at exit.\n",
+           store->metrics->path);
+}
+
+// Writes every metric in the Prometheus text format
+void writeMetrics(AppointmentStore* store, UserStore* users, FILE* out) {
+    Metrics* metrics = store->metrics;
+    OperationMetrics* copies = (OperationMetrics*)malloc(METRIC_OPERATIONS * sizeof(OperationMetrics));
+    if (copies == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    for (int i = 0; i < METRIC_OPERATIONS; i++) {
+        readOperationMetrics(&metrics->operations[i], &copies[i]);
+    }
+    
+    fprintf(out, "# HELP appointment_operations_total Calls of each store operation.\n");
+    fprintf(out, "# TYPE appointment_operations_total counter\n");
+    for (int i = 0; i < METRIC_OPERATIONS; i++) {
+        fprintf(out, "appointment_operations_total{operation=\"%s\"} %llu\n", operationName(i),
+                (unsigned long long)copies[i].calls);
+    }
+    
+    fprintf(out, "# HELP appointment_operation_errors_total Calls that failed or were refused.\n");
+    fprintf(out, "# TYPE appointment_operation_errors_total counter\n");
+    for (int i = 0; i < METRIC_OPERATIONS; i++) {
+        fprintf(out, "appointment_operation_errors_total{operation=\"%s\"} %llu\n", operationName(i),
+                (unsigned long long)copies[i].errors);
+    }
+    
+    // A power of two is the floor of a bucket, so the buckets below it hold
+    // exactly the calls up to one nanosecond less; that is the bound given,
+    // as le bounds include their value
+    fprintf(out, "# HELP appointment_operation_duration_seconds Time taken by each call.\n");
+    fprintf(out, "# TYPE appointment_operation_duration_seconds histogram\n");
+    for (int i = 0; i < METRIC_OPERATIONS; i++) {
+        const char* name = operationName(i);
+        uint64_t below = 0;
+        int bucket = 0;
+        
+        for (int exponent = METRICS_FIRST_BOUND; exponent <= METRICS_MAX_EXPONENT; exponent++) {
+            int limit = latencyBucket((uint64_t)1 << exponent);
+            for (; bucket < limit; bucket++) below += copies[i].buckets[bucket];
+            fprintf(out, "appointment_operation_duration_seconds_bucket{operation=\"%s\",le=\"%.9g\"} %llu\n", name,
+                    (double)(((uint64_t)1 << exponent) - 1) / 1e9, (unsigned long long)below);
+        }
+        for (; bucket < METRICS_BUCKETS; bucket++) below += copies[i].buckets[bucket];
+        
+        fprintf(out, "appointment_operation_duration_seconds_bucket{operation=\"%s\",le=\"+Inf\"} %llu\n", name,
+                (unsigned long long)below);
+        fprintf(out, "appointment_operation_duration_seconds_sum{operation=\"%s\"} %.9f\n", name,
+                copies[i].totalNs / 1e9);
+        fprintf(out, "appointment_operation_duration_seconds_count{operation=\"%s\"} %llu\n", name,
+                (unsigned long long)below);
+    }
+    free(copies);
+    
+    lockStore(store, 0);
+    size_t appointments = store->count, series = store->series.count, doctors = store->doctors.count;
+    size_t strings = store->strings.count, stringBytes = store->strings.bytes;
+    Pool pools[2] = {store->appointmentPool, store->indexPool};
+    unlockStore(store);
+    
+    lockUsers(store);
+    size_t userCount = users->count;
+    StorageStats userStats = users->stats;
+    unlockUsers(store);
+    
+    StorageStats stats = readStorageStats(store);
+    const char* poolNames[2] = {"appointments", "index"};
+    
+    fprintf(out, "# HELP appointment_items Entries held in memory.\n");
+    fprintf(out, "# TYPE appointment_items gauge\n");
+    fprintf(out, "appointment_items{kind=\"appointments\"} %zu\n", appointments);
+    fprintf(out, "appointment_items{kind=\"series\"} %zu\n", series);
+    fprintf(out, "appointment_items{kind=\"doctors\"} %zu\n", doctors);
+    fprintf(out, "appointment_items{kind=\"users\"} %zu\n", userCount);
+    fprintf(out, "appointment_items{kind=\"strings\"} %zu\n", strings);
+    
+    fprintf(out, "# HELP appointment_pool_live_objects Objects handed out by each pool.\n");
+    fprintf(out, "# TYPE appointment_pool_live_objects gauge\n");
+    for (int i = 0; i < 2; i++) {
+        fprintf(out, "appointment_pool_live_objects{pool=\"%s\"} %zu\n", poolNames[i], pools[i].live);
+    }
+    fprintf(out, "# HELP appointment_pool_reused_total Allocations served from a pool's free list.\n");
+    fprintf(out, "# TYPE appointment_pool_reused_total counter\n");
+    for (int i = 0; i < 2; i++) {
+        fprintf(out, "appointment_pool_reused_total{pool=\"%s\"} %zu\n", poolNames[i], pools[i].reused);
+    }
+    fprintf(out, "# HELP appointment_memory_bytes Bytes held by each allocator.\n");
+    fprintf(out, "# TYPE appointment_memory_bytes gauge\n");
+    for (int i = 0; i < 2; i++) {
+        fprintf(out, "appointment_memory_bytes{allocator=\"%s\"} %zu\n", poolNames[i], pools[i].slabBytes);
+    }
+    fprintf(out, "appointment_memory_bytes{allocator=\"strings\"} %zu\n", stringBytes);
+    
+    fprintf(out, "# HELP appointment_written_bytes_total Bytes written to each kind of file.\n");
+    fprintf(out, "# TYPE appointment_written_bytes_total counter\n");
+    fprintf(out, "appointment_written_bytes_total{file=\"journal\"} %llu\n", (unsigned long long)stats.logBytes);
+    fprintf(out, "appointment_written_bytes_total{file=\"snapshot\"} %llu\n", (unsigned long long)stats.snapshotBytes);
+    fprintf(out, "appointment_written_bytes_total{file=\"archive\"} %llu\n", (unsigned long long)stats.archiveBytes);
+    fprintf(out, "appointment_written_bytes_total{file=\"users\"} %llu\n", (unsigned long long)userStats.snapshotBytes);
+    fprintf(out, "# HELP appointment_fsyncs_total Syncs of each kind of file and of the directory for it.\n");
+    fprintf(out, "# TYPE appointment_fsyncs_total counter\n");
+    fprintf(out, "appointment_fsyncs_total{file=\"journal\"} %llu\n", (unsigned long long)stats.logSyncs);
+    fprintf(out, "appointment_fsyncs_total{file=\"snapshot\"} %llu\n", (unsigned long long)stats.snapshotSyncs);
+    fprintf(out, "appointment_fsyncs_total{file=\"archive\"} %llu\n", (unsigned long long)stats.archiveSyncs);
+    fprintf(out, "appointment_fsyncs_total{file=\"users\"} %llu\n", (unsigned long long)userStats.snapshotSyncs);
+    fprintf(out, "# HELP appointment_changes_total Appointments added, removed or modified.\n");
+    fprintf(out, "# TYPE appointment_changes_total counter\n");
+    fprintf(out, "appointment_changes_total %llu\n", (unsigned long long)stats.changes);
+    
+    fprintf(out, "# HELP appointment_uptime_seconds Time since metrics collection began.\n");
+    fprintf(out, "# TYPE appointment_uptime_seconds gauge\n");
+    fprintf(out, "appointment_uptime_seconds %.3f\n", (clockNs() - metrics->started) / 1e9);
+}
+
+// Replaces the --metrics file with the current figures; a scraper never
+// sees it half-written
+int writeMetricsFile(AppointmentStore* store, UserStore* users) {
+    const char* path = store->metrics->path;
+    char tempPath[METRICS_PATH_LEN + 4];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+    
+    FILE* file = fopen(tempPath, "w");
+    if (file == NULL) {
+        printf("Could not write %s.\n", tempPath);
+        return 0;
+    }
+    
+    writeMetrics(store, users, file);
+    int ok = !ferror(file);
+    if (fclose(file) != 0) ok = 0;
+    
+#ifdef _WIN32
+    if (ok) remove(path); // rename() does not replace an existing file on Windows
+#endif
+    if (!ok || rename(tempPath, path) != 0) {
+        remove(tempPath);
+        printf("Could not write %s.\n", path);
+        return 0;
+    }
+    
+    return 1;
+}
+
+// Starts timing operations for --metrics. SIGUSR1 then asks for the file
+// to be written, which the server waits for in sigwait and the menus and
+// batch mode in a thread of their own (watchSignals).
+int startMetrics(AppointmentStore* store, UserStore* users, const char* path) {
+    if (strlen(path) >= METRICS_PATH_LEN) {
+        printf("Metrics file path is too long: %s\n", path);
+        return 0;
+    }
+    
+    Metrics* metrics = (Metrics*)calloc(1, sizeof(Metrics));
+    if (metrics == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    strcpy(metrics->path, path);
+    metrics->started = clockNs();
+    store->metrics = metrics;
+    users->metrics = metrics;
+#ifndef _WIN32
+    // Blocked before any thread starts, so it stays pending for sigwait
+    sigset_t dump;
+    sigemptyset(&dump);
+    sigaddset(&dump, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &dump, NULL);
+#endif
+    return 1;
+}
+
+// Writes the final figures and stops collecting
+void closeMetrics(AppointmentStore* store, UserStore* users) {
+    if (store->metrics == NULL) return;
+    
+    writeMetricsFile(store, users);
+    free(store->metrics);
+    store->metrics = NULL;
+    users->metrics = NULL;
+}
+
+// The local clock in minutes since 1970, the unit of the reminder wheel
+int64_t currentMinute() {
+    time_t now = time(NULL);
+    struct tm local;
+#ifndef _WIN32
+    localtime_r(&now, &local);
+#else
+    local = *localtime(&now);
+#endif
+    
+    Date today = {local.tm_mday, local.tm_mon + 1, local.tm_year + 1900};
+    return (int64_t)dayNumber(today) * 1440 + local.tm_hour * 60 + local.tm_min;
+}
+
+// The default sink: one line per reminder appended to the --reminders file
+void logReminder(AppointmentStore* store, const Reminder* reminder, void* context) {
+    FILE* log = (FILE*)context;
+    char name[MAX_NAME_LEN];
+    int hour, minute;
+    
+    strcpy(name, reminder->name);
+    decrypt(name);
+    keyTime(reminder->key, &hour, &minute);
+    Date sent = dateFromDayNumber((int32_t)(reminder->due / 1440));
+    Date date = keyDate(reminder->key);
+    int doctor = keyDoctor(reminder->key);
+    
+    fprintf(log, "%02d/%02d/%04d %02d:%02d Reminder for %s: appointment on %02d/%02d/%04d at %02d:%02d",
+            sent.day, sent.month, sent.year, (int)(reminder->due % 1440 / 60), (int)(reminder->due % 60), name,
+            date.day, date.month, date.year, hour, minute);
+    if (doctor != 0) fprintf(log, " with %s", doctorName(store, doctor));
+    fprintf(log, ", %d minutes from now\n", reminder->lead);
+}
+
+// Starts sending reminders for --reminders: they are appended to the file
+// at the given number of minutes (a comma-separated list) before each
+// appointment. Must happen before the store is loaded.
+int startReminders(AppointmentStore* store, const char* path, const char* leads) {
+    if (strlen(path) >= REMINDER_PATH_LEN) {
+        printf("Reminder file path is too long: %s\n", path);
+        return 0;
+    }
+    
+    ReminderWheel* wheel = (ReminderWheel*)calloc(1, sizeof(ReminderWheel));
+    if (wheel == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    for (const char* next = leads; *next != '\0';) {
+        char* end;
+        long lead = strtol(next, &end, 10);
+        if (end == next || (*end != ',' && *end != '\0') || lead < 1 || lead > REMINDER_MAX_LEAD ||
+            wheel->leadCount == REMINDER_MAX_LEADS) {
+            printf("Reminder lead times must be up to %d numbers of minutes from 1 to %d, separated by commas.\n",
+                   REMINDER_MAX_LEADS, REMINDER_MAX_LEAD);
+            free(wheel);
+            return 0;
+        }
+        wheel->leads[wheel->leadCount++] = (int)lead;
+        next = *end == ',' ? end + 1 : end;
+    }
+    
+    wheel->log = fopen(path, "a");
+    if (wheel->log == NULL) {
+        printf("Could not open reminder file %s.\n", path);
+        free(wheel);
+        return 0;
+    }
+    
+    wheel->deliver = logReminder;
+    wheel->context = wheel->log;
+    wheel->now = currentMinute();
+    store->reminders = wheel;
+    return 1;
+}
+
+// Sends the reminders that fell due on the local clock since the last
+// look. The menus and batch mode call this between commands; the server
+// every REMINDER_TICK_SECONDS.
+void runDueReminders(AppointmentStore* store) {
+    if (store->reminders == NULL) return;
+    
+    lockStore(store, 1);
+    if (!store->reminders->simulated) advanceReminders(store, currentMinute());
+    unlockStore(store);
+}
+
+// Drops every pending reminder; the clock and settings stay
+void clearReminders(ReminderWheel* wheel) {
+    poolReleaseAll(&wheel->pool);
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    memset(wheel->occupied, 0, sizeof(wheel->occupied));
+    wheel->overflow = NULL;
+    if (wheel->buckets != NULL) memset(wheel->buckets, 0, wheel->bucketCount * sizeof(Reminder*));
+    wheel->count = 0;
+}
+
+void closeReminders(AppointmentStore* store) {
+    if (store->reminders == NULL) return;
+    
+    clearReminders(store->reminders);
+    free(store->reminders->buckets);
+    fclose(store->reminders->log);
+    free(store->reminders);
+    store->reminders = NULL;
+}
+
+void freeUserStore(UserStore* users) {
+    Metrics* metrics = users->metrics; // belongs to the store
+    struct sharedStore* shared = users->shared;
+    
+    free(users->users);
+    free(users->table);
+    memset(users, 0, sizeof(*users));
+    users->metrics = metrics;
+    users->shared = shared;
+}
+
+#ifndef _WIN32
+static size_t dayStripe(uint32_t key) {
+    return hashDateKey(key) & (DAY_LOCK_STRIPES - 1);
+}
+#endif
+
+// Takes the stripes of one or two days, lowest stripe first so two moves
+// cannot deadlock. Does nothing for a store used by a single thread.
+void lockDays(AppointmentStore* store, uint32_t firstKey, uint32_t secondKey) {
+    // Other processes' changes are applied before the days are looked at
+    lockSharedStore(store);
+#ifndef _WIN32
+    if (store->locks == NULL) return;
+    
+    size_t first = dayStripe(firstKey), second = dayStripe(secondKey);
+    if (first > second) {
+        size_t swap = first;
+        first = second;
+        second = swap;
+    }
+    
+    pthread_mutex_lock(&store->locks->days[first]);
+    if (second != first) pthread_mutex_lock(&store->locks->days[second]);
+#else
+    (void)store; (void)firstKey; (void)secondKey;
+#endif
+}
+
+void unlockDays(AppointmentStore* store, uint32_t firstKey, uint32_t secondKey) {
+#ifndef _WIN32
+    if (store->locks != NULL) {
+        size_t first = dayStripe(firstKey), second = dayStripe(secondKey);
+        pthread_mutex_unlock(&store->locks->days[first]);
+        if (second != first) pthread_mutex_unlock(&store->locks->days[second]);
+    }
+#else
+    (void)firstKey; (void)secondKey;
+#endif
+    unlockSharedStore(store);
+}
+
+// Takes every stripe in order, for a change that reaches many days
+void lockAllDays(AppointmentStore* store) {
+    lockSharedStore(store);
+#ifndef _WIN32
+    if (store->locks == NULL) return;
+    
+    for (size_t i = 0; i < DAY_LOCK_STRIPES; i++) {
+        pthread_mutex_lock(&store->locks->days[i]);
+    }
+#else
+    (void)store;
+#endif
+}
+
+void unlockAllDays(AppointmentStore* store) {
+#ifndef _WIN32
+    if (store->locks != NULL) {
+        for (size_t i = DAY_LOCK_STRIPES; i > 0; i--) {
+            pthread_mutex_unlock(&store->locks->days[i - 1]);
+        }
+    }
+#endif
+    unlockSharedStore(store);
+}
+
+// Shared access for lookups, exclusive access for changing the indexes
+void lockStore(AppointmentStore* store, int exclusive) {
+#ifndef _WIN32
+    if (store->locks == NULL) return;
+    
+    if (exclusive) {
+        pthread_rwlock_wrlock(&store->locks->structure);
+    } else {
+        pthread_rwlock_rdlock(&store->locks->structure);
+    }
+#else
+    (void)store; (void)exclusive;
+#endif
+}
+
+void unlockStore(AppointmentStore* store) {
+#ifndef _WIN32
+    if (store->locks != NULL) pthread_rwlock_unlock(&store->locks->structure);
+#else
+    (void)store;
+#endif
+}
+
+void lockUsers(AppointmentStore* store) {
+#ifndef _WIN32
+    if (store->locks != NULL) pthread_mutex_lock(&store->locks->users);
+#else
+    (void)store;
+#endif
+}
+
+void unlockUsers(AppointmentStore* store) {
+#ifndef _WIN32
+    if (store->locks != NULL) pthread_mutex_unlock(&store->locks->users);
+#else
+    (void)store;
+#endif
+}
+
+#ifndef _WIN32
+static StoreLocks* createStoreLocks() {
+    StoreLocks* locks = (StoreLocks*)malloc(sizeof(StoreLocks));
+    if (locks == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_rwlock_init(&locks->structure, NULL);
+    for (int i = 0; i < DAY_LOCK_STRIPES; i++) {
+        pthread_mutex_init(&locks->days[i], NULL);
+    }
+    pthread_mutex_init(&locks->journal, NULL);
+    pthread_cond_init(&locks->synced, NULL);
+    pthread_mutex_init(&locks->users, NULL);
+    return locks;
+}
+
+static void destroyStoreLocks(StoreLocks* locks) {
+    pthread_rwlock_destroy(&locks->structure);
+    for (int i = 0; i < DAY_LOCK_STRIPES; i++) {
+        pthread_mutex_destroy(&locks->days[i]);
+    }
+    pthread_mutex_destroy(&locks->journal);
+    pthread_cond_destroy(&locks->synced);
+    pthread_mutex_destroy(&locks->users);
+    free(locks);
+}
+
+static void* watchForSignals(void* argument) {
+    SignalWatcher* watcher = (SignalWatcher*)argument;
+    int received;
+    
+    while (sigwait(&watcher->signals, &received) == 0 && !__atomic_load_n(&watcher->stopping, __ATOMIC_ACQUIRE)) {
+        if (received == SIGALRM) {
+            runDueReminders(watcher->store);
+        } else {
+            writeMetricsFile(watcher->store, watcher->users);
+        }
+    }
+    return NULL;
+}
+#endif
+
+// Starts a thread that, like the server's main thread, writes the metrics
+// file as soon as SIGUSR1 arrives and sends due reminders on a timer, even
+// while the menus wait for input. The store gets the locks the server
+// uses, as that thread works on it alongside this one.
+void watchSignals(AppointmentStore* store, UserStore* users) {
+#ifndef _WIN32
+    if (store->metrics == NULL && store->reminders == NULL) return;
+    
+    SignalWatcher* watcher = (SignalWatcher*)malloc(sizeof(SignalWatcher));
+    if (watcher == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    watcher->store = store;
+    watcher->users = users;
+    watcher->stopping = 0;
+    watcher->wake = store->metrics != NULL ? SIGUSR1 : SIGALRM;
+    sigemptyset(&watcher->signals);
+    if (store->metrics != NULL) sigaddset(&watcher->signals, SIGUSR1);
+    if (store->reminders != NULL) sigaddset(&watcher->signals, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &watcher->signals, NULL);
+    
+    store->locks = createStoreLocks();
+    store->watcher = watcher;
+    pthread_create(&watcher->thread, NULL, watchForSignals, watcher);
+    
+    if (store->reminders != NULL) {
+        struct itimerval tick;
+        memset(&tick, 0, sizeof(tick));
+        tick.it_interval.tv_sec = REMINDER_TICK_SECONDS;
+        tick.it_value.tv_sec = REMINDER_TICK_SECONDS;
+        setitimer(ITIMER_REAL, &tick, NULL);
+    }
+#else
+    (void)store; (void)users;
+#endif
+}
+
+// Stops the thread watchSignals started; the store is single-threaded again
+void stopWatchingSignals(AppointmentStore* store) {
+#ifndef _WIN32
+    SignalWatcher* watcher = store->watcher;
+    if (watcher == NULL) return;
+    
+    if (store->reminders != NULL) {
+        struct itimerval tick;
+        memset(&tick, 0, sizeof(tick));
+        setitimer(ITIMER_REAL, &tick, NULL);
+    }
+    
+    __atomic_store_n(&watcher->stopping, 1, __ATOMIC_RELEASE);
+    pthread_kill(watcher->thread, watcher->wake);
+    pthread_join(watcher->thread, NULL);
+    
+    destroyStoreLocks(store->locks);
+    store->locks = NULL;
+    free(watcher);
+    store->watcher = NULL;
+#else
+    (void)store;
+#endif
+}
+
+#ifndef _WIN32
+// Whole-file fcntl lock on SHARED_FILE, dropped by the kernel if the
+// process dies. Nested calls only count, so a change that compacts the
+// journal part way through keeps the lock it already has.
+static void lockSharedFile(SharedStore* shared) {
+    if (shared->depth++ > 0) return;
+    
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    
+    while (fcntl(shared->fd, F_SETLKW, &lock) != 0) {
+        if (errno != EINTR) {
+            printf("Error locking %s.\n", SHARED_FILE);
+            break;
+        }
+    }
+}
+
+static void unlockSharedFile(SharedStore* shared) {
+    if (--shared->depth > 0) return;
+    
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_UNLCK;
+    lock.l_whence = SEEK_SET;
+    fcntl(shared->fd, F_SETLK, &lock);
+}
+
+// Loads the store from the files as they are now, under the lock
+static void reloadSharedStore(AppointmentStore* store) {
+    SharedStore* shared = store->shared;
+    
+    // The journal this process had open may have been folded in and removed
+    closeJournal(&store->journal);
+    shared->epoch = shared->state->epoch;
+    loadAppointmentsFromFile(store);
+    shared->state->doctors = store->doctors.count;
+}
+
+// Applies what other processes changed since this one last held the lock.
+// The journal on disk is the truth: whatever it holds past the records
+// already applied is new, and a journal shorter than that, or a new epoch,
+// means it was folded into DATA_FILE and everything is loaded again.
+static void syncSharedStore(AppointmentStore* store) {
+    SharedStore* shared = store->shared;
+    SharedState* state = shared->state;
+    Journal* journal = &store->journal;
+    struct stat info;
+    
+    size_t complete = stat(JOURNAL_FILE, &info) == 0 ? (size_t)info.st_size / sizeof(JournalRecord) : 0;
+    
+    // Locked against the thread that may be writing the metrics file
+    lockStore(store, 1);
+    if (state->epoch != shared->epoch || complete < journal->records) {
+        reloadSharedStore(store);
+        journal->stats.reloads++;
+    } else {
+        if (state->doctors != store->doctors.count) loadDoctorsFromFile(store);
+        if (complete > journal->records) journal->stats.caughtUp += replayJournal(store, journal->records);
+    }
+    unlockStore(store);
+    
+    // A record torn by a process that died mid-append would misalign every one after it
+    if (stat(JOURNAL_FILE, &info) == 0 && (size_t)info.st_size > journal->records * sizeof(JournalRecord) &&
+        truncate(JOURNAL_FILE, (off_t)(journal->records * sizeof(JournalRecord))) != 0) {
+        printf("Error repairing %s.\n", JOURNAL_FILE);
+    }
+    
+    shared->generation = state->generation;
+}
+#endif
+
+// Maps SHARED_FILE, creating it if this is the first process, and loads
+// the store under its lock
+int loadSharedStore(AppointmentStore* store, UserStore* users) {
+#ifndef _WIN32
+    int fd = open(SHARED_FILE, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        printf("Could not open %s.\n", SHARED_FILE);
+        return 0;
+    }
+    
+    SharedStore* shared = (SharedStore*)calloc(1, sizeof(SharedStore));
+    if (shared == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    shared->fd = fd;
+    lockSharedFile(shared);
+    
+    // Zeroes are a valid state, so the first process only has to size the file
+    struct stat info;
+    void* base = MAP_FAILED;
+    if (fstat(fd, &info) == 0 &&
+        ((size_t)info.st_size >= sizeof(SharedState) || ftruncate(fd, sizeof(SharedState)) == 0)) {
+        base = mmap(NULL, sizeof(SharedState), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    
+    SharedState* state = base != MAP_FAILED ? (SharedState*)base : NULL;
+    if (state != NULL && state->magic == 0) {
+        state->magic = SHARED_FILE_MAGIC;
+        state->version = FILE_FORMAT_VERSION;
+    }
+    
+    if (state == NULL || state->magic != SHARED_FILE_MAGIC || state->version != FILE_FORMAT_VERSION) {
+        printf(state == NULL ? "Could not map %s.\n" : "%s is not in the expected format.\n", SHARED_FILE);
+        if (state != NULL) munmap(state, sizeof(SharedState));
+        close(fd); // drops the lock
+        free(shared);
+        return 0;
+    }
+    
+    shared->state = state;
+    shared->users = state->users;
+    store->shared = shared;
+    users->shared = shared;
+    
+    reloadSharedStore(store);
+    shared->generation = state->generation;
+    unlockSharedStore(store);
+    return 1;
+#else
+    (void)store; (void)users;
+    printf("--shared is not available on this system.\n");
+    return 0;
+#endif
+}
+
+void closeSharedStore(AppointmentStore* store, UserStore* users) {
+#ifndef _WIN32
+    SharedStore* shared = store->shared;
+    if (shared == NULL) return;
+    
+    munmap(shared->state, sizeof(SharedState));
+    close(shared->fd);
+    free(shared);
+    store->shared = NULL;
+    users->shared = NULL;
+#else
+    (void)store; (void)users;
+#endif
+}
+
+// Takes the lock other --shared processes change the files under and
+// catches up with them. Does nothing for a store of its own.
+void lockSharedStore(AppointmentStore* store) {
+#ifndef _WIN32
+    SharedStore* shared = store->shared;
+    if (shared == NULL) return;
+    
+    lockSharedFile(shared);
+    if (shared->depth == 1) syncSharedStore(store);
+#else
+    (void)store;
+#endif
+}
+
+// Lets the other processes know about any change made while locked
+void unlockSharedStore(AppointmentStore* store) {
+#ifndef _WIN32
+    SharedStore* shared = store->shared;
+    if (shared == NULL) return;
+    
+    if (shared->depth == 1 && shared->changed) {
+        SharedState* state = shared->state;
+        state->doctors = store->doctors.count;
+        shared->generation = state->generation + 1;
+        __atomic_store_n(&state->generation, shared->generation, __ATOMIC_RELEASE);
+        shared->changed = 0;
+    }
+    
+    unlockSharedFile(shared);
+#else
+    (void)store;
+#endif
+}
+
+// Catches up before something is shown. When no other process has changed
+// anything this costs one read of the mapped generation, no lock or file.
+void refreshSharedStore(AppointmentStore* store) {
+#ifndef _WIN32
+    SharedStore* shared = store->shared;
+    if (shared == NULL || __atomic_load_n(&shared->state->generation, __ATOMIC_ACQUIRE) == shared->generation) {
+        return;
+    }
+    
+    lockSharedStore(store);
+    unlockSharedStore(store);
+#else
+    (void)store;
+#endif
+}
+
+void markSharedChange(AppointmentStore* store) {
+#ifndef _WIN32
+    if (store->shared != NULL) store->shared->changed = 1;
+#else
+    (void)store;
+#endif
+}
+
+// Takes the shared lock before USER_FILE is rewritten and adds the users
+// other processes saved meanwhile, so none of theirs is written over
+void lockSharedUsers(UserStore* users) {
+#ifndef _WIN32
+    SharedStore* shared = users->shared;
+    if (shared == NULL) return;
+    
+    lockSharedFile(shared);
+    if (shared->state->users == shared->users) return;
+    
+    UserStore saved = {0};
+    loadUsersFromFile(&saved);
+    
+    for (size_t i = 0; i < users->count; i++) {
+        const User* user = &users->users[i];
+        if (!insertUser(&saved, user) && strcmp(findUser(&saved, user->username)->password, user->password) != 0) {
+            printf("Username %s was taken on another terminal in the meantime.\n", user->username);
+        }
+    }
+    
+    free(users->users);
+    free(users->table);
+    users->users = saved.users;
+    users->count = saved.count;
+    users->capacity = saved.capacity;
+    users->table = saved.table;
+    users->tableCapacity = saved.tableCapacity;
+#else
+    (void)users;
+#endif
+}
+
+void unlockSharedUsers(UserStore* users) {
+#ifndef _WIN32
+    SharedStore* shared = users->shared;
+    if (shared == NULL) return;
+    
+    shared->users = ++shared->state->users;
+    unlockSharedFile(shared);
+#else
+    (void)users;
+#endif
+}
+
+// Loads users other processes signed up since this one last looked, unless
+// some of its own are still to be saved
+void refreshSharedUsers(UserStore* users) {
+#ifndef _WIN32
+    SharedStore* shared = users->shared;
+    if (shared == NULL || users->dirty) return;
+    
+    uint64_t seen = __atomic_load_n(&shared->state->users, __ATOMIC_ACQUIRE);
+    if (seen == shared->users) return;
+    
+    loadUsersFromFile(users);
+    shared->users = seen;
+#else
+    (void)users;
+#endif
+}
+
+static uint64_t writeJournalRecord(AppointmentStore* store, const JournalRecord* record) {
+    Journal* journal = &store->journal;
+    
+    journal->stats.changes++;
+    if (journal->deferred) {
+        journal->records++;
+        return 0;
+    }
+    
+    if (journal->file == NULL) {
+        journal->file = fopen(JOURNAL_FILE, "ab");
+        if (journal->file == NULL) {
+            printf("Error opening journal for writing.\n");
+            return 0;
+        }
+        
+        // A log created since the last directory sync could vanish in a crash
+        syncDirectory();
+        journal->stats.logSyncs++;
+    }
+    
+    if (fwrite(record, sizeof(*record), 1, journal->file) != 1 || fflush(journal->file) != 0) {
+        printf("Error writing journal.\n");
+        return 0;
+    }
+    
+    journal->records++;
+    journal->stats.logRecords++;
+    journal->stats.logBytes += sizeof(*record);
+    uint64_t sequence = ++journal->appended;
+    markSharedChange(store);
+    
+    if (journal->records >= JOURNAL_COMPACT_THRESHOLD) {
+        compactJournal(store);
+    }
+    
+    return sequence;
+}
+
+// Fills a record with the old key of an appointment and its new contents
+static void fillJournalRecord(JournalRecord* record, int op, const Appointment* before, const Appointment* after) {
+    memset(record, 0, sizeof(*record));
+    record->op = op;
+    
+    if (before != NULL) {
+        record->oldDate = keyDate(before->key);
+        keyTime(before->key, &record->oldHour, &record->oldMinute);
+        record->oldDoctor = keyDoctor(before->key);
+    }
+    
+    if (after != NULL) {
+        strncpy(record->name, after->name, MAX_NAME_LEN - 1);
+        strncpy(record->illness, after->illness, MAX_NAME_LEN - 1);
+        record->date = keyDate(after->key);
+        keyTime(after->key, &record->hour, &record->minute);
+        record->doctor = keyDoctor(after->key);
+        record->duration = after->duration;
+    }
+}
+
+static uint64_t appendJournalRecord(AppointmentStore* store, JournalRecord* record) {
+#ifndef _WIN32
+    if (store->locks != NULL) pthread_mutex_lock(&store->locks->journal);
+#endif
+    uint64_t sequence = writeJournalRecord(store, record);
+#ifndef _WIN32
+    if (store->locks != NULL) pthread_mutex_unlock(&store->locks->journal);
+#endif
+    return sequence;
+}
+
+// Logs one change to the store. Each call writes a single fixed-size record
+// no matter how many appointments exist. Callers still hold the stripes of
+// the days involved, so records for one day are logged in the order applied.
+// Returns the number to pass to journalCommit, 0 if there is nothing to wait for.
+uint64_t journalAppend(AppointmentStore* store, int op, const Appointment* before, const Appointment* after) {
+    JournalRecord record;
+    fillJournalRecord(&record, op, before, after);
+    return appendJournalRecord(store, &record);
+}
+
+// Logs an occurrence of a series moved out on its own as a JOURNAL_MOVE
+// that also names the series and the occurrence, so the skip and the new
+// appointment are replayed together or not at all
+uint64_t journalAppendOccurrenceMove(AppointmentStore* store, const Series* series, int occurrence,
+                                     const Appointment* before, const Appointment* after) {
+    JournalRecord record;
+    fillJournalRecord(&record, JOURNAL_MOVE, before, after);
+    record.series = series->id;
+    record.occurrence = occurrence;
+    return appendJournalRecord(store, &record);
+}
+
+// Logs a change to a series in one record, the whole rule included when it
+// is added. Callers hold the stripes of every day the change affects.
+uint64_t journalAppendSeries(AppointmentStore* store, int op, const Series* series, int occurrence) {
+    JournalRecord record;
+    
+    memset(&record, 0, sizeof(record));
+    record.op = op;
+    record.series = series->id;
+    record.occurrence = occurrence;
+    
+    if (op == JOURNAL_SERIES_ADD) {
+        strcpy(record.name, series->name);
+        strcpy(record.illness, series->illness);
+        record.date = dateFromDayNumber(series->firstDay);
+        record.hour = series->hour;
+        record.minute = series->minute;
+        record.doctor = series->doctor;
+        record.duration = series->duration;
+        record.interval = series->interval;
+        record.occurrences = series->occurrences;
+    }
+    
+    return appendJournalRecord(store, &record);
+}
+
+// Returns once the journal record with the given number is on disk. Server
+// threads that arrive while another's fsync is under way wait for it and
+// then share the next one, so a burst of changes costs a few fsyncs rather
+// than one each; a commit window holds each fsync back a little longer to
+// gather more. Called after the day stripes are released, so bookings for
+// the same day can pile up behind one fsync too.
+void journalCommit(AppointmentStore* store, uint64_t sequence) {
+    Journal* journal = &store->journal;
+    if (sequence == 0) return;
+    
+#ifndef _WIN32
+    if (store->locks != NULL) {
+        pthread_mutex_t* lock = &store->locks->journal;
+        pthread_mutex_lock(lock);
+        journal->stats.commits++;
+        
+        while (journal->durable < sequence) {
+            if (journal->syncing) {
+                pthread_cond_wait(&store->locks->synced, lock);
+                continue;
+            }
+            
+            journal->syncing = 1;
+            if (journal->commitWindow > 0) {
+                pthread_mutex_unlock(lock);
+                usleep((useconds_t)journal->commitWindow);
+                pthread_mutex_lock(lock);
+            }
+            
+            // Appends go on while a duplicate descriptor is synced outside
+            // the lock; a compaction closing the log meanwhile does no harm
+            uint64_t covered = journal->appended;
+            int fd = journal->file != NULL ? dup(fileno(journal->file)) : -1;
+            pthread_mutex_unlock(lock);
+            
+            int ok = fd >= 0 && fsync(fd) == 0;
+            if (fd >= 0) close(fd);
+            
+            pthread_mutex_lock(lock);
+            journal->syncing = 0;
+            journal->stats.logSyncs++;
+            if (ok && covered > journal->durable) journal->durable = covered;
+            pthread_cond_broadcast(&store->locks->synced);
+            
+            if (!ok) {
+                printf("Error syncing journal.\n");
+                break;
+            }
+        }
+        
+        pthread_mutex_unlock(lock);
+        return;
+    }
+#endif
+    
+    // With a single thread there is never anyone to share an fsync with
+    journal->stats.commits++;
+    if (journal->durable < sequence) {
+        if (journal->file == NULL || !syncFile(journal->file)) {
+            printf("Error syncing journal.\n");
+            return;
+        }
+        journal->stats.logSyncs++;
+        journal->durable = journal->appended;
+    }
+}
+
+// Copies the appointment store's storage counters while nothing updates them
+StorageStats readStorageStats(AppointmentStore* store) {
+#ifndef _WIN32
+    if (store->locks != NULL) pthread_mutex_lock(&store->locks->journal);
+#endif
+    lockStore(store, 0); // Doctor list saves count under the structure lock
+    StorageStats stats = store->journal.stats;
+    unlockStore(store);
+#ifndef _WIN32
+    if (store->locks != NULL) pthread_mutex_unlock(&store->locks->journal);
+#endif
+    return stats;
+}
+
+// Applies one logged change to a series; each is harmless to repeat
+static void applySeriesRecord(AppointmentStore* store, const JournalRecord* record) {
+    Series* existing = findSeries(&store->series, record->series);
+    
+    if (record->op == JOURNAL_SERIES_SKIP) {
+        if (existing != NULL && record->occurrence >= 0 && record->occurrence < existing->occurrences &&
+            !isOccurrenceSkipped(existing, record->occurrence)) {
+            trackOccurrence(store, existing, record->occurrence, -1);
+            existing->skipped[record->occurrence / 64] |= (uint64_t)1 << (record->occurrence % 64);
+        }
+        return;
+    }
+    
+    if (record->op == JOURNAL_SERIES_END) {
+        if (existing != NULL) {
+            trackSeries(store, existing, -1);
+            removeSeries(&store->series, existing);
+        }
+        return;
+    }
+    
+    // Already in SERIES_FILE, or not a rule this build would have booked
+    if (existing != NULL || record->interval < 1 || record->interval > SERIES_MAX_INTERVAL ||
+        record->occurrences < 1 || record->occurrences > SERIES_MAX_OCCURRENCES ||
+        !isDurationValid(record->duration) || slotIndex(record->hour, record->minute) < 0) {
+        return;
+    }
+    
+    Series series;
+    memset(&series, 0, sizeof(series));
+    series.id = record->series;
+    series.firstDay = dayNumber(record->date);
+    series.interval = record->interval;
+    series.occurrences = record->occurrences;
+    series.hour = record->hour;
+    series.minute = record->minute;
+    series.duration = record->duration;
+    series.doctor = record->doctor;
+    memcpy(series.name, record->name, MAX_NAME_LEN - 1);
+    memcpy(series.illness, record->illness, MAX_NAME_LEN - 1);
+    insertSeries(&store->series, &series);
+    trackSeries(store, &series, 1);
+}
+
+// Applies one logged change to the in-memory store
+static void applyJournalRecord(AppointmentStore* store, const JournalRecord* record) {
+    Appointment* target = NULL;
+    
+    if (record->op >= JOURNAL_SERIES_ADD && record->op <= JOURNAL_SERIES_END) {
+        applySeriesRecord(store, record);
+        return;
+    }
+    
+    // An occurrence moved out of its series is skipped there, then added
+    // below as the appointment it became
+    int fromSeries = record->op == JOURNAL_MOVE && record->series != 0;
+    if (fromSeries) {
+        JournalRecord skip = *record;
+        skip.op = JOURNAL_SERIES_SKIP;
+        applySeriesRecord(store, &skip);
+    }
+    
+    if (!fromSeries && (record->op == JOURNAL_DELETE || record->op == JOURNAL_MODIFY || record->op == JOURNAL_MOVE)) {
+        target = storeFind(store, record->oldDate, record->oldHour, record->oldMinute, record->oldDoctor);
+        if (target == NULL) return; // Already reflected in the snapshot
+        storeRemove(store, target);
+    }
+    
+    if (record->op == JOURNAL_DELETE) {
+        releaseAppointment(store, target);
+        return;
+    }
+    
+    if (target == NULL) {
+        // A server can log an addition just after a compaction already saved it
+        if (storeFind(store, record->date, record->hour, record->minute, record->doctor) != NULL) return;
+        target = allocateAppointment(store);
+    }
+    
+    char text[MAX_NAME_LEN];
+    text[MAX_NAME_LEN - 1] = '\0';
+    
+    memcpy(text, record->name, MAX_NAME_LEN - 1);
+    target->name = internString(&store->strings, text);
+    memcpy(text, record->illness, MAX_NAME_LEN - 1);
+    target->illness = internString(&store->strings, text);
+    target->key = makeKey(record->date, record->hour, record->minute, record->doctor);
+    target->duration = record->duration > 0 && record->duration <= DAY_MINUTES
+                           ? (uint16_t)record->duration : APPOINTMENT_DURATION;
+    target->next = NULL;
+    storeInsert(store, target);
+}
+
+// Re-applies logged changes from record number first on, on top of the
+// loaded snapshot or, with --shared, of what was applied before. Returns
+// how many were applied.
+size_t replayJournal(AppointmentStore* store, size_t first) {
+    FILE* file = fopen(JOURNAL_FILE, "rb");
+    store->journal.records = first;
+    if (file == NULL) return 0;
+    
+    JournalRecord record;
+    size_t replayed = 0;
+    
+    if (first > 0 && fseek(file, (long)(first * sizeof(record)), SEEK_SET) != 0) {
+        fclose(file);
+        return 0;
+    }
+    
+    // A torn record at the tail (crash mid-append) is simply not read
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        if (record.op < JOURNAL_ADD || record.op > JOURNAL_MOVE) break;
+        applyJournalRecord(store, &record);
+        replayed++;
+    }
+    
+    fclose(file);
+    
+    // Compacting then starts the next session from a clean snapshot and an empty log
+    store->journal.records = first + replayed;
+    return replayed;
+}
+
+// Folds the journal into DATA_FILE and SERIES_FILE and starts a new, empty log. While
+// server threads run, only journalAppend calls this, under the journal lock.
+void compactJournal(AppointmentStore* store) {
+    // With --shared the snapshot must include what other processes changed
+    lockSharedStore(store);
+    if (store->journal.records > 0) saveSnapshot(store); // else DATA_FILE is already current
+    unlockSharedStore(store);
+}
+
+// Writes DATA_FILE and SERIES_FILE and starts a new, empty log, whether or
+// not anything was logged; changes made without a log record (an import,
+// say) are saved this way. Returns 0, keeping the log, if the snapshot
+// could not be written.
+int saveSnapshot(AppointmentStore* store) {
+    Journal* journal = &store->journal;
+    
+    lockSharedStore(store);
+    
+    // Keep the log if the snapshot could not be written; it still has the changes
+    lockStore(store, 0);
+    int saved = saveAppointmentsToFile(store) && saveSeriesToFile(store);
+    unlockStore(store);
+    if (!saved) {
+        unlockSharedStore(store);
+        return 0;
+    }
+    
+    closeJournal(journal);
+    remove(JOURNAL_FILE);
+    journal->records = 0;
+    
+    // Everything logged is in the snapshot, which is already on disk
+    journal->durable = journal->appended;
+    
+#ifndef _WIN32
+    // The other processes load the snapshot instead of reading on in the old log
+    if (store->shared != NULL) {
+        store->shared->epoch = ++store->shared->state->epoch;
+        store->shared->changed = 1;
+    }
+#endif
+    unlockSharedStore(store);
+    return 1;
+}
+
+void closeJournal(Journal* journal) {
+    if (journal->file != NULL) {
+        fclose(journal->file);
+        journal->file = NULL;
+    }
+}
+
+// Maps a data file and checks that its header matches this build, or has
+// shorter records of at least minRecordSize bytes (earlier layouts, which
+// only ever grew at the end; 0 for none). Returns 0 if the file is missing
+// or unusable (after saying why, for the latter).
+int mapDataFile(const char* path, uint32_t magic, uint32_t recordSize, uint32_t minRecordSize,
+                MappedFile* file, const FileHeader** header) {
+    memset(file, 0, sizeof(*file));
+    
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return 0;
+    }
+    
+    file->size = (size_t)info.st_size;
+    if (file->size >= sizeof(FileHeader)) {
+        void* base = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base != MAP_FAILED) {
+            file->base = base;
+            file->mapped = 1;
+        }
+    }
+    close(fd);
+#else
+    FILE* input = fopen(path, "rb");
+    if (input == NULL) return 0;
+    
+    fseek(input, 0, SEEK_END);
+    long size = ftell(input);
+    fseek(input, 0, SEEK_SET);
+    
+    file->size = size > 0 ? (size_t)size : 0;
+    if (file->size >= sizeof(FileHeader)) {
+        file->base = malloc(file->size);
+        if (file->base != NULL && fread(file->base, 1, file->size, input) != file->size) {
+            free(file->base);
+            file->base = NULL;
+        }
+    }
+    fclose(input);
+#endif
+    
+    if (file->base == NULL) {
+        printf("Could not read %s.\n", path);
+        return 0;
+    }
+    
+    const FileHeader* h = (const FileHeader*)file->base;
+    const char* problem = NULL;
+    
+    if (h->magic != magic) {
+        problem = "it is not in the expected format";
+    } else if (h->endianMark != FILE_ENDIAN_MARK) {
+        problem = "it was written on a machine with a different byte order";
+    } else if (h->version != FILE_FORMAT_VERSION) {
+        problem = "it was written by an unsupported version";
+    } else if ((h->recordSize != recordSize &&
+                (minRecordSize == 0 || h->recordSize < minRecordSize || h->recordSize > recordSize ||
+                 h->recordSize % sizeof(int32_t) != 0)) ||
+               h->nameLen != MAX_NAME_LEN || h->passLen != MAX_PASS_LEN) {
+        problem = "its record layout does not match this build";
+    } else if (h->recordCount > (file->size - sizeof(FileHeader)) / h->recordSize) {
+        problem = "it is truncated";
+    }
+    
+    if (problem != NULL) {
+        printf("Ignoring %s: %s.\n", path, problem);
+        unmapDataFile(file);
+        return 0;
+    }
+    
+    *header = h;
+    return 1;
+}
+
+void unmapDataFile(MappedFile* file) {
+#ifndef _WIN32
+    if (file->mapped) {
+        munmap(file->base, file->size);
+    } else {
+        free(file->base);
+    }
+#else
+    free(file->base);
+#endif
+    file->base = NULL;
+    file->size = 0;
+}
+
+// Flushes a file and waits until its contents are on disk
+int syncFile(FILE* file) {
+    if (fflush(file) != 0) return 0;
+#ifndef _WIN32
+    return fsync(fileno(file)) == 0;
+#else
+    return _commit(_fileno(file)) == 0;
+#endif
+}
+
+// Makes renames and new files in the working directory, where every data
+// file lives, survive a crash. Windows offers no way to sync a directory.
+int syncDirectory() {
+#ifndef _WIN32
+    int fd = open(".", O_RDONLY);
+    if (fd < 0) return 0;
+    
+    int ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+#else
+    return 1;
+#endif
+}
+
+// Finishes a snapshot written to tempPath (written is 0 if writing it
+// already failed): syncs and closes it, then renames it over path. A crash
+// at any point leaves either the old file or the complete new one. Returns
+// 0, with path untouched and the temporary file removed, on failure.
+int commitFile(FILE* file, int written, const char* tempPath, const char* path, StorageStats* stats) {
+    long bytes = ftell(file);
+    int ok = written && syncFile(file);
+    
+    if (fclose(file) != 0) ok = 0;
+    
+    if (!ok) {
+        remove(tempPath);
+        return 0;
+    }
+    
+#ifdef _WIN32
+    remove(path); // rename() does not replace an existing file on Windows
+#endif
+    if (rename(tempPath, path) != 0) {
+        remove(tempPath);
+        return 0;
+    }
+    
+    // Until the directory is synced the rename itself could be lost
+    syncDirectory();
+    
+    stats->snapshots++;
+    stats->snapshotBytes += bytes > 0 ? (uint64_t)bytes : 0;
+    stats->snapshotSyncs += 2;
+    return 1;
+}
+
+int writeFileHeader(FILE* file, uint32_t magic, uint32_t recordSize, uint64_t recordCount) {
+    FileHeader header;
+    
+    memset(&header, 0, sizeof(header));
+    header.magic = magic;
+    header.version = FILE_FORMAT_VERSION;
+    header.endianMark = FILE_ENDIAN_MARK;
+    header.recordSize = recordSize;
+    header.recordCount = recordCount;
+    header.nameLen = MAX_NAME_LEN;
+    header.passLen = MAX_PASS_LEN;
+    
+    return fwrite(&header, sizeof(header), 1, file) == 1;
+}
+
+// One-shot import of LEGACY_DATA_FILE and LEGACY_USER_FILE into the
+// current format. The old files are left in place.
+int convertLegacyFiles() {
+    FILE* existing = fopen(DATA_FILE, "rb");
+    if (existing != NULL) {
+        fclose(existing);
+        printf("%s already exists; remove it first to convert again.\n", DATA_FILE);
+        return 0;
+    }
+    
+    AppointmentStore store = {0};
+    FILE* file = fopen(LEGACY_DATA_FILE, "rb");
+    
+    if (file != NULL) {
+        LegacyAppointment legacy;
+        
+        while (fread(&legacy, sizeof(legacy), 1, file) == 1) {
+            Appointment* appointment = allocateAppointment(&store);
+            legacy.name[MAX_NAME_LEN - 1] = '\0';
+            legacy.illness[MAX_NAME_LEN - 1] = '\0';
+            appointment->name = internString(&store.strings, legacy.name);
+            appointment->illness = internString(&store.strings, legacy.illness);
+            appointment->key = makeKey(legacy.date, legacy.hour, legacy.minute, 0);
+            appointment->duration = APPOINTMENT_DURATION;
+            storeInsert(&store, appointment);
+        }
+        
+        fclose(file);
+    }
+    
+    int ok = saveAppointmentsToFile(&store);
+    printf("Converted %zu appointments from %s.\n", store.count, LEGACY_DATA_FILE);
+    freeAppointmentStore(&store);
+    
+    UserStore users = {0};
+    file = fopen(LEGACY_USER_FILE, "rb");
+    
+    if (file != NULL) {
+        LegacyUser legacy;
+        User user;
+        
+        while (fread(&legacy, sizeof(legacy), 1, file) == 1) {
+            memcpy(user.username, legacy.username, MAX_NAME_LEN);
+            memcpy(user.password, legacy.password, MAX_PASS_LEN);
+            user.is_admin = legacy.is_admin;
+            insertUser(&users, &user);
+        }
+        
+        fclose(file);
+        saveUsersToFile(&users);
+        printf("Converted %zu users from %s.\n", users.count, LEGACY_USER_FILE);
+    }
+    
+    freeUserStore(&users);
+    return ok;
+}
+
+// Splits a line into whitespace-separated tokens in place
+static int splitTokens(char* line, char** tokens, int maxTokens) {
+    int count = 0;
+    char* c = line;
+    
+    while (*c != '\0' && count < maxTokens) {
+        while (isspace((unsigned char)*c)) c++;
+        if (*c == '\0') break;
+        
+        tokens[count++] = c;
+        while (*c != '\0' && !isspace((unsigned char)*c)) c++;
+        if (*c != '\0') *c++ = '\0';
+    }
+    
+    return count;
+}
+
+// Parses a whole token as a decimal integer
+static int parseInt(const char* token, int* value) {
+    char* end;
+    long parsed = strtol(token, &end, 10);
+    
+    if (end == token || *end != '\0' || parsed < -1000000 || parsed > 1000000) return 0;
+    *value = (int)parsed;
+    return 1;
+}
+
+// Parses "DD MM YYYY HH MM" starting at tokens[0]
+static int parseDateTime(char** tokens, Date* date, int* hour, int* minute) {
+    return parseInt(tokens[0], &date->day) && parseInt(tokens[1], &date->month) &&
+           parseInt(tokens[2], &date->year) && parseInt(tokens[3], hour) && parseInt(tokens[4], minute);
+}
+
+static int fitsName(const char* text) {
+    return strlen(text) < MAX_NAME_LEN;
+}
+
+// Parses a doctor's name, or ANY when allowAny is set, into a doctor number
+static int parseDoctor(AppointmentStore* store, const char* token, int allowAny, int* doctor) {
+    if (allowAny && (strcmp(token, "ANY") == 0 || strcmp(token, "any") == 0)) {
+        *doctor = DOCTOR_ANY;
+        return 1;
+    }
+    
+    lockStore(store, 0);
+    *doctor = findDoctor(store, token);
+    unlockStore(store);
+    return *doctor != 0;
+}
+
+// Takes a trailing "FOR minutes" off the tokens, if there is one, leaving
+// APPOINTMENT_DURATION otherwise. Returns 0 if the length is not valid.
+static int takeDuration(char** tokens, int* count, int* duration) {
+    *duration = APPOINTMENT_DURATION;
+    if (*count < 3 || (strcmp(tokens[*count - 2], "FOR") != 0 && strcmp(tokens[*count - 2], "for") != 0)) {
+        return 1;
+    }
+    
+    *count -= 2;
+    return parseInt(tokens[*count + 1], duration) && isDurationValid(*duration);
+}
+
+static void appendReply(ReplyBuffer* reply, const char* text, size_t length) {
+    if (reply->length + length > reply->capacity) {
+        size_t capacity = reply->capacity > 0 ? reply->capacity : BATCH_LINE_LEN;
+        while (capacity < reply->length + length) capacity *= 2;
+        
+        char* grown = (char*)realloc(reply->text, capacity);
+        if (grown == NULL) {
+            printf("Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        reply->text = grown;
+        reply->capacity = capacity;
+    }
+    
+    memcpy(reply->text + reply->length, text, length);
+    reply->length += length;
+}
+
+// Sink for the CLOCK command: each reminder is a reply line, kept in a
+// ReplyBuffer until the store is unlocked, as well as a line in the
+// reminder file
+static void echoReminder(AppointmentStore* store, const Reminder* reminder, void* context) {
+    char name[MAX_NAME_LEN];
+    char line[2 * MAX_NAME_LEN + 64];
+    int hour, minute;
+    
+    strcpy(name, reminder->name);
+    decrypt(name);
+    keyTime(reminder->key, &hour, &minute);
+    Date date = keyDate(reminder->key);
+    int doctor = keyDoctor(reminder->key);
+    
+    int length = snprintf(line, sizeof(line), "REMIND %02d/%02d/%04d %02d:%02d %s %d%s%s\n", date.day, date.month,
+                          date.year, hour, minute, name, reminder->lead, doctor != 0 ? " " : "",
+                          doctor != 0 ? doctorName(store, doctor) : "");
+    appendReply((ReplyBuffer*)context, line, length < (int)sizeof(line) ? (size_t)length : sizeof(line) - 1);
+    
+    logReminder(store, reminder, store->reminders->log);
+}
+
+// Ends a reply line with the doctor's name, if there is one
+static void endWithDoctor(AppointmentStore* store, int doctor, FILE* out) {
+    if (doctor != 0) {
+        lockStore(store, 0);
+        fprintf(out, " %s", doctorName(store, doctor));
+        unlockStore(store);
+    }
+    fprintf(out, "\n");
+}
+
+// Prints one search hit as a single batch output line
+static void printBatchMatch(const Appointment* appointment, void* context) {
+    const MatchPrinter* printer = (const MatchPrinter*)context;
+    FILE* out = printer->out;
+    char name[MAX_NAME_LEN], illness[MAX_NAME_LEN];
+    
+    strcpy(name, appointment->name);
+    strcpy(illness, appointment->illness);
+    decrypt(name);
+    decrypt(illness);
+    
+    Date date = keyDate(appointment->key);
+    int hour, minute;
+    keyTime(appointment->key, &hour, &minute);
+    int end = hour * 60 + minute + appointment->duration;
+    
+    fprintf(out, "MATCH %s %s %02d/%02d/%04d %02d:%02d-%02d:%02d", name, illness,
+            date.day, date.month, date.year, hour, minute, end / 60, end % 60);
+    if (keyDoctor(appointment->key) != 0) {
+        fprintf(out, " %s", doctorName(printer->store, keyDoctor(appointment->key)));
+    }
+    fprintf(out, "\n");
+}
+
+// Runs one command line against the stores, writing one or more result
+// lines to out. Returns 1 if the command succeeded.
+int executeCommand(AppointmentStore* store, UserStore* users, char* line, FILE* out) {
+    char* tokens[BATCH_MAX_TOKENS];
+    int count = splitTokens(line, tokens, BATCH_MAX_TOKENS);
+    Date date;
+    int hour, minute;
+    
+    if (count == 0 || tokens[0][0] == '#') return 1; // Blank line or comment
+    
+    for (char* c = tokens[0]; *c != '\0'; c++) {
+        *c = (char)toupper((unsigned char)*c);
+    }
+    const char* command = tokens[0];
+    MatchPrinter printer = {out, store};
+    int doctor = 0, duration = APPOINTMENT_DURATION;
+    
+    // Commands that take a length end with FOR minutes
+    int takesDuration = strcmp(command, "BOOK") == 0 || strcmp(command, "SLOTS") == 0 ||
+                        strcmp(command, "NEXT") == 0 || strcmp(command, "FREE") == 0 ||
+                        strcmp(command, "REPEAT") == 0;
+    if (takesDuration && !takeDuration(tokens, &count, &duration)) {
+        fprintf(out, "ERROR %s: the length must be a multiple of %d minutes, up to %d\n",
+                command, SLOT_MINUTES, DAY_MINUTES);
+        return 0;
+    }
+    
+    if (strcmp(command, "BOOK") == 0 && (count == 8 || count == 9)) {
+        // BOOK name illness DD MM YYYY HH MM [doctor|ANY] [FOR minutes]
+        if (!fitsName(tokens[1]) || !fitsName(tokens[2]) || !parseDateTime(&tokens[3], &date, &hour, &minute)) {
+            fprintf(out, "ERROR BOOK: malformed arguments\n");
+            return 0;
+        }
+        
+        const char* problem = dateProblem(date);
+        if (problem != NULL) {
+            fprintf(out, "ERROR BOOK: %s\n", problem);
+            return 0;
+        }
+        
+        if (count == 9 && !parseDoctor(store, tokens[8], 1, &doctor)) {
+            fprintf(out, "ERROR BOOK: %s\n", resultMessage(RESULT_UNKNOWN_DOCTOR));
+            return 0;
+        }
+        
+        BookingRequest appointment;
+        memset(&appointment, 0, sizeof(appointment));
+        strcpy(appointment.name, tokens[1]);
+        strcpy(appointment.illness, tokens[2]);
+        encrypt(appointment.name);
+        encrypt(appointment.illness);
+        appointment.date = date;
+        appointment.hour = hour;
+        appointment.minute = minute;
+        appointment.doctor = doctor;
+        appointment.duration = duration;
+        
+        int result = bookAppointment(store, &appointment);
+        if (result != RESULT_OK) {
+            fprintf(out, "ERROR BOOK: %s\n", resultMessage(result));
+            return 0;
+        }
+        
+        int end = hour * 60 + minute + duration;
+        fprintf(out, "OK BOOK %02d/%02d/%04d %02d:%02d-%02d:%02d", date.day, date.month, date.year, hour, minute,
+                end / 60, end % 60);
+        endWithDoctor(store, appointment.doctor, out);
+        return 1;
+    }
+    
+    if (strcmp(command, "REPEAT") == 0 && count >= 12) {
+        // REPEAT name illness DD MM YYYY HH MM [doctor] EVERY days (TIMES n | UNTIL DD MM YYYY) [FOR minutes]
+        int interval = 0, occurrences = 0, until = 0, rule;
+        Date last;
+        
+        if (strcmp(tokens[count - 2], "TIMES") == 0 || strcmp(tokens[count - 2], "times") == 0) {
+            rule = count - 2;
+            if (!parseInt(tokens[count - 1], &occurrences)) rule = 0;
+        } else if (count >= 14 && (strcmp(tokens[count - 4], "UNTIL") == 0 || strcmp(tokens[count - 4], "until") == 0)) {
+            rule = count - 4;
+            until = 1;
+            if (!parseInt(tokens[count - 3], &last.day) || !parseInt(tokens[count - 2], &last.month) ||
+                !parseInt(tokens[count - 1], &last.year) || calendarProblem(last) != NULL) {
+                rule = 0;
+            }
+        } else {
+            rule = 0;
+        }
+        
+        // What comes before the rule is a BOOK line with EVERY days at the end
+        int valid = (rule == 10 || rule == 11) &&
+                    (strcmp(tokens[rule - 2], "EVERY") == 0 || strcmp(tokens[rule - 2], "every") == 0) &&
+                    parseInt(tokens[rule - 1], &interval) &&
+                    fitsName(tokens[1]) && fitsName(tokens[2]) && parseDateTime(&tokens[3], &date, &hour, &minute);
+        if (!valid) {
+            fprintf(out, "ERROR REPEAT: malformed arguments\n");
+            return 0;
+        }
+        
+        const char* problem = dateProblem(date);
+        if (problem != NULL) {
+            fprintf(out, "ERROR REPEAT: %s\n", problem);
+            return 0;
+        }
+        
+        if (rule == 11 && !parseDoctor(store, tokens[8], 0, &doctor)) {
+            fprintf(out, "ERROR REPEAT: %s\n", resultMessage(RESULT_UNKNOWN_DOCTOR));
+            return 0;
+        }
+        
+        if (until) {
+            occurrences = interval > 0 && compareDate(last, date) >= 0
+                              ? (dayNumber(last) - dayNumber(date)) / interval + 1 : 0;
+        }
+        
+        BookingRequest appointment;
+        memset(&appointment, 0, sizeof(appointment));
+        strcpy(appointment.name, tokens[1]);
+        strcpy(appointment.illness, tokens[2]);
+        encrypt(appointment.name);
+        encrypt(appointment.illness);
+        appointment.date = date;
+        appointment.hour = hour;
+        appointment.minute = minute;
+        appointment.doctor = doctor;
+        appointment.duration = duration;
+        
+        int id;
+        int result = bookSeries(store, &appointment, interval, occurrences, &id);
+        if (result != RESULT_OK) {
+            fprintf(out, "ERROR REPEAT: %s\n", resultMessage(result));
+            return 0;
+        }
+        
+        int end = hour * 60 + minute + duration;
+        fprintf(out, "OK REPEAT %d %d %02d/%02d/%04d %02d:%02d-%02d:%02d", id, occurrences,
+                date.day, date.month, date.year, hour, minute, end / 60, end % 60);
+        endWithDoctor(store, doctor, out);
+        return 1;
+    }
+    
+    if (strcmp(command, "ENDSERIES") == 0 && count == 2) {
+        int id;
+        if (!parseInt(tokens[1], &id)) {
+            fprintf(out, "ERROR ENDSERIES: malformed arguments\n");
+            return 0;
+        }
+        
+        if (endSeries(store, id) != RESULT_OK) {
+            fprintf(out, "ERROR ENDSERIES: no such series\n");
+            return 0;
+        }
+        
+        fprintf(out, "OK ENDSERIES %d\n", id);
+        return 1;
+    }
+    
+    if (strcmp(command, "SERIES") == 0 && count == 1) {
+        // One line per series: number, name, illness, first date and time, rule, cancelled occurrences
+        lockStore(store, 0);
+        size_t listed = store->series.count;
+        for (size_t i = 0; i < listed; i++) {
+            const Series* series = &store->series.items[i];
+            char name[MAX_NAME_LEN], illness[MAX_NAME_LEN];
+            strcpy(name, series->name);
+            strcpy(illness, series->illness);
+            decrypt(name);
+            decrypt(illness);
+            
+            Date first = dateFromDayNumber(series->firstDay);
+            int end = series->hour * 60 + series->minute + series->duration;
+            int skipped = 0;
+            for (int k = 0; k < series->occurrences; k++) skipped += isOccurrenceSkipped(series, k);
+            
+            fprintf(out, "SERIES %d %s %s %02d/%02d/%04d %02d:%02d-%02d:%02d EVERY %d TIMES %d SKIPPED %d",
+                    series->id, name, illness, first.day, first.month, first.year,
+                    series->hour, series->minute, end / 60, end % 60, series->interval, series->occurrences, skipped);
+            if (series->doctor != 0) fprintf(out, " %s", doctorName(store, series->doctor));
+            fprintf(out, "\n");
+        }
+        unlockStore(store);
+        
+        fprintf(out, "OK SERIES %zu\n", listed);
+        return 1;
+    }
+    
+    if (strcmp(command, "CANCEL") == 0 && (count == 6 || count == 7)) {
+        // CANCEL DD MM YYYY HH MM [doctor]
+        if (!parseDateTime(&tokens[1], &date, &hour, &minute)) {
+            fprintf(out, "ERROR CANCEL: malformed arguments\n");
+            return 0;
+        }
+        
+        if (count == 7 && !parseDoctor(store, tokens[6], 0, &doctor)) {
+            fprintf(out, "ERROR CANCEL: %s\n", resultMessage(RESULT_UNKNOWN_DOCTOR));
+            return 0;
+        }
+        
+        int result = cancelAppointment(store, date, hour, minute, doctor);
+        if (result != RESULT_OK) {
+            fprintf(out, "ERROR CANCEL: %s\n", resultMessage(result));
+            return 0;
+        }
+        
+        fprintf(out, "OK CANCEL %02d/%02d/%04d %02d:%02d", date.day, date.month, date.year, hour, minute);
+        endWithDoctor(store, doctor, out);
+        return 1;
+    }
+    
+    if (strcmp(command, "MODIFY") == 0 && count >= 8) {
+        // MODIFY DD MM YYYY HH MM [doctor] ILLNESS text
+        // MODIFY DD MM YYYY HH MM [doctor] DATE DD MM YYYY HH MM
+        if (!parseDateTime(&tokens[1], &date, &hour, &minute)) {
+            fprintf(out, "ERROR MODIFY: malformed arguments\n");
+            return 0;
+        }
+        
+        // The doctor is there when the line is one token longer than usual
+        int at = 6;
+        if (count == 9 || count == 13) {
+            if (!parseDoctor(store, tokens[6], 0, &doctor)) {
+                fprintf(out, "ERROR MODIFY: %s\n", resultMessage(RESULT_UNKNOWN_DOCTOR));
+                return 0;
+            }
+            at = 7;
+        }
+        
+        for (char* c = tokens[at]; *c != '\0'; c++) {
+            *c = (char)toupper((unsigned char)*c);
+        }
+        
+        if (strcmp(tokens[at], "ILLNESS") == 0 && count == at + 2 && fitsName(tokens[at + 1])) {
+            int result = updateIllness(store, date, hour, minute, doctor, tokens[at + 1]);
+            if (result != RESULT_OK) {
+                fprintf(out, "ERROR MODIFY: %s\n", resultMessage(result));
+                return 0;
+            }
+            
+            fprintf(out, "OK MODIFY %02d/%02d/%04d %02d:%02d", date.day, date.month, date.year, hour, minute);
+            endWithDoctor(store, doctor, out);
+            return 1;
+        }
+        
+        Date newDate;
+        int newHour, newMinute;
+        
+        if (strcmp(tokens[at], "DATE") == 0 && count == at + 6 &&
+            parseDateTime(&tokens[at + 1], &newDate, &newHour, &newMinute)) {
+            const char* problem = dateProblem(newDate);
+            if (problem != NULL) {
+                fprintf(out, "ERROR MODIFY: %s\n", problem);
+                return 0;
+            }
+            
+            int result = moveAppointment(store, date, hour, minute, doctor, newDate, newHour, newMinute, doctor);
+            if (result != RESULT_OK) {
+                fprintf(out, "ERROR MODIFY: %s\n", resultMessage(result));
+                return 0;
+            }
+            
+            fprintf(out, "OK MODIFY %02d/%02d/%04d %02d:%02d",
+                    newDate.day, newDate.month, newDate.year, newHour, newMinute);
+            endWithDoctor(store, doctor, out);
+            return 1;
+        }
+        
+        fprintf(out, "ERROR MODIFY: malformed arguments\n");
+        return 0;
+    }
+    
+    if (strcmp(command, "MOVE") == 0 && count >= 12 && count <= 14) {
+        // MOVE DD MM YYYY HH MM [doctor] TO DD MM YYYY HH MM [doctor], also for one
+        // occurrence of a series; the doctor stays the same unless a new one is named
+        int at = strcmp(tokens[6], "TO") == 0 || strcmp(tokens[6], "to") == 0 ? 6 : 7;
+        Date newDate;
+        int newHour, newMinute;
+        
+        if (!parseDateTime(&tokens[1], &date, &hour, &minute) || count < at + 6 || count > at + 7 ||
+            (strcmp(tokens[at], "TO") != 0 && strcmp(tokens[at], "to") != 0) ||
+            !parseDateTime(&tokens[at + 1], &newDate, &newHour, &newMinute)) {
+            fprintf(out, "ERROR MOVE: malformed arguments\n");
+            return 0;
+        }
+        
+        if (at == 7 && !parseDoctor(store, tokens[6], 0, &doctor)) {
+            fprintf(out, "ERROR MOVE: %s\n", resultMessage(RESULT_UNKNOWN_DOCTOR));
+            return 0;
+        }
+        
+        int newDoctor = doctor;
+        if (count == at + 7 && !parseDoctor(store, tokens[at + 6], 0, &newDoctor)) {
+            fprintf(out, "ERROR MOVE: %s\n", resultMessage(RESULT_UNKNOWN_DOCTOR));
+            return 0;
+        }
+        
+        const char* problem = dateProblem(newDate);
+        if (problem != NULL) {
+            fprintf(out, "ERROR MOVE: %s\n", problem);
+            return 0;
+        }
+        
+        int result = moveAppointment(store, date, hour, minute, doctor, newDate, newHour, newMinute, newDoctor);
+        if (result != RESULT_OK) {
+            fprintf(out, "ERROR MOVE: %s\n", resultMessage(result));
+            return 0;
+        }
+        
+        fprintf(out, "OK MOVE %02d/%02d/%04d %02d:%02d",
+                newDate.day, newDate.month, newDate.year, newHour, newMinute);
+        endWithDoctor(store, newDoctor, out);
+        return 1;
+    }
+    
+    if (strcmp(command, "SEARCH") == 0 && count == 2) {
+        // SEARCH name, or SEARCH prefix*
+        char query[MAX_NAME_LEN];
+        size_t length = strlen(tokens[1]);
+        
+        if (!fitsName(tokens[1])) {
+            fprintf(out, "ERROR SEARCH: malformed arguments\n");
+            return 0;
+        }
+        
+        int prefix = tokens[1][length - 1] == '*';
+        strcpy(query, tokens[1]);
+        if (prefix) query[length - 1] = '\0';
+        encrypt(query);
+        
+        uint64_t started = operationStart(store->metrics);
+        lockStore(store, 0);
+        size_t matched = searchAppointments(store, query, prefix, printBatchMatch, &printer);
+        unlockStore(store);
+        recordOperation(store->metrics, METRIC_SEARCH, started, RESULT_OK);
+        fprintf(out, "OK SEARCH %zu\n", matched);
+        return 1;
+    }
+    
+    if ((strcmp(command, "SLOTS") == 0 || strcmp(command, "GAPS") == 0) && (count == 4 || count == 5)) {
+        // SLOTS DD MM YYYY [doctor|ANY] [FOR minutes], the times an appointment that long can start
+        // GAPS DD MM YYYY [doctor|ANY], the stretches of free time
+        int gaps = command[0] == 'G';
+        
+        if (!parseInt(tokens[1], &date.day) || !parseInt(tokens[2], &date.month) || !parseInt(tokens[3], &date.year)) {
+            fprintf(out, "ERROR %s: malformed arguments\n", command);
+            return 0;
+        }
+        
+        if (count == 5 && !parseDoctor(store, tokens[4], 1, &doctor)) {
+            fprintf(out, "ERROR %s: %s\n", command, resultMessage(RESULT_UNKNOWN_DOCTOR));
+            return 0;
+        }
+        
+        uint64_t started = operationStart(store->metrics);
+        lockStore(store, 0);
+        SlotMask freeSlots = gaps ? ALL_SLOTS_MASK & ~bookedSlots(store, date, doctor)
+                                  : freeStarts(store, date, doctor, duration);
+        unlockStore(store);
+        recordOperation(store->metrics, METRIC_SLOTS, started, RESULT_OK);
+        
+        fprintf(out, "OK %s %02d/%02d/%04d", command, date.day, date.month, date.year);
+        int slot, slots;
+        while (gaps && nextFreeGap(&freeSlots, &slot, &slots)) {
+            int start = slot * SLOT_MINUTES, end = (slot + slots) * SLOT_MINUTES;
+            fprintf(out, " %02d:%02d-%02d:%02d", START_HOUR + start / 60, start % 60,
+                    START_HOUR + end / 60, end % 60);
+        }
+        while (!gaps && freeSlots != 0) {
+            int minutes = __builtin_ctzll(freeSlots) * SLOT_MINUTES;
+            fprintf(out, " %02d:%02d", START_HOUR + minutes / 60, minutes % 60);
+            freeSlots &= freeSlots - 1;
+        }
+        fprintf(out, "\n");
+        return 1;
+    }
+    
+    if (strcmp(command, "NEXT") == 0 && count >= 4 && count <= 7) {
+        // NEXT DD MM YYYY [HH MM] [doctor|ANY] [FOR minutes], the earliest free slot from then on
+        int hour = START_HOUR, minute = 0;
+        Date next;
+        
+        if (!parseInt(tokens[1], &date.day) || !parseInt(tokens[2], &date.month) || !parseInt(tokens[3], &date.year) ||
+            (count >= 6 && (!parseInt(tokens[4], &hour) || !parseInt(tokens[5], &minute)))) {
+            fprintf(out, "ERROR NEXT: malformed arguments\n");
+            return 0;
+        }
+        
+        if ((count == 5 || count == 7) && !parseDoctor(store, tokens[count - 1], 1, &doctor)) {
+            fprintf(out, "ERROR NEXT: %s\n", resultMessage(RESULT_UNKNOWN_DOCTOR));
+            return 0;
+        }
+        
+        const char* problem = calendarProblem(date);
+        if (problem != NULL) {
+            fprintf(out, "ERROR NEXT: %s\n", problem);
+            return 0;
+        }
+        
+        uint64_t started = operationStart(store->metrics);
+        lockStore(store, 0);
+        int found = findNextFreeSlot(store, date, hour, minute, doctor, duration, &next, &hour, &minute);
+        
+        // Name the doctor who is free then when any would do
+        if (found && doctor == DOCTOR_ANY) {
+            doctor = firstFreeDoctor(store, next, slotIndex(hour, minute), duration);
+        }
+        unlockStore(store);
+        recordOperation(store->metrics, METRIC_SLOTS, started, !found);
+        
+        if (!found) {
+            fprintf(out, "ERROR NEXT: %s\n", doctor != 0 ? resultMessage(RESULT_UNKNOWN_DOCTOR)
+                                                          : "no free slot within the calendar");
+            return 0;
+        }
+        
+        fprintf(out, "OK NEXT %02d/%02d/%04d %02d:%02d", next.day, next.month, next.year, hour, minute);
+        endWithDoctor(store, doctor, out);
+        return 1;
+    }
+    
+    if (strcmp(command, "FREE") == 0 && count == 6) {
+        // FREE DD MM YYYY HH MM [FOR minutes], the doctors free throughout that time
+        int slot;
+        
+        if (!parseDateTime(&tokens[1], &date, &hour, &minute) || (slot = bookableSlot(store, hour, minute, duration)) < 0) {
+            fprintf(out, "ERROR FREE: malformed arguments\n");
+            return 0;
+        }
+        
+        const char* problem = calendarProblem(date);
+        if (problem != NULL) {
+            fprintf(out, "ERROR FREE: %s\n", problem);
+            return 0;
+        }
+        
+        fprintf(out, "OK FREE %02d/%02d/%04d %02d:%02d", date.day, date.month, date.year, hour, minute);
+        
+        uint64_t started = operationStart(store->metrics);
+        lockStore(store, 0);
+        SlotMask run = slotRun(slot, duration);
+        for (size_t i = 1; i <= store->doctors.count; i++) {
+            if (!(bookedSlots(store, date, (int)i) & run)) {
+                fprintf(out, " %s", store->doctors.items[i - 1].name);
+            }
+        }
+        unlockStore(store);
+        recordOperation(store->metrics, METRIC_SLOTS, started, RESULT_OK);
+        
+        fprintf(out, "\n");
+        return 1;
+    }
+    
+    if (strcmp(command, "ADDDOCTOR") == 0 && count == 2) {
+        // ADDDOCTOR name
+        if (!fitsName(tokens[1]) || strcmp(tokens[1], "ANY") == 0 || strcmp(tokens[1], "any") == 0) {
+            fprintf(out, "ERROR ADDDOCTOR: malformed arguments\n");
+            return 0;
+        }
+        
+        int number = registerDoctor(store, tokens[1]);
+        if (number == 0) {
+            fprintf(out, "ERROR ADDDOCTOR: A doctor with that name already exists\n");
+            return 0;
+        }
+        
+        fprintf(out, "OK ADDDOCTOR %d %s\n", number, tokens[1]);
+        return 1;
+    }
+    
+    if (strcmp(command, "METRICS") == 0 && count == 1) {
+        // Operation metrics in the Prometheus text format
+        if (store->metrics == NULL) {
+            fprintf(out, "ERROR METRICS: metrics are off; start with --metrics file\n");
+            return 0;
+        }
+        
+        writeMetrics(store, users, out);
+        fprintf(out, "OK METRICS\n");
+        return 1;
+    }
+    
+    if (strcmp(command, "CLOCK") == 0 && count == 6) {
+        // CLOCK DD MM YYYY HH MM, moves the reminder clock forward to then and
+        // sends what falls due on the way; real time no longer moves it
+        if (store->reminders == NULL) {
+            fprintf(out, "ERROR CLOCK: reminders are off; start with --reminders file\n");
+            return 0;
+        }
+        if (!parseDateTime(&tokens[1], &date, &hour, &minute) || hour < 0 || hour > 23 || minute < 0 || minute > 59) {
+            fprintf(out, "ERROR CLOCK: malformed arguments\n");
+            return 0;
+        }
+        const char* problem = dateProblem(date);
+        if (problem != NULL) {
+            fprintf(out, "ERROR CLOCK: %s\n", problem);
+            return 0;
+        }
+        
+        ReminderWheel* wheel = store->reminders;
+        int64_t until = (int64_t)dayNumber(date) * 1440 + hour * 60 + minute;
+        ReplyBuffer reply = {NULL, 0, 0};
+        
+        // The client is written to only after the store is unlocked
+        lockStore(store, 1);
+        if (until < wheel->now) {
+            unlockStore(store);
+            fprintf(out, "ERROR CLOCK: the clock only moves forward\n");
+            return 0;
+        }
+        
+        uint64_t sent = wheel->delivered;
+        wheel->simulated = 1;
+        wheel->deliver = echoReminder;
+        wheel->context = &reply;
+        advanceReminders(store, until);
+        wheel->deliver = logReminder;
+        wheel->context = wheel->log;
+        sent = wheel->delivered - sent;
+        size_t waiting = wheel->count;
+        unlockStore(store);
+        
+        if (reply.length > 0) fwrite(reply.text, 1, reply.length, out);
+        free(reply.text);
+        
+        fprintf(out, "OK CLOCK %02d/%02d/%04d %02d:%02d %llu sent, %zu waiting\n", date.day, date.month, date.year,
+                hour, minute, (unsigned long long)sent, waiting);
+        return 1;
+    }
+    
+    if (strcmp(command, "REPORT") == 0 && (count == 1 || count == 2)) {
+        // REPORT [days], the busiest days, every month and every illness
+        int limit = REPORT_TOP_DAYS;
+        if (count == 2 && (!parseInt(tokens[1], &limit) || limit < 1 || limit > REPORT_MAX_DAYS)) {
+            fprintf(out, "ERROR REPORT: malformed arguments\n");
+            return 0;
+        }
+        
+        Reports* reports = &store->reports;
+        int32_t days[REPORT_MAX_DAYS];
+        
+        lockStore(store, 0);
+        fprintf(out, "TOTAL %llu %llu\n", (unsigned long long)reports->appointments,
+                (unsigned long long)reports->slots);
+        
+        size_t found = busiestDays(reports, (size_t)limit, days);
+        for (size_t i = 0; i < found; i++) {
+            Date date = dateFromDayNumber(days[i]);
+            const DayReport* day = dayReport(reports, days[i]);
+            fprintf(out, "DAY %02d/%02d/%04d %u %u\n", date.day, date.month, date.year, day->appointments,
+                    day->slots);
+        }
+        
+        for (size_t month = 0; month < reports->monthCount; month++) {
+            if (reports->months[month].appointments == 0) continue;
+            int number = reports->firstMonth + (int)month;
+            fprintf(out, "MONTH %02d/%04d %u %u\n", number % 12 + 1, number / 12,
+                    reports->months[month].appointments, reports->months[month].slots);
+        }
+        
+        size_t listed;
+        IllnessCount* counts = sortedIllnessCounts(reports, &listed);
+        for (size_t i = 0; i < listed; i++) {
+            char decrypted[MAX_NAME_LEN];
+            strcpy(decrypted, counts[i].illness);
+            decrypt(decrypted);
+            fprintf(out, "ILLNESS %s %llu\n", decrypted, (unsigned long long)counts[i].appointments);
+        }
+        unlockStore(store);
+        
+        free(counts);
+        fprintf(out, "OK REPORT\n");
+        return 1;
+    }
+    
+    if (strcmp(command, "STATS") == 0 && count == 1) {
+        // Storage counters as name value pairs, one per line
+        StorageStats stats = readStorageStats(store);
+        
+        lockUsers(store);
+        StorageStats userStats = users->stats;
+        unlockUsers(store);
+        
+        fprintf(out, "STAT changes %llu\n", (unsigned long long)stats.changes);
+        fprintf(out, "STAT commits %llu\n", (unsigned long long)stats.commits);
+        fprintf(out, "STAT journalRecords %llu\n", (unsigned long long)stats.logRecords);
+        fprintf(out, "STAT journalBytes %llu\n", (unsigned long long)stats.logBytes);
+        fprintf(out, "STAT journalSyncs %llu\n", (unsigned long long)stats.logSyncs);
+        fprintf(out, "STAT snapshots %llu\n", (unsigned long long)stats.snapshots);
+        fprintf(out, "STAT snapshotBytes %llu\n", (unsigned long long)stats.snapshotBytes);
+        fprintf(out, "STAT snapshotSyncs %llu\n", (unsigned long long)stats.snapshotSyncs);
+        fprintf(out, "STAT archived %llu\n", (unsigned long long)stats.archived);
+        fprintf(out, "STAT archiveBytes %llu\n", (unsigned long long)stats.archiveBytes);
+        fprintf(out, "STAT archiveSyncs %llu\n", (unsigned long long)stats.archiveSyncs);
+        fprintf(out, "STAT userSnapshots %llu\n", (unsigned long long)userStats.snapshots);
+        fprintf(out, "STAT userSnapshotBytes %llu\n", (unsigned long long)userStats.snapshotBytes);
+        fprintf(out, "STAT writeAmplification %.2f\n", writeAmplification(&stats));
+        fprintf(out, "STAT sharedCaughtUp %llu\n", (unsigned long long)stats.caughtUp);
+        fprintf(out, "STAT sharedReloads %llu\n", (unsigned long long)stats.reloads);
+        fprintf(out, "OK STATS\n");
+        return 1;
+    }
+    
+    if (strcmp(command, "DOCTORS") == 0 && count == 1) {
+        lockStore(store, 0);
+        size_t listed = store->doctors.count;
+        for (size_t i = 0; i < listed; i++) {
+            fprintf(out, "DOCTOR %zu %s\n", i + 1, store->doctors.items[i].name);
+        }
+        unlockStore(store);
+        
+        fprintf(out, "OK DOCTORS %zu\n", listed);
+        return 1;
+    }
+    
+    if ((strcmp(command, "RANGE") == 0 || strcmp(command, "HISTORY") == 0) && count == 7) {
+        // RANGE DD MM YYYY DD MM YYYY, both days included; HISTORY reads the archives instead
+        Date from, to;
+        
+        if (!parseInt(tokens[1], &from.day) || !parseInt(tokens[2], &from.month) || !parseInt(tokens[3], &from.year) ||
+            !parseInt(tokens[4], &to.day) || !parseInt(tokens[5], &to.month) || !parseInt(tokens[6], &to.year)) {
+            fprintf(out, "ERROR %s: malformed arguments\n", command);
+            return 0;
+        }
+        
+        const char* problem = rangeProblem(from, to);
+        if (problem != NULL) {
+            fprintf(out, "ERROR %s: %s\n", command, problem);
+            return 0;
+        }
+        
+        // Held for HISTORY too, since doctor names are printed
+        lockStore(store, 0);
+        size_t matched = command[0] == 'R' ? queryDateRange(store, from, to, printBatchMatch, &printer)
+                                           : queryArchive(from, to, printBatchMatch, &printer);
+        unlockStore(store);
+        
+        fprintf(out, "OK %s %zu\n", command, matched);
+        return 1;
+    }
+    
+    if (strcmp(command, "ADDUSER") == 0 && (count == 3 || count == 4)) {
+        // ADDUSER username password [ADMIN]
+        User user;
+        
+        if (!fitsName(tokens[1]) || strlen(tokens[2]) >= MAX_PASS_LEN) {
+            fprintf(out, "ERROR ADDUSER: malformed arguments\n");
+            return 0;
+        }
+        
+        memset(&user, 0, sizeof(user));
+        strcpy(user.username, tokens[1]);
+        strcpy(user.password, tokens[2]);
+        user.is_admin = count == 4 && (strcmp(tokens[3], "ADMIN") == 0 || strcmp(tokens[3], "admin") == 0);
+        
+        lockUsers(store);
+        int inserted = insertUser(users, &user);
+        if (inserted) users->dirty = 1;
+        unlockUsers(store);
+        
+        if (!inserted) {
+            fprintf(out, "ERROR ADDUSER: %s\n", resultMessage(RESULT_DUPLICATE));
+            return 0;
+        }
+        
+        fprintf(out, "OK ADDUSER %s\n", user.username);
+        return 1;
+    }
+    
+    fprintf(out, "ERROR %s: unknown command or wrong number of arguments\n", command);
+    return 0;
+}
+
+// Runs every command in a file ("-" for standard input) without prompts.
+// Changes are written once, when the batch ends.
+int runBatch(AppointmentStore* store, UserStore* users, const char* path) {
+    FILE* input = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    
+    if (input == NULL) {
+        printf("Could not open batch file %s.\n", path);
+        return 0;
+    }
+    
+    // Fully buffered output and no per-command journal writes, unless other
+    // --shared processes must see each change as it is made
+    setvbuf(stdout, NULL, _IOFBF, BATCH_OUTPUT_BUFFER);
+    store->journal.deferred = store->shared == NULL;
+    
+    char line[BATCH_LINE_LEN];
+    size_t lineNumber = 0, failed = 0;
+    
+    while (fgets(line, sizeof(line), input) != NULL) {
+        lineNumber++;
+        refreshSharedStore(store);
+        if (!executeCommand(store, users, line, stdout)) {
+            failed++;
+        }
+    }
+    
+    if (input != stdin) fclose(input);
+    
+    store->journal.deferred = 0;
+    compactJournal(store);
+    if (users->dirty) {
+        saveUsersToFile(users);
+        users->dirty = 0;
+    }
+    
+    printf("DONE %zu commands, %zu failed\n", lineNumber, failed);
+    fflush(stdout);
+    return failed == 0;
+}
+
+// Cuts the next field off a CSV line in place, undoing any quoting, and
+// moves the cursor past its delimiter; the cursor is NULL after the last
+static char* nextCsvField(char** cursor, char delimiter) {
+    char* field = *cursor;
+    char* in = field;
+    char* out = field;
+    int quoted = *in == '"';
+    
+    if (quoted) in++;
+    while (*in != '\0') {
+        if (quoted && *in == '"') {
+            // A doubled quote stands for one; a single one ends the quoting
+            if (in[1] == '"') {
+                *out++ = '"';
+                in += 2;
+            } else {
+                quoted = 0;
+                in++;
+            }
+            continue;
+        }
+        if (!quoted && *in == delimiter) break;
+        *out++ = *in++;
+    }
+    
+    *cursor = *in == delimiter ? in + 1 : NULL;
+    *out = '\0';
+    return field;
+}
+
+// Writes a field, quoted only if it holds the delimiter, a quote or a line break
+static void writeCsvField(FILE* out, const char* text, char delimiter) {
+    if (strchr(text, delimiter) == NULL && strpbrk(text, "\"\r\n") == NULL) {
+        fputs(text, out);
+        return;
+    }
+    
+    fputc('"', out);
+    for (const char* c = text; *c != '\0'; c++) {
+        if (*c == '"') fputc('"', out);
+        fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+// Tab-separated when the file name says so, comma-separated otherwise
+static char csvDelimiter(const char* path) {
+    size_t length = strlen(path);
+    return length >= 4 && strcmp(path + length - 4, ".tsv") == 0 ? '\t' : ',';
+}
+
+// Turns one row into an appointment node with the checks a booking gets,
+// or says what is wrong with it. Overlaps are left to the caller.
+static const char* parseCsvRow(AppointmentStore* store, char* line, char delimiter, Appointment* node) {
+    char* fields[CSV_FIELDS];
+    char* cursor = line;
+    int count = 0;
+    
+    while (cursor != NULL) {
+        if (count == CSV_FIELDS) return "too many fields";
+        fields[count++] = nextCsvField(&cursor, delimiter);
+    }
+    if (count < 4) return "expected name, illness, date, time and optionally length and doctor";
+    
+    Date date;
+    int hour, minute, used = 0;
+    int duration = APPOINTMENT_DURATION;
+    int doctor = 0;
+    
+    if (fields[0][0] == '\0' || fields[1][0] == '\0' || !fitsName(fields[0]) || !fitsName(fields[1])) {
+        return "name or illness missing or too long";
+    }
+    if (sscanf(fields[2], "%d/%d/%d%n", &date.day, &date.month, &date.year, &used) != 3 || fields[2][used] != '\0') {
+        return "dates are written DD/MM/YYYY";
+    }
+    used = 0;
+    if (sscanf(fields[3], "%d:%d%n", &hour, &minute, &used) != 2 || fields[3][used] != '\0') {
+        return "times are written HH:MM";
+    }
+    if (count > 4 && fields[4][0] != '\0' && !parseInt(fields[4], &duration)) {
+        return "the length is a number of minutes";
+    }
+    if (count > 5 && fields[5][0] != '\0' && (doctor = findDoctor(store, fields[5])) == 0) {
+        return resultMessage(RESULT_UNKNOWN_DOCTOR);
+    }
+    
+    const char* problem = dateProblem(date);
+    if (problem != NULL) return problem;
+    if (bookableSlot(store, hour, minute, duration) < 0) return resultMessage(RESULT_INVALID_SLOT);
+    
+    char text[MAX_NAME_LEN];
+    node->key = makeKey(date, hour, minute, doctor);
+    node->duration = (uint16_t)duration;
+    node->next = NULL;
+    
+    strcpy(text, fields[0]);
+    encrypt(text);
+    node->name = internString(&store->strings, text);
+    strcpy(text, fields[1]);
+    encrypt(text);
+    node->illness = internString(&store->strings, text);
+    return NULL;
+}
+
+// Records a rejected row for the report, which lists them in line order
+static void addImportProblem(ImportProblem** problems, size_t* count, size_t* capacity, size_t line,
+                             const char* problem) {
+    if (*count == *capacity) {
+        *capacity = *capacity > 0 ? *capacity * 2 : CSV_INITIAL_ROWS;
+        ImportProblem* grown = (ImportProblem*)realloc(*problems, *capacity * sizeof(ImportProblem));
+        if (grown == NULL) {
+            printf("Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        *problems = grown;
+    }
+    
+    (*problems)[*count].line = line;
+    (*problems)[*count].problem = problem;
+    (*count)++;
+}
+
+static int compareImportProblems(const void* a, const void* b) {
+    size_t x = ((const ImportProblem*)a)->line, y = ((const ImportProblem*)b)->line;
+    return (x > y) - (x < y);
+}
+
+// Key order, then file order among rows for the same slot
+static int compareImportRows(const void* a, const void* b) {
+    const ImportRow* x = (const ImportRow*)a;
+    const ImportRow* y = (const ImportRow*)b;
+    int order = compareAppointments(&x->node, &y->node);
+    
+    return order != 0 ? order : (x->line > y->line) - (x->line < y->line);
+}
+
+// Reads rows of name, illness, DD/MM/YYYY, HH:MM and optionally a length in
+// minutes and a doctor, comma- or tab-separated as the first line shows, as
+// --export writes them. Valid rows are collected, sorted once and linked
+// in, in one pass when the store is empty; a row that overlaps the
+// calendar or an earlier row is turned away like a booking would be.
+// Problems go to report, if given, in line order. Returns the number added;
+// saving them is up to the caller.
+size_t importAppointments(AppointmentStore* store, FILE* input, FILE* report, size_t* rejected) {
+    ImportRow* rows = NULL;
+    ImportProblem* problems = NULL;
+    size_t count = 0, capacity = 0, lineNumber = 0;
+    size_t problemCount = 0, problemCapacity = 0;
+    char line[CSV_LINE_LEN];
+    char delimiter = 0;
+    
+    *rejected = 0;
+    
+    while (fgets(line, sizeof(line), input) != NULL) {
+        const char* problem = NULL;
+        size_t length = strlen(line);
+        lineNumber++;
+        
+        if (length > 0 && line[length - 1] == '\n') {
+            line[--length] = '\0';
+        } else if (!feof(input)) {
+            int c;
+            while ((c = fgetc(input)) != EOF && c != '\n') {}
+            problem = "line too long";
+        }
+        if (length > 0 && line[length - 1] == '\r') line[--length] = '\0';
+        if (problem == NULL && length == 0) continue;
+        
+        // The first line picks the delimiter and may name the columns
+        if (delimiter == 0) {
+            delimiter = strchr(line, '\t') != NULL ? '\t' : ',';
+            if (problem == NULL && (strncmp(line, "name", 4) == 0 || strncmp(line, "Name", 4) == 0) &&
+                line[4] == delimiter) {
+                continue;
+            }
+        }
+        
+        if (problem == NULL) {
+            if (count == capacity) {
+                capacity = capacity > 0 ? capacity * 2 : CSV_INITIAL_ROWS;
+                ImportRow* grown = (ImportRow*)realloc(rows, capacity * sizeof(ImportRow));
+                if (grown == NULL) {
+                    printf("Memory allocation failed.\n");
+                    exit(EXIT_FAILURE);
+                }
+                rows = grown;
+            }
+            problem = parseCsvRow(store, line, delimiter, &rows[count].node);
+        }
+        
+        if (problem != NULL) {
+            if (report != NULL) addImportProblem(&problems, &problemCount, &problemCapacity, lineNumber, problem);
+            (*rejected)++;
+            continue;
+        }
+        rows[count++].line = lineNumber;
+    }
+    
+    qsort(rows, count, sizeof(ImportRow), compareImportRows);
+    
+    // Rows taken so far have day bitmaps of their own, checked along with
+    // the calendar's, so each row costs two lookups
+    DaySlotIndex taken = {0};
+    size_t kept = 0;
+    
+    for (size_t i = 0; i < count; i++) {
+        const Appointment* node = &rows[i].node;
+        int doctor = keyDoctor(node->key);
+        int hour, minute;
+        keyTime(node->key, &hour, &minute);
+        
+        SlotMask run = slotRun(slotIndex(hour, minute), node->duration);
+        SlotMask* imported = findDoctorSlots(&taken, (uint32_t)(node->key >> 32), doctor, 1);
+        
+        if (((bookedSlots(store, keyDate(node->key), doctor) | *imported) & run) != 0) {
+            if (report != NULL) {
+                addImportProblem(&problems, &problemCount, &problemCapacity, rows[i].line,
+                                 resultMessage(RESULT_SLOT_TAKEN));
+            }
+            (*rejected)++;
+            continue;
+        }
+        
+        *imported |= run;
+        rows[kept++] = rows[i];
+    }
+    freeDaySlotIndex(&taken);
+    
+    // Overlaps were found in key order, after the rows that did not parse
+    qsort(problems, problemCount, sizeof(ImportProblem), compareImportProblems);
+    for (size_t i = 0; i < problemCount; i++) {
+        fprintf(report, "ERROR line %zu: %s\n", problems[i].line, problems[i].problem);
+    }
+    free(problems);
+    
+    store->appointmentPool.objectSize = sizeof(Appointment);
+    Appointment* nodes = (Appointment*)poolAllocBlock(&store->appointmentPool, kept);
+    for (size_t i = 0; i < kept; i++) {
+        nodes[i] = rows[i].node;
+    }
+    free(rows);
+    
+    // The rows are sorted already, so either way nothing is searched for
+    if (store->count == 0) {
+        storeBulkLoad(store, nodes, kept);
+    } else {
+        storeMerge(store, nodes, kept);
+    }
+    
+    return kept;
+}
+
+// Writes one appointment as a row, decrypting into buffers of its own
+static void writeCsvRow(const Appointment* appointment, void* context) {
+    const CsvWriter* writer = (const CsvWriter*)context;
+    char text[MAX_NAME_LEN];
+    int hour, minute;
+    
+    Date date = keyDate(appointment->key);
+    keyTime(appointment->key, &hour, &minute);
+    int doctor = keyDoctor(appointment->key);
+    
+    strcpy(text, appointment->name);
+    decrypt(text);
+    writeCsvField(writer->out, text, writer->delimiter);
+    fputc(writer->delimiter, writer->out);
+    
+    strcpy(text, appointment->illness);
+    decrypt(text);
+    writeCsvField(writer->out, text, writer->delimiter);
+    
+    fprintf(writer->out, "%c%02d/%02d/%04d%c%02d:%02d%c%d%c", writer->delimiter, date.day, date.month, date.year,
+            writer->delimiter, hour, minute, writer->delimiter, appointment->duration, writer->delimiter);
+    if (doctor != 0) writeCsvField(writer->out, doctorName(writer->store, doctor), writer->delimiter);
+    fputc('\n', writer->out);
+}
+
+// The latest day anything is booked on, series included, so a walk up to
+// it reaches the end of the list whatever the year
+static Date lastBookedDate(AppointmentStore* store) {
+    Appointment* tail = skipSearch(store, UINT64_MAX, 0, NULL);
+    int32_t last = tail != NULL ? dayNumber(keyDate(tail->key)) : 0;
+    
+    for (size_t i = 0; i < store->series.count; i++) {
+        const Series* series = &store->series.items[i];
+        int32_t end = series->firstDay + (series->occurrences - 1) * series->interval;
+        if (end > last) last = end;
+    }
+    
+    return dateFromDayNumber(last);
+}
+
+// Writes a header line and then every appointment, series occurrences
+// included, in date and time order straight off the list. Returns the
+// number of rows.
+size_t exportAppointments(AppointmentStore* store, FILE* output, char delimiter) {
+    CsvWriter writer = {output, store, delimiter};
+    Date first = {1, 1, 1};
+    Date last = lastBookedDate(store);
+    
+    fprintf(output, "name%cillness%cdate%ctime%clength%cdoctor\n", delimiter, delimiter, delimiter, delimiter,
+            delimiter);
+    return queryDateRange(store, first, last, writeCsvRow, &writer);
+}
+
+// Adds the rows of a CSV file (or standard input with "-") to the saved
+// appointments, then writes one snapshot holding them all
+int runImport(AppointmentStore* store, const char* path) {
+    FILE* input = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    
+    if (input == NULL) {
+        printf("Could not open %s.\n", path);
+        return 0;
+    }
+    setvbuf(input, NULL, _IOFBF, CSV_BUFFER);
+    
+    size_t rejected;
+    size_t imported = importAppointments(store, input, stdout, &rejected);
+    int readOk = !ferror(input);
+    if (input != stdin) fclose(input);
+    
+    if (!readOk) {
+        printf("Error reading %s.\n", path);
+    }
+    
+    // The snapshot is written once rather than a log record per row
+    int saved = imported == 0 || saveSnapshot(store);
+    
+    printf("DONE %zu imported, %zu rejected\n", imported, rejected);
+    return readOk && saved && rejected == 0;
+}
+
+// Writes every appointment to a CSV file, or standard output with "-";
+// a name ending in .tsv gets tab-separated rows
+int runExport(AppointmentStore* store, const char* path) {
+    int toStdout = strcmp(path, "-") == 0;
+    FILE* output = toStdout ? stdout : fopen(path, "w");
+    
+    if (output == NULL) {
+        printf("Could not open %s.\n", path);
+        return 0;
+    }
+    setvbuf(output, NULL, _IOFBF, CSV_BUFFER);
+    
+    size_t rows = exportAppointments(store, output, csvDelimiter(path));
+    int ok = fflush(output) == 0 && !ferror(output);
+    if (!toStdout && fclose(output) != 0) ok = 0;
+    
+    // Messages stay out of the rows when those go to standard output
+    FILE* messages = toStdout ? stderr : stdout;
+    if (!ok) {
+        fprintf(messages, "Error writing %s.\n", path);
+        return 0;
+    }
+    
+    fprintf(messages, "DONE %zu exported\n", rows);
+    return 1;
+}
+
+// Says how two stores loaded from the same files differ, or NULL if they
+// hold the same appointments in the same order with the same indexes
+static const char* storeDifference(AppointmentStore* a, AppointmentStore* b) {
+    if (a->count != b->count) return "they hold different numbers of appointments";
+    if (a->strings.count != b->strings.count) return "they intern different strings";
+    
+    for (Appointment *x = a->head, *y = b->head; x != NULL; x = x->next, y = y->next) {
+        if (y == NULL || compareLoadedNodes(x, y) != 0) return "the appointment lists differ";
+        
+        Date date = keyDate(x->key);
+        int doctor = keyDoctor(x->key);
+        if (bookedSlots(a, date, doctor) != bookedSlots(b, date, doctor)) return "the day slots differ";
+    }
+    
+    if (a->level != b->level) return "the skip lists have different heights";
+    for (int level = 0; level < a->level; level++) {
+        const SkipIndex *x = a->levels[level].right, *y = b->levels[level].right;
+        for (; x != NULL && y != NULL; x = x->right, y = y->right) {
+            if (x->key != y->key) break;
+        }
+        if (x != NULL || y != NULL) return "the skip lists differ";
+    }
+    
+    if (a->names.count != b->names.count) return "the name indexes hold different names";
+    for (size_t i = 0; i < a->names.count; i++) {
+        const NameEntry *x = a->names.sorted[i], *y = b->names.sorted[i];
+        if (strcmp(x->name, y->name) != 0 || x->count != y->count) return "the name indexes differ";
+        for (size_t j = 0; j < x->count; j++) {
+            if (compareLoadedNodes(x->items[j], y->items[j]) != 0) return "the name indexes differ";
+        }
+        if (findNameEntry(&b->names, x->name, 0) != y) return "a name cannot be looked up";
+    }
+    
+    return NULL;
+}
+
+// Loads the files again on one thread and on several and checks that both
+// give the same store, for --verify-load. The store given was loaded
+// already, so the journal is folded in and both start from the same files.
+int verifyParallelLoad(AppointmentStore* store) {
+    AppointmentStore serial = {0}, parallel = {0};
+    int threads = loadThreadCount(store, LOAD_PARALLEL_MIN);
+    
+    serial.granularity = parallel.granularity = store->granularity;
+    serial.loadThreads = 1;
+    parallel.loadThreads = threads > 1 ? threads : LOAD_VERIFY_THREADS;
+    
+    uint64_t started = clockNs();
+    loadAppointmentsFromFile(&serial);
+    uint64_t middle = clockNs();
+    loadAppointmentsFromFile(&parallel);
+    uint64_t finished = clockNs();
+    
+    const char* difference = storeDifference(&serial, &parallel);
+    printf("Loaded %zu appointments in %.3f s on 1 thread and in %.3f s on %d threads: %s.\n",
+           serial.count, (middle - started) / 1e9, (finished - middle) / 1e9, parallel.loadThreads,
+           difference != NULL ? difference : "identical");
+    
+    closeJournal(&serial.journal);
+    closeJournal(&parallel.journal);
+    freeAppointmentStore(&serial);
+    freeAppointmentStore(&parallel);
+    return difference == NULL;
+}
+
+#ifndef _WIN32
+// Hands the next queued connection to a worker, or returns -1 when stopping
+static int takeConnection(Server* server, int worker) {
+    pthread_mutex_lock(&server->lock);
+    
+    while (server->queueCount == 0 && !server->closed) {
+        pthread_cond_wait(&server->notEmpty, &server->lock);
+    }
+    
+    int fd = -1;
+    if (!server->closed) {
+        fd = server->queue[server->queueHead];
+        server->queueHead = (server->queueHead + 1) % SERVER_BACKLOG;
+        server->queueCount--;
+        server->active[worker] = fd;
+        pthread_cond_signal(&server->notFull);
+    }
+    
+    pthread_mutex_unlock(&server->lock);
+    return fd;
+}
+
+static void finishConnection(Server* server, int worker) {
+    pthread_mutex_lock(&server->lock);
+    server->active[worker] = -1;
+    pthread_mutex_unlock(&server->lock);
+}
+
+// Queues an accepted connection; returns 0 (closing it) if the server is stopping
+static int queueConnection(Server* server, int fd) {
+    pthread_mutex_lock(&server->lock);
+    
+    while (server->queueCount == SERVER_BACKLOG && !server->closed) {
+        pthread_cond_wait(&server->notFull, &server->lock);
+    }
+    
+    int queued = !server->closed;
+    if (queued) {
+        server->queue[(server->queueHead + server->queueCount) % SERVER_BACKLOG] = fd;
+        server->queueCount++;
+        pthread_cond_signal(&server->notEmpty);
+    }
+    
+    pthread_mutex_unlock(&server->lock);
+    if (!queued) close(fd);
+    return queued;
+}
+
+// Drops waiting connections and ends the ones being served; workers see
+// end of input and return for the next connection, which never comes
+static void stopServer(Server* server) {
+    pthread_mutex_lock(&server->lock);
+    
+    server->closed = 1;
+    for (; server->queueCount > 0; server->queueCount--) {
+        close(server->queue[server->queueHead]);
+        server->queueHead = (server->queueHead + 1) % SERVER_BACKLOG;
+    }
+    for (int i = 0; i < SERVER_THREADS; i++) {
+        if (server->active[i] >= 0) shutdown(server->active[i], SHUT_RDWR);
+    }
+    
+    pthread_cond_broadcast(&server->notEmpty);
+    pthread_cond_broadcast(&server->notFull);
+    pthread_mutex_unlock(&server->lock);
+}
+
+// Runs the batch command protocol on one connection at a time: each line
+// is a command, answered with the lines executeCommand writes for it
+static void* serveConnections(void* argument) {
+    ServerWorker* worker = (ServerWorker*)argument;
+    Server* server = worker->server;
+    char line[BATCH_LINE_LEN];
+    int fd;
+    
+    while ((fd = takeConnection(server, worker->id)) >= 0) {
+        int outFd = dup(fd);
+        FILE* in = fdopen(fd, "r");
+        FILE* out = outFd >= 0 ? fdopen(outFd, "w") : NULL;
+        
+        while (in != NULL && out != NULL && fgets(line, sizeof(line), in) != NULL) {
+            executeCommand(server->store, server->users, line, out);
+            
+            // New users are saved straight away; USER_FILE is small
+            lockUsers(server->store);
+            if (server->users->dirty) {
+                saveUsersToFile(server->users);
+                server->users->dirty = 0;
+            }
+            unlockUsers(server->store);
+            
+            if (fflush(out) != 0) break; // Client went away
+        }
+        
+        finishConnection(server, worker->id);
+        
+        if (in != NULL) fclose(in); else close(fd);
+        if (out != NULL) fclose(out); else if (outFd >= 0) close(outFd);
+    }
+    
+    return NULL;
+}
+
+static void* acceptConnections(void* argument) {
+    Server* server = (Server*)argument;
+    
+    while (1) {
+        int fd = accept(server->listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        if (!queueConnection(server, fd)) break;
     }
     
-    newUser->is_admin = 0; // Default to regular user
-    newUser->next = NULL;
+    return NULL;
+}
+
+static int connectToServer(const char* path) {
+    struct sockaddr_un address;
     
-    return newUser;
+    if (strlen(path) >= sizeof(address.sun_path)) return -1;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
 }
+#endif
 
-void addUser(User** head) {
-    User* newUser = createUser();
+// Serves the batch command protocol on a Unix domain socket to many clients
+// at once until SIGINT or SIGTERM. Every change is journalled as it happens.
+int runServer(AppointmentStore* store, UserStore* users, const char* path) {
+#ifndef _WIN32
+    struct sockaddr_un address;
+    
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        printf("Socket path is too long: %s\n", path);
+        return 0;
+    }
     
-    if (newUser == NULL) return;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    unlink(path); // Left behind by a server that did not stop cleanly
     
-    // Check if username already exists
-    User* current = *head;
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listener, SERVER_BACKLOG) != 0) {
+        printf("Could not listen on %s.\n", path);
+        if (listener >= 0) close(listener);
+        return 0;
+    }
     
-    while (current != NULL) {
-        if (strcmp(current->username, newUser->username) == 0) {
-            printf("Username already exists. Please choose a different username.\n");
-            free(newUser);
-            return;
+    store->locks = createStoreLocks();
+    
+    // The signals that stop the server, SIGUSR1 for the metrics file and
+    // SIGALRM for reminders are collected by sigwait below, so block them
+    // before starting threads that would otherwise inherit them
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    if (store->metrics != NULL) sigaddset(&stopSignals, SIGUSR1);
+    if (store->reminders != NULL) sigaddset(&stopSignals, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+    signal(SIGPIPE, SIG_IGN); // A client hanging up must not end the server
+    
+    Server server;
+    ServerWorker workers[SERVER_THREADS];
+    pthread_t acceptor;
+    
+    memset(&server, 0, sizeof(server));
+    server.store = store;
+    server.users = users;
+    server.listener = listener;
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.notEmpty, NULL);
+    pthread_cond_init(&server.notFull, NULL);
+    
+    for (int i = 0; i < SERVER_THREADS; i++) {
+        server.active[i] = -1;
+        workers[i].server = &server;
+        workers[i].id = i;
+        pthread_create(&workers[i].thread, NULL, serveConnections, &workers[i]);
+    }
+    pthread_create(&acceptor, NULL, acceptConnections, &server);
+    
+    printf("Serving on %s with %d threads. Send SIGINT or SIGTERM to stop.\n", path, SERVER_THREADS);
+    fflush(stdout);
+    
+    struct itimerval tick;
+    memset(&tick, 0, sizeof(tick));
+    if (store->reminders != NULL) {
+        tick.it_interval.tv_sec = REMINDER_TICK_SECONDS;
+        tick.it_value.tv_sec = REMINDER_TICK_SECONDS;
+        setitimer(ITIMER_REAL, &tick, NULL);
+    }
+    
+    int received;
+    while (sigwait(&stopSignals, &received) == 0 && (received == SIGUSR1 || received == SIGALRM)) {
+        if (received == SIGALRM) {
+            runDueReminders(store);
+        } else {
+            writeMetricsFile(store, users);
         }
-        current = current->next;
     }
     
-    // Add to the beginning of the list
-    newUser->next = *head;
-    *head = newUser;
+    if (store->reminders != NULL) {
+        memset(&tick, 0, sizeof(tick));
+        setitimer(ITIMER_REAL, &tick, NULL);
+    }
+    
+    stopServer(&server);
     
-    printf("User account created successfully.\n");
+    // Wake the acceptor with a connection it will turn away
+    int wake = connectToServer(path);
+    pthread_join(acceptor, NULL);
+    if (wake >= 0) close(wake);
+    
+    for (int i = 0; i < SERVER_THREADS; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    
+    close(listener);
+    unlink(path);
+    pthread_mutex_destroy(&server.lock);
+    pthread_cond_destroy(&server.notEmpty);
+    pthread_cond_destroy(&server.notFull);
+    
+    destroyStoreLocks(store->locks);
+    store->locks = NULL;
+    
+    printf("Server stopped.\n");
+    return 1;
+#else
+    (void)store; (void)users; (void)path;
+    printf("Server mode needs Unix domain sockets and is not available on this platform.\n");
+    return 0;
+#endif
 }
 
-int authenticateUser(User* head, char* username, char* password, int* is_admin) {
-    User* current = head;
+#ifndef _WIN32
+// Sends BOOK requests for random slots over the load generator's days,
+// one at a time, and tallies the replies
+static void* runLoadClient(void* argument) {
+    LoadClient* client = (LoadClient*)argument;
+    char line[BATCH_LINE_LEN];
     
-    while (current != NULL) {
-        if (strcmp(current->username, username) == 0 && 
-            strcmp(current->password, password) == 0) {
-            *is_admin = current->is_admin;
-            return 1; // Authentication successful
-        }
+    int fd = connectToServer(client->path);
+    int outFd = fd >= 0 ? dup(fd) : -1;
+    FILE* in = fd >= 0 ? fdopen(fd, "r") : NULL;
+    FILE* out = outFd >= 0 ? fdopen(outFd, "w") : NULL;
+    
+    uint32_t seed = 2463534242u ^ ((uint32_t)client->id + 1) * 2654435761u;
+    int sent = 0;
+    
+    while (in != NULL && out != NULL && sent < client->requests) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
         
-        current = current->next;
+        size_t slot = seed % (LOADGEN_DAYS * STANDARD_SLOTS_PER_DAY);
+        const Date* date = &client->days[slot / STANDARD_SLOTS_PER_DAY];
+        int minutes = (int)(slot % STANDARD_SLOTS_PER_DAY) * APPOINTMENT_DURATION;
+        
+        fprintf(out, "BOOK load%d test %d %d %d %d %d\n", client->id,
+                date->day, date->month, date->year, START_HOUR + minutes / 60, minutes % 60);
+        if (fflush(out) != 0 || fgets(line, sizeof(line), in) == NULL) break;
+        sent++;
+        
+        if (strncmp(line, "OK ", 3) == 0) {
+            client->booked++;
+            __atomic_fetch_add(&client->slotWins[slot], 1, __ATOMIC_RELAXED);
+        } else if (strstr(line, resultMessage(RESULT_SLOT_TAKEN)) != NULL) {
+            client->rejected++;
+        } else {
+            client->failed++;
+        }
     }
     
-    return 0; // Authentication failed
+    client->failed += (size_t)(client->requests - sent);
+    
+    if (in != NULL) fclose(in); else if (fd >= 0) close(fd);
+    if (out != NULL) fclose(out); else if (outFd >= 0) close(outFd);
+    return NULL;
 }
+#endif
 
-void saveUsersToFile(User* head) {
-    FILE* file = fopen(USER_FILE, "wb");
+// Drives a running server with concurrent clients all competing for the
+// same slots, then checks that no slot was granted twice. The bookings
+// it made are cancelled afterwards so runs can be repeated.
+int runLoadGenerator(const char* path, int clients, int requests) {
+#ifndef _WIN32
+    if (clients < 1 || requests < 1) {
+        printf("Clients and requests must be positive.\n");
+        return 0;
+    }
     
-    if (file == NULL) {
-        printf("Error opening user file for writing.\n");
-        return;
+    signal(SIGPIPE, SIG_IGN);
+    
+    // Consecutive days starting tomorrow, so none is in the past
+    Date days[LOADGEN_DAYS];
+    time_t now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+    
+    for (int i = 0; i < LOADGEN_DAYS; i++) {
+        struct tm day = local;
+        day.tm_mday += i + 1;
+        day.tm_hour = 12; // Away from daylight saving changes at midnight
+        mktime(&day);
+        days[i].day = day.tm_mday;
+        days[i].month = day.tm_mon + 1;
+        days[i].year = day.tm_year + 1900;
+    }
+    
+    unsigned int* slotWins = (unsigned int*)calloc(LOADGEN_DAYS * STANDARD_SLOTS_PER_DAY, sizeof(unsigned int));
+    LoadClient* loaders = (LoadClient*)calloc((size_t)clients, sizeof(LoadClient));
+    if (slotWins == NULL || loaders == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
     }
     
-    User* current = head;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     
-    while (current != NULL) {
-        fwrite(current, sizeof(User), 1, file);
-        current = current->next;
+    for (int i = 0; i < clients; i++) {
+        loaders[i].path = path;
+        loaders[i].id = i;
+        loaders[i].requests = requests;
+        loaders[i].days = days;
+        loaders[i].slotWins = slotWins;
+        pthread_create(&loaders[i].thread, NULL, runLoadClient, &loaders[i]);
     }
     
-    fclose(file);
+    size_t booked = 0, rejected = 0, failed = 0;
+    for (int i = 0; i < clients; i++) {
+        pthread_join(loaders[i].thread, NULL);
+        booked += loaders[i].booked;
+        rejected += loaders[i].rejected;
+        failed += loaders[i].failed;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    size_t total = (size_t)clients * (size_t)requests;
+    
+    size_t doubled = 0;
+    for (int slot = 0; slot < LOADGEN_DAYS * STANDARD_SLOTS_PER_DAY; slot++) {
+        if (slotWins[slot] > 1) doubled++;
+    }
+    
+    printf("%d clients sent %zu requests in %.3f s (%.0f requests/s)\n",
+           clients, total, seconds, seconds > 0 ? (double)total / seconds : 0.0);
+    printf("Booked %zu, rejected %zu as taken, %zu failed\n", booked, rejected, failed);
+    printf("Slots booked more than once: %zu\n", doubled);
+    
+    // Put the server back the way it was
+    int fd = connectToServer(path);
+    FILE* in = fd >= 0 ? fdopen(fd, "r") : NULL;
+    FILE* out = fd >= 0 ? fdopen(dup(fd), "w") : NULL;
+    char line[BATCH_LINE_LEN];
+    
+    for (int slot = 0; in != NULL && out != NULL && slot < LOADGEN_DAYS * STANDARD_SLOTS_PER_DAY; slot++) {
+        if (slotWins[slot] == 0) continue;
+        
+        const Date* date = &days[slot / STANDARD_SLOTS_PER_DAY];
+        int minutes = (slot % STANDARD_SLOTS_PER_DAY) * APPOINTMENT_DURATION;
+        fprintf(out, "CANCEL %d %d %d %d %d\n",
+                date->day, date->month, date->year, START_HOUR + minutes / 60, minutes % 60);
+        if (fflush(out) != 0 || fgets(line, sizeof(line), in) == NULL) break;
+    }
+    
+    if (in != NULL) fclose(in); else if (fd >= 0) close(fd);
+    if (out != NULL) fclose(out);
+    
+    free(slotWins);
+    free(loaders);
+    return doubled == 0 && failed == 0;
+#else
+    (void)path; (void)clients; (void)requests;
+    printf("Load generation needs Unix domain sockets and is not available on this platform.\n");
+    return 0;
+#endif
+}
+
+#ifndef _WIN32
+static uint64_t benchNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static uint32_t benchRandom(uint32_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static int compareSamples(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void startSeries(BenchSeries* series, const char* name, size_t calls) {
+    series->name = name;
+    series->count = 0;
+    series->items = 0;
+    series->samples = (uint64_t*)malloc((calls > 0 ? calls : 1) * sizeof(uint64_t));
+    if (series->samples == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
 }
 
-void loadUsersFromFile(User** head) {
-    FILE* file = fopen(USER_FILE, "rb");
+// Writes one operation's throughput and latency percentiles as JSON
+static void printSeries(FILE* out, BenchSeries* series, int last) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < series->count; i++) total += series->samples[i];
     
-    if (file == NULL) {
-        // File doesn't exist yet, not an error
-        return;
+    qsort(series->samples, series->count, sizeof(uint64_t), compareSamples);
+    uint64_t p50 = series->count ? series->samples[(series->count - 1) * 50 / 100] : 0;
+    uint64_t p99 = series->count ? series->samples[(series->count - 1) * 99 / 100] : 0;
+    size_t items = series->items ? series->items : series->count;
+    double seconds = (double)total / 1e9;
+    
+    fprintf(out, "        {\"operation\": \"%s\", \"calls\": %zu, \"items\": %zu, \"seconds\": %.6f, "
+            "\"itemsPerSecond\": %.1f, \"p50Ns\": %llu, \"p99Ns\": %llu}%s\n",
+            series->name, series->count, items, seconds, seconds > 0 ? (double)items / seconds : 0.0,
+            (unsigned long long)p50, (unsigned long long)p99, last ? "" : ",");
+    
+    free(series->samples);
+    series->samples = NULL;
+}
+
+static void countMatch(const Appointment* appointment, void* context) {
+    (void)appointment;
+    (*(size_t*)context)++;
+}
+
+// Generates one data set and times each store operation against it
+static int benchmarkSize(const BenchConfig* config, size_t size, const double* patientWeights, FILE* out, int last) {
+    uint32_t seed = config->seed ^ (uint32_t)size;
+    int perDay = config->perDay;
+    size_t days = (size + (size_t)perDay - 1) / (size_t)perDay;
+    
+    // Bookings start tomorrow and must all fall within the booking horizon
+    int32_t tomorrow = dayNumber(currentDate()) + 1;
+    size_t bookable = (size_t)(horizonDay() - tomorrow + 1);
+    if (config->days > 0 || days > bookable) {
+        days = config->days > 0 ? (size_t)config->days : bookable;
+        perDay = (int)((size + days - 1) / days);
     }
     
-    // Free existing list
-    freeUserList(head);
+    // Every day gets perDay distinct slots, taken from every doctor's
+    // calendar when there are doctors; the last day may get fewer
+    int calendars = config->doctors > 0 ? config->doctors : 1;
+    int places = STANDARD_SLOTS_PER_DAY * calendars;
+    BookingRequest* bookings = (BookingRequest*)calloc(size, sizeof(BookingRequest));
+    int* slots = (int*)malloc((size_t)places * sizeof(int));
+    if (bookings == NULL || slots == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
     
-    User temp;
+    size_t made = 0;
     
-    while (fread(&temp, sizeof(User), 1, file) == 1) {
-        User* newUser = (User*)malloc(sizeof(User));
+    for (size_t day = 0; day < days && made < size; day++) {
+        Date date = dateFromDayNumber(tomorrow + (int32_t)day);
+        for (int i = 0; i < places; i++) slots[i] = i;
         
-        if (newUser == NULL) {
-            printf("Memory allocation failed while loading users.\n");
-            fclose(file);
-            return;
+        for (int i = 0; i < perDay && made < size; i++) {
+            int pick = i + (int)(benchRandom(&seed) % (uint32_t)(places - i));
+            int place = slots[pick];
+            slots[pick] = slots[i];
+            slots[i] = place;
+            int slot = place % STANDARD_SLOTS_PER_DAY;
+            
+            // Patients are drawn by inverting the cumulative Zipf weights
+            double target = (double)benchRandom(&seed) / 4294967296.0 * patientWeights[config->users - 1];
+            int low = 0, high = config->users - 1;
+            while (low < high) {
+                int middle = (low + high) / 2;
+                if (patientWeights[middle] < target) low = middle + 1; else high = middle;
+            }
+            
+            BookingRequest* booking = &bookings[made++];
+            snprintf(booking->name, MAX_NAME_LEN, "patient%d", low);
+            strcpy(booking->illness, "checkup");
+            encrypt(booking->name);
+            encrypt(booking->illness);
+            booking->date = date;
+            booking->hour = START_HOUR + slot * APPOINTMENT_DURATION / 60;
+            booking->minute = slot * APPOINTMENT_DURATION % 60;
+            booking->doctor = config->doctors > 0 ? place / STANDARD_SLOTS_PER_DAY + 1 : 0;
+        }
+    }
+    free(slots);
+    
+    // Book in random order, as real requests arrive
+    for (size_t i = made; i > 1; i--) {
+        size_t j = benchRandom(&seed) % i;
+        BookingRequest swap = bookings[i - 1];
+        bookings[i - 1] = bookings[j];
+        bookings[j] = swap;
+    }
+    
+    AppointmentStore store = {0};
+    BenchSeries series;
+    store.journal.deferred = !config->journal;
+    
+    // Instrumented as --metrics would, to show what that costs
+    if (config->metrics) {
+        store.metrics = (Metrics*)calloc(1, sizeof(Metrics));
+        if (store.metrics == NULL) {
+            printf("Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    char name[MAX_NAME_LEN];
+    for (int i = 0; i < config->doctors; i++) {
+        snprintf(name, MAX_NAME_LEN, "doctor%d", i + 1);
+        registerDoctor(&store, name);
+    }
+    
+    fprintf(out, "    {\"size\": %zu, \"days\": %zu, \"perDay\": %d, \"operations\": [\n", made, days, perDay);
+    
+    startSeries(&series, "addAppointment", made);
+    for (size_t i = 0; i < made; i++) {
+        uint64_t start = benchNow();
+        bookAppointment(&store, &bookings[i]);
+        series.samples[series.count++] = benchNow() - start;
+    }
+    printSeries(out, &series, 0);
+    
+    startSeries(&series, "isSlotAvailable", made);
+    for (size_t i = 0; i < made; i++) {
+        Date probe = bookings[benchRandom(&seed) % made].date;
+        int slot = (int)(benchRandom(&seed) % STANDARD_SLOTS_PER_DAY);
+        int hour = START_HOUR + slot * APPOINTMENT_DURATION / 60, minute = slot * APPOINTMENT_DURATION % 60;
+        int doctor = config->doctors > 0 ? (int)(benchRandom(&seed) % (uint32_t)config->doctors) + 1 : 0;
+        
+        uint64_t start = benchNow();
+        isSlotAvailable(&store, hour, minute, probe, doctor, APPOINTMENT_DURATION);
+        series.samples[series.count++] = benchNow() - start;
+    }
+    printSeries(out, &series, 0);
+    
+    // Which slots of a day have any doctor free, over every doctor at once
+    if (config->doctors > 0) {
+        volatile SlotMask anyFree; // keeps the result from being optimised away
+        startSeries(&series, "anyDoctorFree", made);
+        for (size_t i = 0; i < made; i++) {
+            Date probe = bookings[benchRandom(&seed) % made].date;
+            
+            uint64_t start = benchNow();
+            anyFree = ALL_SLOTS_MASK & ~bookedSlots(&store, probe, DOCTOR_ANY);
+            series.samples[series.count++] = benchNow() - start;
         }
+        (void)anyFree;
+        printSeries(out, &series, 0);
+    }
+    
+    size_t searches = made < BENCH_SEARCHES ? made : BENCH_SEARCHES;
+    size_t matched = 0;
+    startSeries(&series, "searchAppointmentByName", searches);
+    for (size_t i = 0; i < searches; i++) {
+        const char* name = bookings[benchRandom(&seed) % made].name;
         
-        *newUser = temp;
-        newUser->next = NULL;
+        uint64_t start = benchNow();
+        searchNameIndex(&store.names, name, 0, countMatch, &matched);
+        series.samples[series.count++] = benchNow() - start;
+    }
+    printSeries(out, &series, 0);
+    
+    // A week's schedule starting on a random booked day
+    size_t listed = 0;
+    startSeries(&series, "queryDateRange", searches);
+    for (size_t i = 0; i < searches; i++) {
+        Date from = bookings[benchRandom(&seed) % made].date;
+        Date to = dateFromDayNumber(dayNumber(from) + 6);
         
-        // Add to the beginning of the list
-        newUser->next = *head;
-        *head = newUser;
+        uint64_t start = benchNow();
+        listed += queryDateRange(&store, from, to, countMatch, &matched);
+        series.samples[series.count++] = benchNow() - start;
     }
+    series.items = listed;
+    printSeries(out, &series, 0);
     
-    fclose(file);
+    startSeries(&series, "findNextFreeSlot", searches);
+    for (size_t i = 0; i < searches; i++) {
+        Date from = bookings[benchRandom(&seed) % made].date, next;
+        int hour, minute;
+    
+        uint64_t start = benchNow();
+        findNextFreeSlot(&store, from, START_HOUR, 0, config->doctors > 0 ? DOCTOR_ANY : 0, APPOINTMENT_DURATION,
+                         &next, &hour, &minute);
+        series.samples[series.count++] = benchNow() - start;
+    }
+    printSeries(out, &series, 0);
+    
+    startSeries(&series, "saveAppointmentsToFile", BENCH_FILE_REPEATS);
+    for (int i = 0; i < BENCH_FILE_REPEATS; i++) {
+        uint64_t start = benchNow();
+        saveAppointmentsToFile(&store);
+        series.samples[series.count++] = benchNow() - start;
+    }
+    series.items = made * BENCH_FILE_REPEATS;
+    printSeries(out, &series, 0);
+    
+    // The snapshot now holds everything, so loading must not replay a log too
+    compactJournal(&store);
+    
+    startSeries(&series, "loadAppointmentsFromFile", BENCH_FILE_REPEATS);
+    for (int i = 0; i < BENCH_FILE_REPEATS; i++) {
+        AppointmentStore loaded = {0};
+        
+        uint64_t start = benchNow();
+        loadAppointmentsFromFile(&loaded);
+        series.samples[series.count++] = benchNow() - start;
+        
+        freeAppointmentStore(&loaded);
+    }
+    series.items = made * BENCH_FILE_REPEATS;
+    printSeries(out, &series, 0);
+    
+    // The whole set written out as CSV and read back into an empty store
+    startSeries(&series, "exportAppointments", BENCH_FILE_REPEATS);
+    for (int i = 0; i < BENCH_FILE_REPEATS; i++) {
+        FILE* csv = fopen(BENCH_CSV_FILE, "w");
+        if (csv == NULL) break;
+        setvbuf(csv, NULL, _IOFBF, CSV_BUFFER);
+        
+        uint64_t start = benchNow();
+        series.items += exportAppointments(&store, csv, ',');
+        fclose(csv);
+        series.samples[series.count++] = benchNow() - start;
+    }
+    printSeries(out, &series, 0);
+    
+    // Every exported row must be imported again, or the timings are of rejections
+    size_t refused = 0;
+    startSeries(&series, "importAppointments", BENCH_FILE_REPEATS);
+    for (int i = 0; i < BENCH_FILE_REPEATS; i++) {
+        AppointmentStore imported = {0};
+        size_t rejected;
+        loadDoctorsFromFile(&imported);
+        
+        FILE* csv = fopen(BENCH_CSV_FILE, "r");
+        if (csv == NULL) break;
+        setvbuf(csv, NULL, _IOFBF, CSV_BUFFER);
+        
+        uint64_t start = benchNow();
+        series.items += importAppointments(&imported, csv, NULL, &rejected);
+        series.samples[series.count++] = benchNow() - start;
+        refused += rejected;
+        
+        fclose(csv);
+        freeAppointmentStore(&imported);
+    }
+    printSeries(out, &series, 0);
+    
+    startSeries(&series, "deleteAppointment", made);
+    for (size_t i = 0; i < made; i++) {
+        uint64_t start = benchNow();
+        cancelAppointment(&store, bookings[i].date, bookings[i].hour, bookings[i].minute, bookings[i].doctor);
+        series.samples[series.count++] = benchNow() - start;
+    }
+    printSeries(out, &series, 1);
+    
+    fprintf(out, "    ]}%s\n", last ? "" : ",");
+    fflush(out);
+    
+    store.journal.deferred = 0;
+    store.journal.records = 0;
+    closeJournal(&store.journal);
+    remove(JOURNAL_FILE);
+    remove(DATA_FILE);
+    remove(DOCTOR_FILE);
+    remove(SERIES_FILE);
+    remove(BENCH_CSV_FILE);
+    free(store.metrics);
+    freeAppointmentStore(&store);
+    free(bookings);
+    
+    if (refused > 0) {
+        printf("The import of %zu appointments rejected %zu rows.\n", made, refused / BENCH_FILE_REPEATS);
+        return 0;
+    }
+    return 1;
 }
+#endif
 
-void adminMenu(Appointment** appointmentList, User** userList) {
-    int choice;
+// Times the store operations on synthetic data sets of growing size and
+// prints the results as JSON. Runs in a scratch directory, leaving the
+// real data files alone. Options are given as name=value.
+int runBenchmark(int argc, char* argv[]) {
+#ifndef _WIN32
+    BenchConfig config = {BENCH_MIN_SIZE, BENCH_MAX_SIZE, BENCH_PER_DAY, 0, BENCH_USERS, BENCH_SKEW, 12345u, 0, BENCH_DOCTORS, 0};
     
-    while (1) {
-        printf("\n===== ADMIN MENU =====\n");
-        printf("1. View all appointments\n");
-        printf("2. Search appointments by name\n");
-        printf("3. Delete an appointment\n");
-        printf("4. Create a new user\n");
-        printf("5. Log out\n");
-        printf("Enter your choice: ");
+    for (int i = 0; i < argc; i++) {
+        const char* value = strchr(argv[i], '=');
+        size_t nameLength = value != NULL ? (size_t)(value - argv[i]) : 0;
+        int ok = value != NULL;
         
-        if (scanf("%d", &choice) != 1) {
-            printf("Invalid input. Please enter a number.\n");
-            clearInputBuffer();
-            continue;
+        if (ok) {
+            value++;
+            if (strncmp(argv[i], "min", nameLength) == 0 && nameLength == 3) {
+                config.minSize = strtoul(value, NULL, 10);
+            } else if (strncmp(argv[i], "max", nameLength) == 0 && nameLength == 3) {
+                config.maxSize = strtoul(value, NULL, 10);
+            } else if (strncmp(argv[i], "perday", nameLength) == 0 && nameLength == 6) {
+                config.perDay = atoi(value);
+            } else if (strncmp(argv[i], "days", nameLength) == 0 && nameLength == 4) {
+                config.days = atoi(value);
+            } else if (strncmp(argv[i], "users", nameLength) == 0 && nameLength == 5) {
+                config.users = atoi(value);
+            } else if (strncmp(argv[i], "skew", nameLength) == 0 && nameLength == 4) {
+                config.skew = atof(value);
+            } else if (strncmp(argv[i], "seed", nameLength) == 0 && nameLength == 4) {
+                config.seed = (uint32_t)strtoul(value, NULL, 10);
+            } else if (strncmp(argv[i], "journal", nameLength) == 0 && nameLength == 7) {
+                config.journal = atoi(value) != 0;
+            } else if (strncmp(argv[i], "doctors", nameLength) == 0 && nameLength == 7) {
+                config.doctors = atoi(value);
+            } else if (strncmp(argv[i], "metrics", nameLength) == 0 && nameLength == 7) {
+                config.metrics = atoi(value) != 0;
+            } else {
+                ok = 0;
+            }
         }
         
-        switch (choice) {
-            case 1:
-                displayAppointments(*appointmentList);
-                break;
-            case 2:
-                searchAppointmentByName(*appointmentList);
-                break;
-            case 3:
-                deleteAppointment(appointmentList);
-                saveAppointmentsToFile(*appointmentList);
-                break;
-            case 4:
-                addUser(userList);
-                saveUsersToFile(*userList);
-                break;
-            case 5:
-                printf("Logging out from admin account...\n");
-                return;
-            default:
-                printf("Invalid choice. Please try again.\n");
+        if (!ok) {
+            printf("Unknown benchmark option %s. Options: min= max= perday= days= users= skew= seed= journal=0|1 doctors= metrics=0|1\n", argv[i]);
+            return 0;
         }
     }
-}
-
-void displayAvailableSlots(Appointment* head, Date date) {
-    printf("\n===== AVAILABLE SLOTS FOR %02d/%02d/%04d =====\n", 
-           date.day, date.month, date.year);
     
-    int slotsAvailable = 0;
+    size_t placesPerDay = (size_t)STANDARD_SLOTS_PER_DAY * (config.doctors > 0 ? (size_t)config.doctors : 1);
+    if (config.minSize < 1 || config.maxSize < config.minSize || config.perDay < 1 ||
+        (size_t)config.perDay > placesPerDay || config.days < 0 || config.users < 1 || config.skew < 0 ||
+        config.seed == 0 || config.doctors < 0 || config.doctors > MAX_DOCTORS) {
+        printf("Benchmark options out of range.\n");
+        return 0;
+    }
+    if (config.days > 0 && config.maxSize > (size_t)config.days * placesPerDay) {
+        printf("%d days cannot hold %zu appointments.\n", config.days, config.maxSize);
+        return 0;
+    }
     
-    for (int hour = START_HOUR; hour <= END_HOUR; hour++) {
-        for (int minute = 0; minute < 60; minute += APPOINTMENT_DURATION) {
-            // Skip 17:30 as it's outside office hours
-            if (hour == END_HOUR && minute > 0) continue;
-            
-            if (isSlotAvailable(head, hour, minute, date)) {
-                printf("%02d:%02d\n", hour, minute);
-                slotsAvailable++;
-            }
-        }
+    // Only the days from tomorrow to the booking horizon can be booked
+    size_t bookableDays = (size_t)(horizonDay() - dayNumber(currentDate()));
+    if ((size_t)config.days > bookableDays || config.maxSize > bookableDays * placesPerDay) {
+        printf("Only %zu days can be booked ahead, holding %zu appointments; use fewer days or more doctors.\n",
+               bookableDays, bookableDays * placesPerDay);
+        return 0;
     }
     
-    if (slotsAvailable == 0) {
-        printf("No available slots for this date.\n");
+    char previous[4096];
+    char scratch[] = "/tmp/appointment-bench-XXXXXX";
+    if (getcwd(previous, sizeof(previous)) == NULL || mkdtemp(scratch) == NULL || chdir(scratch) != 0) {
+        printf("Could not set up a scratch directory.\n");
+        return 0;
     }
-}
-
-int isSlotAvailable(Appointment* head, int hour, int minute, Date date) {
-    Appointment* current = head;
     
-    while (current != NULL) {
-        if (compareDate(current->date, date) == 0 && 
-            current->hour == hour && current->minute == minute) {
-            return 0; // Slot is already booked
-        }
-        current = current->next;
+    // Cumulative weights 1/k^skew of patient k, for sampling who books
+    double* patientWeights = (double*)malloc((size_t)config.users * sizeof(double));
+    if (patientWeights == NULL) {
+        printf("Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
     }
     
-    return 1; // Slot is available
-}
-
-void freeAppointmentList(Appointment** head) {
-    Appointment* current = *head;
-    Appointment* next;
+    UserStore users = {0};
+    User user;
+    double sum = 0;
     
-    while (current != NULL) {
-        next = current->next;
-        free(current);
-        current = next;
+    for (int k = 0; k < config.users; k++) {
+        sum += 1.0 / pow(k + 1, config.skew);
+        patientWeights[k] = sum;
+        
+        memset(&user, 0, sizeof(user));
+        snprintf(user.username, MAX_NAME_LEN, "patient%d", k);
+        strcpy(user.password, "password");
+        insertUser(&users, &user);
     }
+    saveUsersToFile(&users);
     
-    *head = NULL;
-}
-
-void freeUserList(User** head) {
-    User* current = *head;
-    User* next;
+    FILE* out = stdout;
+    fprintf(out, "{\n  \"benchmark\": \"appointment\",\n");
+    fprintf(out, "  \"config\": {\"perDay\": %d, \"days\": %d, \"users\": %d, \"skew\": %.3f, "
+            "\"seed\": %u, \"journal\": %s, \"doctors\": %d, \"metrics\": %s},\n",
+            config.perDay, config.days, config.users, config.skew, config.seed, config.journal ? "true" : "false",
+            config.doctors, config.metrics ? "true" : "false");
+    fprintf(out, "  \"results\": [\n");
     
-    while (current != NULL) {
-        next = current->next;
-        free(current);
-        current = next;
+    int ok = 1;
+    for (size_t size = config.minSize; size <= config.maxSize && ok; size *= 10) {
+        ok = benchmarkSize(&config, size, patientWeights, out, size > config.maxSize / 10);
     }
     
-    *head = NULL;
+    fprintf(out, "  ]\n}\n");
+    
+    free(patientWeights);
+    freeUserStore(&users);
+    remove(USER_FILE);
+    
+    if (chdir(previous) != 0 || rmdir(scratch) != 0) {
+        printf("Could not remove %s.\n", scratch);
+    }
+    return ok;
+#else
+    (void)argc; (void)argv;
+    printf("The benchmark needs POSIX timers and is not available on this platform.\n");
+    return 0;
+#endif
 }
 
 Date getDate() {
@@ -835,41 +8840,81 @@ Date getDate() {
 }
 
 int isDateValid(Date date) {
-    // Basic validation
-    if (date.month < 1 || date.month > 12) {
-        printf("Invalid month. Please enter a month between 1 and 12.\n");
+    const char* problem = dateProblem(date);
+    
+    if (problem != NULL) {
+        printf("%s\n", problem);
         return 0;
     }
     
-    int daysInMonth[] = {0, 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    return 1;
+}
+
+// Says what is wrong with a booking date, or returns NULL if it is usable
+const char* dateProblem(Date date) {
+    const char* problem = calendarProblem(date);
+    if (problem != NULL) return problem;
     
-    // Check for leap year
-    if (date.month == 2 && ((date.year % 4 == 0 && date.year % 100 != 0) || date.year % 400 == 0)) {
-        daysInMonth[2] = 29;
+    // Check if date is in the past
+    Date today = currentDate();
+    if (compareDate(date, today) < 0) {
+        return "Cannot book appointments for past dates.";
     }
     
-    if (date.day < 1 || date.day > daysInMonth[date.month]) {
-        printf("Invalid day for the given month.\n");
-        return 0;
+    if (dayNumber(date) > horizonDay()) {
+        return "Cannot book appointments more than 10 years ahead.";
     }
     
-    // Get current date for comparison
+    return NULL;
+}
+
+// Day number of the last day that can be booked, MAX_BOOKING_YEARS from
+// today; the day indexes reach no further
+int32_t horizonDay() {
+    Date today = currentDate();
+    Date horizon = {today.day, today.month, today.year + MAX_BOOKING_YEARS};
+    if (calendarProblem(horizon) != NULL) horizon.day--; // 29 February
+    return dayNumber(horizon);
+}
+
+// Today's date on the local clock
+Date currentDate() {
     time_t now = time(NULL);
-    struct tm *local = localtime(&now);
+    struct tm local;
+#ifndef _WIN32
+    localtime_r(&now, &local); // Server threads validate dates concurrently
+#else
+    local = *localtime(&now);
+#endif
     
     Date today = {
-        .day = local->tm_mday,
-        .month = local->tm_mon + 1,  // tm_mon is 0-based
-        .year = local->tm_year + 1900  // tm_year is years since 1900
+        .day = local.tm_mday,
+        .month = local.tm_mon + 1,  // tm_mon is 0-based
+        .year = local.tm_year + 1900  // tm_year is years since 1900
     };
     
-    // Check if date is in the past
-    if (compareDate(date, today) < 0) {
-        printf("Cannot book appointments for past dates.\n");
-        return 0;
+    return today;
+}
+
+// Says what is wrong with a date regardless of when it is, or returns NULL
+const char* calendarProblem(Date date) {
+    // Basic validation
+    if (date.month < 1 || date.month > 12) {
+        return "Invalid month. Please enter a month between 1 and 12.";
     }
     
-    return 1;
+    int daysInMonth[] = {0, 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    
+    // Check for leap year
+    if (date.month == 2 && ((date.year % 4 == 0 && date.year % 100 != 0) || date.year % 400 == 0)) {
+        daysInMonth[2] = 29;
+    }
+    
+    if (date.day < 1 || date.day > daysInMonth[date.month]) {
+        return "Invalid day for the given month.";
+    }
+    
+    return NULL;
 }
 
 int compareDate(Date date1, Date date2) {
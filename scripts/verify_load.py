@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+"""Checks the parallel loader on a data file it is unlikely to meet by chance.
+
+Writes appointments.db in a scratch directory with more records than
+LOAD_PARALLEL_MIN (65536), in shuffled order and with duplicate keys (the
+same date, time and doctor, some with the same name too), plus a few
+doctors, then runs the program there with --verify-load on several
+threads. The exit status is the program's: 0 when the store loaded on one
+thread and on several is identical.
+
+    python3 scripts/verify_load.py ./appointment [records [threads [seed]]]
+"""
+
+import os
+import random
+import struct
+import subprocess
+import sys
+import tempfile
+
+# Must match appointment.c
+MAX_NAME_LEN = 50
+MAX_PASS_LEN = 50
+ENCRYPTION_KEY = 3
+FILE_FORMAT_VERSION = 1
+FILE_ENDIAN_MARK = 0x01020304
+APPOINTMENT_FILE_MAGIC = 0x54505041
+DOCTOR_FILE_MAGIC = 0x53524344
+HEADER = struct.Struct("<IIIIQII")  # FileHeader
+RECORD = struct.Struct("<5i%ds%ds2i" % (MAX_NAME_LEN, MAX_NAME_LEN))  # AppointmentRecord
+DOCTORS = ["house", "grey", "quinn"]
+
+
+def text(value):
+    """An encrypted, NUL-padded name field, as the program stores it."""
+    data = bytes(ord(c) + ENCRYPTION_KEY for c in value)
+    return data.ljust(MAX_NAME_LEN, b"\0")
+
+
+def header(magic, record_size, count):
+    return HEADER.pack(magic, FILE_FORMAT_VERSION, FILE_ENDIAN_MARK, record_size, count, MAX_NAME_LEN,
+                       MAX_PASS_LEN)
+
+
+def make_records(count, rng):
+    records = []
+    while len(records) < count:
+        day, month, year = rng.randint(1, 28), rng.randint(1, 12), rng.randint(2027, 2031)
+        slot = rng.randrange(17)
+        record = [day, month, year, 9 + slot // 2, slot % 2 * 30, "patient%d" % rng.randrange(5000),
+                  rng.choice(["checkup", "flu", "fracture"]), rng.randrange(len(DOCTORS) + 1), rng.choice([30, 60])]
+        records.append(record)
+
+        # Roughly one record in eight has the key of an earlier one
+        if rng.random() < 0.125 and len(records) < count:
+            twin = list(rng.choice(records))
+            if rng.random() < 0.5:
+                twin[5] = "patient%d" % rng.randrange(5000)
+            records.append(twin)
+
+    rng.shuffle(records)
+    return records
+
+
+def main():
+    if len(sys.argv) < 2:
+        print(__doc__.strip().splitlines()[-1].strip())
+        return 2
+
+    program = os.path.abspath(sys.argv[1])
+    count = int(sys.argv[2]) if len(sys.argv) > 2 else 200000
+    threads = int(sys.argv[3]) if len(sys.argv) > 3 else 4
+    rng = random.Random(int(sys.argv[4]) if len(sys.argv) > 4 else 1)
+
+    with tempfile.TemporaryDirectory(prefix="appointment-load-") as scratch:
+        with open(os.path.join(scratch, "doctors.db"), "wb") as doctors:
+            doctors.write(header(DOCTOR_FILE_MAGIC, MAX_NAME_LEN, len(DOCTORS)))
+            for name in DOCTORS:
+                doctors.write(name.encode().ljust(MAX_NAME_LEN, b"\0"))
+
+        with open(os.path.join(scratch, "appointments.db"), "wb") as data:
+            data.write(header(APPOINTMENT_FILE_MAGIC, RECORD.size, count))
+            for day, month, year, hour, minute, name, illness, doctor, duration in make_records(count, rng):
+                data.write(RECORD.pack(day, month, year, hour, minute, text(name), text(illness), doctor, duration))
+
+        print("Wrote %d records, shuffled and with duplicate keys." % count)
+        sys.stdout.flush()
+        return subprocess.call([program, "--load-threads", str(threads), "--verify-load"], cwd=scratch)
+
+
+if __name__ == "__main__":
+    sys.exit(main())